@@ -8,13 +8,17 @@ LIST(APPEND CMAKE_MODULE_PATH "${CMAKE_SOURCE_DIR}/cmake/modules")
 FIND_PACKAGE(APACHE REQUIRED)
 FIND_PACKAGE(APR REQUIRED)
 
+## zlib is required for permessage-deflate
+FIND_PACKAGE(ZLIB REQUIRED)
+
 ## Necessary Includes
 INCLUDE_DIRECTORIES(${APACHE_INCLUDE_DIR})
 INCLUDE_DIRECTORIES(${APR_INCLUDE_DIR})
+INCLUDE_DIRECTORIES(${ZLIB_INCLUDE_DIRS})
 
 ## Create The mod_websocket.so
 ADD_LIBRARY(mod_websocket MODULE mod_websocket.c)
-TARGET_LINK_LIBRARIES(mod_websocket ${APR_LIBRARIES})
+TARGET_LINK_LIBRARIES(mod_websocket ${APR_LIBRARIES} ${ZLIB_LIBRARIES})
 
 SET_TARGET_PROPERTIES(mod_websocket
                       PROPERTIES
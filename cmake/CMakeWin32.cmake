@@ -30,11 +30,14 @@ ELSE()
 ENDIF()
 
 SET(default_httpd_libraries ${CMAKE_INSTALL_PREFIX}/lib/libhttpd.lib)
+SET(default_zlib_libraries ${CMAKE_INSTALL_PREFIX}/lib/zlib.lib)
 
 SET(APR_INCLUDE_DIR    "${CMAKE_INSTALL_PREFIX}/include" CACHE PATH   "Directory with APR[-Util] include files")
 SET(APR_LIBRARIES      ${default_apr_libraries}          CACHE STRING "APR libraries to link with")
 SET(HTTPD_INCLUDE_DIR  "${CMAKE_INSTALL_PREFIX}/include" CACHE PATH   "Directory with HTTPD include files")
 SET(HTTPD_LIBRARIES    ${default_httpd_libraries}        CACHE STRING "HTTPD libraries to link with")
+SET(ZLIB_INCLUDE_DIR   "${CMAKE_INSTALL_PREFIX}/include" CACHE PATH   "Directory with the zlib include files")
+SET(ZLIB_LIBRARIES     ${default_zlib_libraries}         CACHE STRING "zlib libraries to link with")
 SET(MODULE_INSTALL_DIR "${CMAKE_INSTALL_PREFIX}/modules" CACHE PATH   "Directory to install the module into")
 
 #
@@ -59,6 +62,15 @@ FOREACH(onelib ${HTTPD_LIBRARIES})
   ENDIF()
 ENDFOREACH()
 
+IF(NOT EXISTS "${ZLIB_INCLUDE_DIR}/zlib.h")
+  MESSAGE(FATAL_ERROR "zlib include directory ${ZLIB_INCLUDE_DIR} is not correct.")
+ENDIF()
+FOREACH(onelib ${ZLIB_LIBRARIES})
+  IF(NOT EXISTS ${onelib})
+    MESSAGE(FATAL_ERROR "zlib library ${onelib} was not found.")
+  ENDIF()
+ENDFOREACH()
+
 IF(NOT EXISTS "${MODULE_INSTALL_DIR}")
   MESSAGE(WARNING "Module installation directory ${MODULE_INSTALL_DIR} does not exist.")
 ENDIF()
@@ -67,14 +79,14 @@ ENDIF()
 # Module Definition and Compilation
 #
 
-INCLUDE_DIRECTORIES(${APR_INCLUDE_DIR} ${HTTPD_INCLUDE_DIR} ${PROJECT_SOURCE_DIR})
+INCLUDE_DIRECTORIES(${APR_INCLUDE_DIR} ${HTTPD_INCLUDE_DIR} ${ZLIB_INCLUDE_DIR} ${PROJECT_SOURCE_DIR})
 
 ADD_LIBRARY(mod_websocket SHARED mod_websocket.c)
 SET_TARGET_PROPERTIES(mod_websocket
                       PROPERTIES
                       SUFFIX ".so")
 
-TARGET_LINK_LIBRARIES(mod_websocket ${APR_LIBRARIES} ${HTTPD_LIBRARIES})
+TARGET_LINK_LIBRARIES(mod_websocket ${APR_LIBRARIES} ${HTTPD_LIBRARIES} ${ZLIB_LIBRARIES})
 
 IF(BUILD_EXAMPLES)
   ADD_LIBRARY(mod_websocket_echo           MODULE examples/mod_websocket_echo.c)
@@ -16,39 +16,36 @@
 
 #include <stdio.h>
 #include "httpd.h"
-#include "apr_thread_proc.h"
 
 #include "websocket_plugin.h"
 
 typedef struct _DumbIncrementData {
   const WebSocketServer *server;
   apr_pool_t *pool;
-  apr_thread_t *thread;
+  struct _WebSocketTimer *timer;
   int counter;
-  int active;
 } DumbIncrementData;
 
-void* APR_THREAD_FUNC dumb_increment_run(apr_thread_t *thread, void *data)
+/*
+ * Called on the connection's own thread every 50ms, so the message is written
+ * immediately without any locking or queueing.
+ */
+void CALLBACK dumb_increment_tick(const WebSocketServer *server, void *data)
 {
   char buffer[64];
   DumbIncrementData *dib = (DumbIncrementData *) data;
 
   if (dib != NULL) {
-    /* Keep sending messages as long as the connection is active */
-    while (dib->active) {
-      apr_sleep(50000); /* 50ms */
-      sprintf(buffer,"%d", dib->counter++);
-      dib->server->send(dib->server, MESSAGE_TYPE_TEXT, (unsigned char *)buffer, strlen(buffer));
-    }
+    sprintf(buffer,"%d", dib->counter++);
+    server->send(server, MESSAGE_TYPE_TEXT, (unsigned char *)buffer, strlen(buffer));
   }
-  return NULL;
 }
 
 void * CALLBACK dumb_increment_on_connect(const WebSocketServer *server)
 {
   DumbIncrementData *dib = NULL;
 
-  if ((server != NULL) && (server->version == WEBSOCKET_SERVER_VERSION_1)) {
+  if ((server != NULL) && (server->version >= WEBSOCKET_SERVER_VERSION_2)) {
     /* Get access to the request_rec strucure for this connection */
     request_rec *r = server->request(server);
 
@@ -72,20 +69,13 @@ void * CALLBACK dumb_increment_on_connect(const WebSocketServer *server)
           (apr_pool_create(&pool, r->pool) == APR_SUCCESS)) {
         /* Allocate memory to hold the dumb increment state */
         if ((dib = (DumbIncrementData *) apr_palloc(pool, sizeof(DumbIncrementData))) != NULL) {
-          apr_thread_t *thread = NULL;
-          apr_threadattr_t *thread_attr = NULL;
-
           dib->server = server;
           dib->pool = pool;
-          dib->thread = NULL;
           dib->counter = 0;
-          dib->active = 1;
 
-          /* Create a non-detached thread that will perform the work */
-          if ((apr_threadattr_create(&thread_attr, pool) == APR_SUCCESS) &&
-              (apr_threadattr_detach_set(thread_attr, 0) == APR_SUCCESS) &&
-              (apr_thread_create(&thread, thread_attr, dumb_increment_run, dib, pool) == APR_SUCCESS)) {
-            dib->thread = thread;
+          /* Start a timer that will perform the work */
+          dib->timer = server->timer_add(server, 50, dumb_increment_tick, dib); /* 50ms */
+          if (dib->timer != NULL) {
             /* Success */
             pool = NULL;
           } else {
@@ -125,14 +115,8 @@ void CALLBACK dumb_increment_on_disconnect(void *plugin_private, const WebSocket
   DumbIncrementData *dib = (DumbIncrementData *) plugin_private;
 
   if (dib != 0) {
-    /* When disconnecting, inform the thread that it is time to stop */
-    dib->active = 0;
-    if (dib->thread) {
-      apr_status_t status;
-
-      /* Wait for the thread to finish */
-      status = apr_thread_join(&status, dib->thread);
-    }
+    /* When disconnecting, stop the timer */
+    server->timer_cancel(server, dib->timer);
     apr_pool_destroy(dib->pool);
   }
 }
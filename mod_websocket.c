@@ -29,18 +29,29 @@
  *   Apache API inteface structures
  */
 
+#include "apr_atomic.h"
 #include "apr_base64.h"
+#include "apr_file_io.h"
+#include "apr_global_mutex.h"
 #include "apr_lib.h"
+#include "apr_mmap.h"
+#include "apr_portable.h"
 #include "apr_queue.h"
 #include "apr_sha1.h"
+#include "apr_shm.h"
 #include "apr_strings.h"
 #include "apr_thread_cond.h"
+#include "apr_thread_proc.h"
 
+/* struct iovec for the direct output path, which Windows doesn't define. */
+#define APR_WANT_IOVEC
+#include "apr_want.h"
+
+#include "ap_mpm.h"
 #include "httpd.h"
 #include "http_config.h"
 #include "http_log.h"
 #include "http_protocol.h"
-#include "util_varbuf.h"
 
 #include "websocket_plugin.h"
 #include "mod_websocket_hook_export.h"
@@ -50,6 +61,37 @@
 #include "http_core.h"
 #include "http_connection.h"
 
+#if APR_HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <limits.h>
+#include <zlib.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/* Large prepared frames can be sent without copying them into the kernel. */
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY 1
+#endif
+
+/* Bus readers can sleep until a publisher wakes them, instead of polling. */
+#if defined(SYS_futex) && defined(FUTEX_WAIT) && defined(FUTEX_WAKE)
+#define HAVE_BUS_FUTEX 1
+#endif
+
 #if !defined(APR_ARRAY_IDX)
 #define APR_ARRAY_IDX(ary,i,type) (((type *)(ary)->elts)[i])
 #endif
@@ -61,6 +103,9 @@ module AP_MODULE_DECLARE_DATA websocket_module;
 
 #ifdef APLOG_USE_MODULE /* only in Apache 2.4 */
 APLOG_USE_MODULE(websocket);
+
+#include "util_mutex.h"
+#define HAVE_BROADCAST_BUS 1 /* needs the 2.4 mutex API */
 #endif
 
 #ifndef APLOG_TRACE1 /* not defined in Apache 2.2 */
@@ -76,6 +121,21 @@ typedef struct
     int allow_reserved; /* whether to allow reserved status codes */
     int origin_check;   /* how to check the Origin during a handshake */
     apr_hash_t *trusted_origins; /* allowlist for ORIGIN_CHECK_TRUSTED */
+    apr_interval_time_t busy_poll; /* how long to spin before blocking in poll */
+    int kernel_busy_poll; /* whether to also set SO_BUSY_POLL on the socket */
+    apr_interval_time_t ping_interval; /* quiet time before a keepalive ping */
+    apr_interval_time_t idle_timeout;  /* close if no message for this long */
+    int deflate; /* whether to negotiate permessage-deflate */
+    apr_size_t deflate_min_size; /* send smaller messages uncompressed */
+    apr_size_t max_pending_bytes; /* close if more is published but unsent */
+    apr_interval_time_t max_send_delay; /* close if a message waits this long */
+    apr_size_t low_watermark; /* call on_writable once pending drops below */
+    apr_int64_t message_rate; /* messages per second from the client, or 0 */
+    apr_int64_t byte_rate;    /* bytes per second from the client, or 0 */
+    apr_int64_t control_rate; /* control frames per second, or 0 */
+    int rate_limit_close;     /* close, rather than delay, clients over a limit */
+    apr_int64_t spill_threshold; /* larger messages go to a temp file, or 0 */
+    apr_size_t zerocopy_min_size; /* send larger frames with MSG_ZEROCOPY */
 } websocket_config_rec;
 
 /* Possible config values for websocket_config_rec->origin_check */
@@ -84,9 +144,28 @@ typedef struct
 #define ORIGIN_CHECK_TRUSTED 2 /* Origin must be on the WebSocketTrustedOrigin list */
 
 #define BLOCK_DATA_SIZE              4096
+#define SPILL_CHUNK_SIZE             65536 /* written to the temp file at once */
+#define FILE_CHUNK_SIZE              65536 /* compressed by send_file() at once */
 
 #define QUEUE_CAPACITY                 16
 
+#define READ_BATCH_BLOCKS              16
+
+#define DEFLATE_MIN_SIZE               64
+#define LOW_WATERMARK                  65536
+#define DEFLATE_BACKOFF_MESSAGES       16
+
+#define BUS_MIN_SIZE                   65536
+#define BUS_ALIGN                      32   /* the size of a record header */
+#define BUS_POLL_INTERVAL              1000   /* microseconds, at first */
+#define BUS_POLL_INTERVAL_MAX          100000 /* once idle for a while */
+#define BUS_MUTEX_TYPE                 "websocket-bus"
+
+#define FRAME_HEADER_MAX               14
+#define DIRECT_FRAMES_MAX              (QUEUE_CAPACITY + 2)
+#define ZEROCOPY_REAPER_FDS            64  /* sockets polled at once */
+#define ZEROCOPY_REAPER_INTERVAL       100 /* milliseconds */
+
 #define DATA_FRAMING_MASK               0
 #define DATA_FRAMING_START              1
 #define DATA_FRAMING_PAYLOAD_LENGTH     2
@@ -103,6 +182,7 @@ typedef struct
 #define FRAME_GET_PAYLOAD_LEN(BYTE) ( (BYTE)       & 0x7F)
 
 #define FRAME_SET_FIN(BYTE)         (((BYTE) & 0x01) << 7)
+#define FRAME_SET_RSV1(BYTE)        (((BYTE) & 0x01) << 6)
 #define FRAME_SET_OPCODE(BYTE)       ((BYTE) & 0x0F)
 #define FRAME_SET_MASK(BYTE)        (((BYTE) & 0x01) << 7)
 #define FRAME_SET_LENGTH(X64, IDX)  (unsigned char)(((X64) >> ((IDX)*8)) & 0xFF)
@@ -114,6 +194,8 @@ typedef struct
 #define OPCODE_PING         0x9
 #define OPCODE_PONG         0xA
 
+#define CONTROL_PAYLOAD_MAX 125 /* RFC 6455, section 5.5 */
+
 #define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 #define WEBSOCKET_GUID_LEN 36
 
@@ -150,6 +232,8 @@ static void *mod_websocket_create_dir_config(apr_pool_t *p, char *path)
             conf->message_limit = 32 * 1024 * 1024;
             conf->origin_check = ORIGIN_CHECK_SAME;
             conf->trusted_origins = apr_hash_make(p);
+            conf->deflate_min_size = DEFLATE_MIN_SIZE;
+            conf->low_watermark = LOW_WATERMARK;
         }
     }
     return (void *)conf;
@@ -186,6 +270,25 @@ static const char *mod_websocket_conf_allow_reserved(cmd_parms *cmd,
     return NULL;
 }
 
+/* Returns the size of the plugin struct as of the given version. */
+static apr_size_t plugin_size(unsigned int version)
+{
+    if (version == WEBSOCKET_PLUGIN_VERSION_0) {
+        return APR_OFFSETOF(WebSocketPlugin, on_writable);
+    }
+    if (version == WEBSOCKET_PLUGIN_VERSION_1) {
+        return APR_OFFSETOF(WebSocketPlugin, on_message_iov);
+    }
+    return sizeof(WebSocketPlugin);
+}
+
+/* Returns 1 if the plugin takes messages in pieces, with on_message_iov(). */
+static int plugin_takes_iov(const WebSocketPlugin *plugin)
+{
+    return (plugin->version >= WEBSOCKET_PLUGIN_VERSION_2) &&
+           (plugin->on_message_iov != NULL);
+}
+
 static const char *mod_websocket_conf_handler(cmd_parms *cmd, void *confv,
                                               const char *path,
                                               const char *name)
@@ -225,14 +328,14 @@ static const char *mod_websocket_conf_handler(cmd_parms *cmd, void *confv,
     if (!plugin) {
         errmsg = "returned NULL";
     }
-    else if (plugin->version != WEBSOCKET_PLUGIN_VERSION_0) {
+    else if (plugin->version > WEBSOCKET_PLUGIN_VERSION_2) {
         errmsg = apr_psprintf(cmd->pool, "unsupported plugin version %u",
                               plugin->version);
     }
-    else if (plugin->size < sizeof(WebSocketPlugin)) {
+    else if (plugin->size < plugin_size(plugin->version)) {
         errmsg = "invalid plugin size; check plugin version and compiler";
     }
-    else if (!plugin->on_message) {
+    else if (!plugin->on_message && !plugin_takes_iov(plugin)) {
         errmsg = "on_message handler is NULL";
     }
 
@@ -334,276 +437,3905 @@ static const char *mod_websocket_conf_max_message_size(cmd_parms *cmd,
     return response;
 }
 
-/*
- * Functions available to plugins.
- */
-
-typedef struct _WebSocketState
+static const char *mod_websocket_conf_deflate(cmd_parms *cmd, void *confv,
+                                              int on)
 {
-    request_rec *r;
-    apr_bucket_brigade *obb;
-    apr_os_thread_t main_thread;
-    apr_thread_mutex_t *mutex;
-    apr_thread_cond_t *cond;
-    apr_array_header_t *protocols;
-    int closing;
-    apr_int64_t protocol_version;
-    apr_pollset_t *pollset;
-    apr_queue_t *queue;
-} WebSocketState;
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
 
-static request_rec *CALLBACK mod_websocket_request(const WebSocketServer *server)
+    if (conf != NULL) {
+        conf->deflate = on;
+    }
+
+    return NULL;
+}
+
+static const char *mod_websocket_conf_deflate_min_size(cmd_parms *cmd,
+                                                      void *confv,
+                                                      const char *size)
 {
-    if ((server != NULL) && (server->state != NULL)) {
-        return server->state->r;
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+    apr_int64_t min_size = apr_atoi64(size);
+
+    if ((min_size < 0) || (min_size > APR_SIZE_MAX)) {
+        return "Invalid WebSocketDeflateMinSize";
     }
+
+    if (conf != NULL) {
+        conf->deflate_min_size = (apr_size_t) min_size;
+    }
+
     return NULL;
 }
 
-static const char *CALLBACK mod_websocket_header_get(const WebSocketServer *server,
-                                                     const char *key)
+static const char *mod_websocket_conf_spill_threshold(cmd_parms *cmd,
+                                                     void *confv,
+                                                     const char *size)
 {
-    if ((server != NULL) && (key != NULL)) {
-        WebSocketState *state = server->state;
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+    apr_int64_t threshold = apr_atoi64(size);
 
-        if ((state != NULL) && (state->r != NULL)) {
-            return apr_table_get(state->r->headers_in, key);
-        }
+    if ((threshold < 0) || (threshold > APR_SIZE_MAX)) {
+        return "Invalid WebSocketSpillThreshold";
     }
+
+    if (conf != NULL) {
+        conf->spill_threshold = threshold;
+    }
+
     return NULL;
 }
 
-static void CALLBACK mod_websocket_header_set(const WebSocketServer *server,
-                                              const char *key,
-                                              const char *value)
+static const char *mod_websocket_conf_zerocopy_min_size(cmd_parms *cmd,
+                                                       void *confv,
+                                                       const char *size)
 {
-    if ((server != NULL) && (key != NULL) && (value != NULL)) {
-        WebSocketState *state = server->state;
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+    apr_int64_t min_size = apr_atoi64(size);
 
-        if ((state != NULL) && (state->r != NULL)) {
-            apr_table_setn(state->r->headers_out,
-                           apr_pstrdup(state->r->pool, key),
-                           apr_pstrdup(state->r->pool, value));
-        }
+    if ((min_size < 0) || (min_size > APR_SIZE_MAX)) {
+        return "Invalid WebSocketZeroCopyMinSize";
+    }
+
+    if (conf != NULL) {
+        conf->zerocopy_min_size = (apr_size_t) min_size;
     }
+
+    return NULL;
 }
 
-static size_t CALLBACK mod_websocket_protocol_count(const WebSocketServer *server)
+static const char *mod_websocket_conf_max_pending_bytes(cmd_parms *cmd,
+                                                        void *confv,
+                                                        const char *size)
 {
-    size_t count = 0;
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+    apr_int64_t max_pending = apr_atoi64(size);
 
-    if ((server != NULL) && (server->state != NULL) &&
-        (server->state->protocols != NULL) &&
-        !apr_is_empty_array(server->state->protocols)) {
-        count = (size_t) server->state->protocols->nelts;
+    if ((max_pending < 0) || (max_pending > APR_SIZE_MAX)) {
+        return "Invalid WebSocketMaxPendingBytes";
     }
-    return count;
+
+    if (conf != NULL) {
+        conf->max_pending_bytes = (apr_size_t) max_pending;
+    }
+
+    return NULL;
 }
 
-static const char *CALLBACK mod_websocket_protocol_index(const WebSocketServer *server,
-                                                         const size_t index)
+static const char *mod_websocket_conf_low_watermark(cmd_parms *cmd,
+                                                    void *confv,
+                                                    const char *size)
 {
-    if ((index >= 0) && (index < mod_websocket_protocol_count(server))) {
-        return APR_ARRAY_IDX(server->state->protocols, index, char *);
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+    apr_int64_t watermark = apr_atoi64(size);
+
+    if ((watermark <= 0) || (watermark > APR_SIZE_MAX)) {
+        return "Invalid WebSocketLowWatermark";
+    }
+
+    if (conf != NULL) {
+        conf->low_watermark = (apr_size_t) watermark;
     }
+
     return NULL;
 }
 
-static void CALLBACK mod_websocket_protocol_set(const WebSocketServer *server,
-                                                const char *protocol)
+/* Parses a per-second rate limit for the WebSocket*RateLimit directives. */
+static apr_status_t parse_rate(const char *arg, apr_int64_t *rate)
 {
-    if ((server != NULL) && (protocol != NULL)) {
-        WebSocketState *state = server->state;
+    char *end;
 
-        if ((state != NULL) && (state->r != NULL)) {
-            apr_table_setn(state->r->headers_out, "Sec-WebSocket-Protocol",
-                           apr_pstrdup(state->r->pool, protocol));
-        }
+    *rate = apr_strtoi64(arg, &end, 10);
+    if ((end == arg) || *end || (*rate < 0) || (*rate > APR_INT32_MAX)) {
+        return APR_EGENERAL;
     }
+
+    return APR_SUCCESS;
 }
 
-/*
- * Sends data to the WebSocket connection using the given server state. The
- * server state must be locked upon entering this function. buffer_size is
- * assumed to be within the limits defined by the WebSocket protocol (i.e. fits
- * in 63 bits).
- */
-static size_t mod_websocket_send_internal(WebSocketState *state,
-                                          const int type,
-                                          const unsigned char *buffer,
-                                          const size_t buffer_size)
+static const char *mod_websocket_conf_message_rate(cmd_parms *cmd, void *confv,
+                                                   const char *arg)
 {
-    apr_uint64_t payload_length =
-        (apr_uint64_t) ((buffer != NULL) ? buffer_size : 0);
-    size_t written = 0;
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+    apr_int64_t rate;
 
-    if ((state->r != NULL) && (state->obb != NULL) && !state->closing) {
-        unsigned char header[32];
-        ap_filter_t *of = state->r->connection->output_filters;
-        apr_size_t pos = 0;
-        unsigned char opcode;
+    if (parse_rate(arg, &rate) != APR_SUCCESS) {
+        return "Invalid WebSocketMessageRateLimit";
+    }
 
-        switch (type) {
-        case MESSAGE_TYPE_TEXT:
-            opcode = OPCODE_TEXT;
-            break;
-        case MESSAGE_TYPE_BINARY:
-            opcode = OPCODE_BINARY;
-            break;
-        case MESSAGE_TYPE_PING:
-            opcode = OPCODE_PING;
-            break;
-        case MESSAGE_TYPE_PONG:
-            opcode = OPCODE_PONG;
-            break;
-        case MESSAGE_TYPE_CLOSE:
-        default:
-            state->closing = 1;
-            opcode = OPCODE_CLOSE;
-            break;
-        }
-        header[pos++] = FRAME_SET_FIN(1) | FRAME_SET_OPCODE(opcode);
-        if (payload_length < 126) {
-            header[pos++] =
-                FRAME_SET_MASK(0) | FRAME_SET_LENGTH(payload_length, 0);
-        }
-        else {
-            if (payload_length < 65536) {
-                header[pos++] = FRAME_SET_MASK(0) | 126;
-            }
-            else {
-                header[pos++] = FRAME_SET_MASK(0) | 127;
-                header[pos++] = FRAME_SET_LENGTH(payload_length, 7);
-                header[pos++] = FRAME_SET_LENGTH(payload_length, 6);
-                header[pos++] = FRAME_SET_LENGTH(payload_length, 5);
-                header[pos++] = FRAME_SET_LENGTH(payload_length, 4);
-                header[pos++] = FRAME_SET_LENGTH(payload_length, 3);
-                header[pos++] = FRAME_SET_LENGTH(payload_length, 2);
-            }
-            header[pos++] = FRAME_SET_LENGTH(payload_length, 1);
-            header[pos++] = FRAME_SET_LENGTH(payload_length, 0);
-        }
-        ap_fwrite(of, state->obb, (const char *)header, pos); /* Header */
-        if (payload_length > 0) {
-            if (ap_fwrite(of, state->obb,
-                          (const char *)buffer,
-                          buffer_size) == APR_SUCCESS) { /* Payload Data */
-                written = buffer_size;
-            }
-        }
-        if (ap_fflush(of, state->obb) != APR_SUCCESS) {
-            written = 0;
-        }
+    if (conf != NULL) {
+        conf->message_rate = rate;
     }
 
-    return written;
+    return NULL;
 }
 
-typedef struct
+static const char *mod_websocket_conf_byte_rate(cmd_parms *cmd, void *confv,
+                                                const char *arg)
 {
-    int type;
-    const unsigned char * buffer;
-    size_t buffer_size;
-    int done;
-    size_t written;
-} WebSocketMessageData;
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+    apr_int64_t rate;
 
-/*
- * Sends a buffer of data via the WebSocket. Returns the number of bytes that
- * are actually written.
- *
- * If this function is called from a different thread than the one running the
- * main framing loop, the message will be queued and the calling thread will
- * block until the data is written by the main thread.
- */
-static size_t CALLBACK mod_websocket_plugin_send(const WebSocketServer *server,
-                                                 const int type,
-                                                 const unsigned char *buffer,
-                                                 const size_t buffer_size)
-{
-    size_t written = 0;
+    if (parse_rate(arg, &rate) != APR_SUCCESS) {
+        return "Invalid WebSocketByteRateLimit";
+    }
 
-    /* Deal with size more that 63 bits - FIXME */
-    /* FIXME - if sending a zero-length message, the API cannot distinguish
-     * between success and failure */
-    if ((server != NULL) && (server->state != NULL)) {
-        WebSocketState *state = server->state;
+    if (conf != NULL) {
+        conf->byte_rate = rate;
+    }
 
-        apr_thread_mutex_lock(state->mutex);
+    return NULL;
+}
 
-        if (apr_os_thread_equal(apr_os_thread_current(), state->main_thread)) {
-            /* This is the main thread. It's safe to write messages directly. */
-            written = mod_websocket_send_internal(state, type, buffer, buffer_size);
-        }
-        else if ((state->pollset != NULL) && (state->queue != NULL) &&
-                 !state->closing) {
-            /* Dispatch this message to the main thread. */
-            apr_status_t rv;
-            WebSocketMessageData msg = { 0 };
+static const char *mod_websocket_conf_control_rate(cmd_parms *cmd, void *confv,
+                                                   const char *arg)
+{
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+    apr_int64_t rate;
 
-            /* Populate the message data. */
-            msg.type = type;
-            msg.buffer = buffer;
-            msg.buffer_size = buffer_size;
+    if (parse_rate(arg, &rate) != APR_SUCCESS) {
+        return "Invalid WebSocketControlRateLimit";
+    }
 
-            /* Queue the message. */
-            do {
-                rv = apr_queue_push(state->queue, &msg);
-            } while (APR_STATUS_IS_EINTR(rv));
+    if (conf != NULL) {
+        conf->control_rate = rate;
+    }
 
-            if (rv != APR_SUCCESS) {
-                /* Couldn't push the message onto the queue. */
-                goto send_unlock;
-            }
+    return NULL;
+}
 
-            /* Interrupt the pollset. */
-            rv = apr_pollset_wakeup(state->pollset);
+static const char *mod_websocket_conf_rate_limit_action(cmd_parms *cmd,
+                                                        void *confv,
+                                                        const char *action)
+{
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
 
-            if (rv != APR_SUCCESS) {
-                /*
-                 * Couldn't wake up poll...? We can't return zero since we've
-                 * already pushed the message, and it might actually be sent...
-                 */
-                /* TODO: log. */
-            }
+    if (conf) {
+        if (!strcasecmp(action, "Delay")) {
+            conf->rate_limit_close = 0;
+        } else if (!strcasecmp(action, "Close")) {
+            conf->rate_limit_close = 1;
+        } else {
+            return "WebSocketRateLimitAction must be Delay or Close";
+        }
+    }
 
-            /* Wait for the message to be written. */
-            while (!msg.done && !state->closing) {
-                apr_thread_cond_wait(state->cond, state->mutex);
-            }
+    return NULL;
+}
 
-            if (msg.done) {
-                written = msg.written;
-            }
-        }
+static apr_size_t zstream_memory_limit; /* WebSocketDeflateMemoryLimit */
 
-send_unlock:
-        apr_thread_mutex_unlock(state->mutex);
+static const char *mod_websocket_conf_deflate_memory_limit(cmd_parms *cmd,
+                                                           void *dummy,
+                                                           const char *size)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_int64_t limit;
+
+    if (err != NULL) {
+        return err;
     }
 
-    return written;
+    limit = apr_atoi64(size);
+    if ((limit < 0) || (limit > APR_SIZE_MAX)) {
+        return "Invalid WebSocketDeflateMemoryLimit";
+    }
+
+    zstream_memory_limit = (apr_size_t) limit;
+    return NULL;
 }
 
+static apr_size_t buffered_memory_limit; /* WebSocketMaxBufferedMemory */
 
-static void CALLBACK mod_websocket_plugin_close(const WebSocketServer *
-                                                server)
+static const char *mod_websocket_conf_max_buffered_memory(cmd_parms *cmd,
+                                                          void *dummy,
+                                                          const char *size)
 {
-    if (server != NULL) {
-        /* Send closing handshake */
-        mod_websocket_plugin_send(server, MESSAGE_TYPE_CLOSE, NULL, 0);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_int64_t limit;
+
+    if (err != NULL) {
+        return err;
     }
-}
+
+    limit = apr_atoi64(size);
+    if ((limit < 0) || (limit > APR_SIZE_MAX)) {
+        return "Invalid WebSocketMaxBufferedMemory";
+    }
+
+    buffered_memory_limit = (apr_size_t) limit;
+    return NULL;
+}
+
+static apr_size_t bus_size; /* WebSocketBroadcastBusSize */
+
+static const char *mod_websocket_conf_bus_size(cmd_parms *cmd, void *dummy,
+                                               const char *size)
+{
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    apr_int64_t requested;
+
+    if (err != NULL) {
+        return err;
+    }
+
+    requested = apr_atoi64(size);
+    if ((requested < 0) || (requested > (APR_INT64_C(1) << 30))) {
+        return "Invalid WebSocketBroadcastBusSize";
+    }
+
+#if defined(HAVE_BROADCAST_BUS)
+    /* Round up to a power of two, so that offsets wrap along with the ring. */
+    bus_size = 0;
+    if (requested > 0) {
+        bus_size = BUS_MIN_SIZE;
+        while (bus_size < (apr_size_t) requested) {
+            bus_size *= 2;
+        }
+    }
+    return NULL;
+#else
+    return (requested > 0) ?
+           "WebSocketBroadcastBusSize requires Apache 2.4 or later" : NULL;
+#endif
+}
+
+static const char *mod_websocket_conf_busy_poll(cmd_parms *cmd, void *confv,
+                                                const char *usec)
+{
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+
+    if ((conf != NULL) && (usec != NULL)) {
+        apr_int64_t busy_poll = apr_atoi64(usec);
+
+        if ((busy_poll < 0) || (busy_poll > APR_USEC_PER_SEC)) {
+            return "WebSocketBusyPoll must be between 0 and 1000000 "
+                   "microseconds";
+        }
+        conf->busy_poll = (apr_interval_time_t) busy_poll;
+    }
+
+    return NULL;
+}
+
+static const char *mod_websocket_conf_kernel_busy_poll(cmd_parms *cmd,
+                                                       void *confv, int on)
+{
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+
+    if (conf != NULL) {
+        conf->kernel_busy_poll = on;
+    }
+
+    return NULL;
+}
+
+/*
+ * Compatibility wrapper for ap_timeout_parameter_parse(), which doesn't exist
+ * in Apache 2.2. The fallback only understands a plain number of seconds.
+ */
+static apr_status_t parse_timeout(const char *arg,
+                                  apr_interval_time_t *timeout)
+{
+#if AP_MODULE_MAGIC_AT_LEAST(20080920,2)
+    return ap_timeout_parameter_parse(arg, timeout, "s");
+#else
+    char *end;
+    apr_int64_t seconds = apr_strtoi64(arg, &end, 10);
+
+    if ((end == arg) || *end || (seconds < 0)) {
+        return APR_EGENERAL;
+    }
+
+    *timeout = apr_time_from_sec(seconds);
+    return APR_SUCCESS;
+#endif
+}
+
+static const char *mod_websocket_conf_ping_interval(cmd_parms *cmd,
+                                                    void *confv,
+                                                    const char *arg)
+{
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+    apr_interval_time_t interval;
+
+    if ((parse_timeout(arg, &interval) != APR_SUCCESS) || (interval < 0)) {
+        return "WebSocketPingInterval must be a non-negative time (in seconds, "
+               "or with a unit suffix such as ms)";
+    }
+
+    if (conf != NULL) {
+        conf->ping_interval = interval;
+    }
+
+    return NULL;
+}
+
+static const char *mod_websocket_conf_idle_timeout(cmd_parms *cmd,
+                                                   void *confv,
+                                                   const char *arg)
+{
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+    apr_interval_time_t timeout;
+
+    if ((parse_timeout(arg, &timeout) != APR_SUCCESS) || (timeout < 0)) {
+        return "WebSocketIdleTimeout must be a non-negative time (in seconds, "
+               "or with a unit suffix such as ms)";
+    }
+
+    if (conf != NULL) {
+        conf->idle_timeout = timeout;
+    }
+
+    return NULL;
+}
+
+static const char *mod_websocket_conf_max_send_delay(cmd_parms *cmd,
+                                                     void *confv,
+                                                     const char *arg)
+{
+    websocket_config_rec *conf = (websocket_config_rec *)confv;
+    apr_interval_time_t delay;
+
+    if ((parse_timeout(arg, &delay) != APR_SUCCESS) || (delay < 0)) {
+        return "WebSocketMaxSendDelay must be a non-negative time (in seconds, "
+               "or with a unit suffix such as ms)";
+    }
+
+    if (conf != NULL) {
+        conf->max_send_delay = delay;
+    }
+
+    return NULL;
+}
+
+/*
+ * Functions available to plugins.
+ */
+
+/*
+ * Frames that have been written but not yet flushed when the connection
+ * bypasses the filter stack. The payloads are referenced, not copied, so they
+ * must stay valid until the next flush. A payload from send_file() goes last,
+ * straight from the file. A vector with a zerocopy message is sent on its own
+ * with MSG_ZEROCOPY.
+ */
+typedef struct
+{
+    struct iovec vec[2 * DIRECT_FRAMES_MAX];
+    struct _WebSocketPreparedMessage *zerocopy[2 * DIRECT_FRAMES_MAX];
+    unsigned char headers[DIRECT_FRAMES_MAX][FRAME_HEADER_MAX];
+    int nvec;
+    int frames;
+    apr_file_t *file;
+    apr_off_t file_offset;
+    apr_size_t file_len;
+} WebSocketDirectOutput;
+
+/*
+ * A prepared message that the kernel may still read from, because it was sent
+ * with MSG_ZEROCOPY. The kernel numbers every zero-copy send on a socket, and
+ * reports ranges of those numbers on the socket's error queue once it is done
+ * with their pages.
+ */
+typedef struct
+{
+    struct _WebSocketPreparedMessage *msg; /* holds a reference */
+    apr_uint32_t id;                       /* of the send */
+} WebSocketZeroCopyPin;
+
+typedef struct
+{
+    apr_size_t min_size;   /* WebSocketZeroCopyMinSize; 0 if not in use */
+    apr_uint32_t next_id;  /* the kernel's number for the next send */
+    WebSocketZeroCopyPin *pins; /* in send order */
+    apr_size_t npins;
+    apr_size_t pins_size;
+} WebSocketZeroCopy;
+
+/*
+ * A growing buffer for an incoming message. It comes from malloc() rather than
+ * a pool, so that a plugin can take it over with detach_message() and free it
+ * from any thread.
+ */
+typedef struct
+{
+    unsigned char *buf;
+    apr_size_t len;
+    apr_size_t size;
+} WebSocketMessageBuf;
+
+/* A zlib stream, which may sit in the per-child pool of idle streams. */
+typedef struct _WebSocketZStream
+{
+    struct _WebSocketZStream *next;
+    z_stream zs;
+    int deflater;    /* a deflate stream, rather than an inflate stream */
+    int window_bits;
+} WebSocketZStream;
+
+/*
+ * The negotiated parameters and compression state for a connection using the
+ * permessage-deflate extension (RFC 7692).
+ *
+ * A connection only keeps its own zlib streams in the directions that use
+ * context takeover, and only once they are first needed. In the other
+ * directions, a stream is borrowed from the per-child pool for each message.
+ */
+typedef struct
+{
+    int server_no_context_takeover;
+    int client_no_context_takeover;
+    int server_max_window_bits;
+    int client_max_window_bits; /* 0 if the client didn't offer it */
+    apr_size_t min_size;        /* send smaller messages uncompressed */
+    int skip_messages;          /* messages left to send uncompressed */
+    WebSocketZStream *deflater;
+    WebSocketZStream *inflater;
+} WebSocketDeflate;
+
+typedef struct _WebSocketState
+{
+    request_rec *r;
+    apr_bucket_brigade *obb;
+    apr_os_thread_t main_thread;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    apr_array_header_t *protocols;
+    int closing;
+    apr_int64_t protocol_version;
+    apr_pollset_t *pollset;
+    apr_queue_t *queue;
+    apr_socket_t *sock;
+    int direct_io;    /* only the core filters are present; use the socket */
+    int direct_input; /* the core input filter is drained; read the socket */
+    WebSocketDirectOutput direct_out;
+    WebSocketZeroCopy zerocopy; /* main thread only */
+    apr_thread_mutex_t *timer_mutex;
+    struct _WebSocketTimer *timers;
+    WebSocketDeflate *deflate; /* NULL unless permessage-deflate is in use */
+    apr_pool_t *frame_pool;    /* cleared after every flush */
+    apr_thread_mutex_t *outbox_mutex; /* also guards pollset for publishers */
+    struct _WebSocketOutboxEntry *outbox;      /* published messages */
+    struct _WebSocketOutboxEntry *outbox_tail;
+    struct _WebSocketOutboxEntry **outbox_keys; /* hash of conflated entries */
+    apr_size_t outbox_keys_size;
+    apr_size_t outbox_keys_count;
+    apr_thread_mutex_t *sub_mutex;
+    struct _WebSocketSubscription *subscriptions;
+    int unsubscribed; /* closing; no more subscriptions are allowed */
+    apr_size_t max_pending_bytes;       /* WebSocketMaxPendingBytes */
+    apr_interval_time_t max_send_delay; /* WebSocketMaxSendDelay */
+    apr_size_t pending_bytes;  /* published but not yet flushed; see outbox */
+    apr_time_t pending_since;  /* when the oldest of those was published */
+    apr_time_t outbox_since;   /* when the oldest in the outbox was published */
+    const char *evicted;       /* why the connection must be closed, if it must */
+    apr_uint64_t expired;      /* messages dropped for missing their deadline */
+    apr_size_t low_watermark;  /* WebSocketLowWatermark */
+    int backed_up;             /* pending_bytes reached low_watermark */
+    int read_paused;           /* by the plugin; guarded by outbox_mutex */
+    int pong_pending;          /* a ping awaits its pong; main thread only */
+    apr_size_t pong_len;
+    unsigned char pong[CONTROL_PAYLOAD_MAX]; /* the latest ping's payload */
+    apr_pool_t *connection_pool; /* the plugin's; see connection_pool() */
+    apr_pool_t *message_pool;    /* cleared after every on_message() */
+    WebSocketMessageBuf *delivered; /* during on_message(), if detachable */
+} WebSocketState;
+
+static request_rec *CALLBACK mod_websocket_request(const WebSocketServer *server)
+{
+    if ((server != NULL) && (server->state != NULL)) {
+        return server->state->r;
+    }
+    return NULL;
+}
+
+static const char *CALLBACK mod_websocket_header_get(const WebSocketServer *server,
+                                                     const char *key)
+{
+    if ((server != NULL) && (key != NULL)) {
+        WebSocketState *state = server->state;
+
+        if ((state != NULL) && (state->r != NULL)) {
+            return apr_table_get(state->r->headers_in, key);
+        }
+    }
+    return NULL;
+}
+
+static void CALLBACK mod_websocket_header_set(const WebSocketServer *server,
+                                              const char *key,
+                                              const char *value)
+{
+    if ((server != NULL) && (key != NULL) && (value != NULL)) {
+        WebSocketState *state = server->state;
+
+        /*
+         * Once the handshake response has gone out, there's no point in
+         * copying headers into the request pool, which lasts as long as the
+         * connection does.
+         */
+        if ((state != NULL) && (state->r != NULL) &&
+            (state->r->status != HTTP_SWITCHING_PROTOCOLS)) {
+            apr_table_setn(state->r->headers_out,
+                           apr_pstrdup(state->r->pool, key),
+                           apr_pstrdup(state->r->pool, value));
+        }
+    }
+}
+
+static size_t CALLBACK mod_websocket_protocol_count(const WebSocketServer *server)
+{
+    size_t count = 0;
+
+    if ((server != NULL) && (server->state != NULL) &&
+        (server->state->protocols != NULL) &&
+        !apr_is_empty_array(server->state->protocols)) {
+        count = (size_t) server->state->protocols->nelts;
+    }
+    return count;
+}
+
+static const char *CALLBACK mod_websocket_protocol_index(const WebSocketServer *server,
+                                                         const size_t index)
+{
+    if ((index >= 0) && (index < mod_websocket_protocol_count(server))) {
+        return APR_ARRAY_IDX(server->state->protocols, index, char *);
+    }
+    return NULL;
+}
+
+static void CALLBACK mod_websocket_protocol_set(const WebSocketServer *server,
+                                                const char *protocol)
+{
+    if ((server != NULL) && (protocol != NULL)) {
+        WebSocketState *state = server->state;
+
+        /* As with header_set(), this only matters before the handshake. */
+        if ((state != NULL) && (state->r != NULL) &&
+            (state->r->status != HTTP_SWITCHING_PROTOCOLS)) {
+            apr_table_setn(state->r->headers_out, "Sec-WebSocket-Protocol",
+                           apr_pstrdup(state->r->pool, protocol));
+        }
+    }
+}
+
+static apr_status_t mod_websocket_flush(WebSocketState *state);
+static void outbox_evict(WebSocketState *state, const char *reason);
+static void buffered_release(apr_size_t len);
+
+/*
+ * Compression contexts are expensive (a deflate stream with the default window
+ * holds about 256 KB), so rather than keeping a pair per connection, the
+ * directions without context takeover borrow a stream from a per-child pool
+ * for each message. Every byte zlib allocates is counted, and no new deflate
+ * streams are created (and no new connections negotiate compression) once
+ * WebSocketDeflateMemoryLimit is reached.
+ */
+static apr_thread_mutex_t *zstream_mutex;
+static WebSocketZStream *idle_deflaters[16]; /* indexed by window bits */
+static WebSocketZStream *idle_inflaters;
+static apr_size_t zstream_memory; /* bytes currently allocated by zlib */
+
+#define ZSTREAM_ALLOC_HEADER 16 /* keeps the allocations suitably aligned */
+
+static voidpf zstream_alloc(voidpf opaque, uInt items, uInt size)
+{
+    apr_size_t len = (apr_size_t) items * size;
+    char *mem = malloc(len + ZSTREAM_ALLOC_HEADER);
+
+    if (mem == NULL) {
+        return Z_NULL;
+    }
+    *(apr_size_t *) mem = len;
+
+    apr_thread_mutex_lock(zstream_mutex);
+    zstream_memory += len;
+    apr_thread_mutex_unlock(zstream_mutex);
+
+    return mem + ZSTREAM_ALLOC_HEADER;
+}
+
+static void zstream_free(voidpf opaque, voidpf address)
+{
+    char *mem = (char *) address - ZSTREAM_ALLOC_HEADER;
+
+    apr_thread_mutex_lock(zstream_mutex);
+    zstream_memory -= *(apr_size_t *) mem;
+    apr_thread_mutex_unlock(zstream_mutex);
+
+    free(mem);
+}
+
+/* Checks whether compression has used up its memory budget. */
+static int zstream_over_budget(void)
+{
+    int over;
+
+    apr_thread_mutex_lock(zstream_mutex);
+    over = (zstream_memory_limit > 0) &&
+           (zstream_memory >= zstream_memory_limit);
+    apr_thread_mutex_unlock(zstream_mutex);
+
+    return over;
+}
+
+static WebSocketZStream *zstream_create(int deflater, int window_bits)
+{
+    WebSocketZStream *stream = calloc(1, sizeof(WebSocketZStream));
+    int ret;
+
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    stream->deflater = deflater;
+    stream->window_bits = window_bits;
+    stream->zs.zalloc = zstream_alloc;
+    stream->zs.zfree = zstream_free;
+
+    if (deflater) {
+        ret = deflateInit2(&stream->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                           -window_bits, 8, Z_DEFAULT_STRATEGY);
+    }
+    else {
+        ret = inflateInit2(&stream->zs, -window_bits);
+    }
+
+    if (ret != Z_OK) {
+        free(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+static void zstream_destroy(WebSocketZStream *stream)
+{
+    if (stream->deflater) {
+        deflateEnd(&stream->zs);
+    }
+    else {
+        inflateEnd(&stream->zs);
+    }
+    free(stream);
+}
+
+/*
+ * Takes an idle stream from the pool, or creates a new one. Returns NULL if a
+ * new deflate stream would exceed the memory budget; inflate streams are
+ * always provided, since we can't refuse compressed input once the extension
+ * has been negotiated.
+ */
+static WebSocketZStream *zstream_borrow(int deflater, int window_bits)
+{
+    WebSocketZStream **idle = deflater ? &idle_deflaters[window_bits]
+                                       : &idle_inflaters;
+    WebSocketZStream *stream;
+
+    apr_thread_mutex_lock(zstream_mutex);
+    if ((stream = *idle) != NULL) {
+        *idle = stream->next;
+    }
+    apr_thread_mutex_unlock(zstream_mutex);
+
+    if ((stream == NULL) && !(deflater && zstream_over_budget())) {
+        stream = zstream_create(deflater, window_bits);
+    }
+
+    return stream;
+}
+
+/*
+ * Resets a borrowed stream and returns it to the pool. A stream that failed is
+ * destroyed instead, as is any stream while the pool is holding more memory
+ * than the budget allows.
+ */
+static void zstream_return(WebSocketZStream *stream, int failed)
+{
+    if (!failed) {
+        if (stream->deflater) {
+            failed = (deflateReset(&stream->zs) != Z_OK);
+        }
+        else {
+            failed = (inflateReset(&stream->zs) != Z_OK);
+        }
+    }
+
+    if (!failed && !zstream_over_budget()) {
+        WebSocketZStream **idle = stream->deflater ?
+                                  &idle_deflaters[stream->window_bits] :
+                                  &idle_inflaters;
+
+        apr_thread_mutex_lock(zstream_mutex);
+        stream->next = *idle;
+        *idle = stream;
+        apr_thread_mutex_unlock(zstream_mutex);
+    }
+    else {
+        zstream_destroy(stream);
+    }
+}
+
+/*
+ * Gets a stream for compressing (or decompressing) a single message: the
+ * connection's own stream in a direction that uses context takeover, or one
+ * borrowed from the pool otherwise. Returns NULL if no deflate stream fits in
+ * the memory budget.
+ */
+static WebSocketZStream *zstream_acquire(WebSocketDeflate *params,
+                                         int deflater)
+{
+    WebSocketZStream **own = deflater ? &params->deflater : &params->inflater;
+    int shared = deflater ? params->server_no_context_takeover
+                          : params->client_no_context_takeover;
+    /* Any window the client may use fits in the largest one. */
+    int window_bits = deflater ? params->server_max_window_bits : 15;
+
+    if (shared) {
+        return zstream_borrow(deflater, window_bits);
+    }
+
+    if (*own == NULL) {
+        if (!(deflater && zstream_over_budget())) {
+            *own = zstream_create(deflater, window_bits);
+        }
+    }
+
+    return *own;
+}
+
+/* Gives back a stream from zstream_acquire(). */
+static void zstream_release(WebSocketDeflate *params, WebSocketZStream *stream,
+                            int failed)
+{
+    WebSocketZStream **own = stream->deflater ? &params->deflater
+                                              : &params->inflater;
+
+    if (*own == stream) {
+        if (failed) {
+            /* Start over with a fresh stream for the next message. */
+            *own = NULL;
+            zstream_destroy(stream);
+        }
+        return;
+    }
+
+    zstream_return(stream, failed);
+}
+
+/* Frees the streams a connection kept for itself. */
+static void zstream_release_all(WebSocketDeflate *params)
+{
+    if (params->deflater != NULL) {
+        zstream_destroy(params->deflater);
+        params->deflater = NULL;
+    }
+    if (params->inflater != NULL) {
+        zstream_destroy(params->inflater);
+        params->inflater = NULL;
+    }
+}
+
+/* Frees the idle streams when the child exits. */
+static apr_status_t zstream_cleanup_idle(void *data)
+{
+    int i;
+
+    for (i = 0; i < 16; ++i) {
+        while (idle_deflaters[i] != NULL) {
+            WebSocketZStream *stream = idle_deflaters[i];
+
+            idle_deflaters[i] = stream->next;
+            zstream_destroy(stream);
+        }
+    }
+    while (idle_inflaters != NULL) {
+        WebSocketZStream *stream = idle_inflaters;
+
+        idle_inflaters = stream->next;
+        zstream_destroy(stream);
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Compresses a whole message with the given stream, allocating the output from
+ * the given pool. The empty block that ends every Z_SYNC_FLUSH is stripped, as
+ * RFC 7692 requires. Returns 0 if zlib fails.
+ */
+static int deflate_message(z_stream *zs, apr_pool_t *pool,
+                           const unsigned char *in, apr_size_t in_len,
+                           unsigned char **out, apr_size_t *out_len)
+{
+    unsigned char *buf;
+    apr_size_t size;
+    apr_size_t len = 0;
+
+    /* deflateBound() doesn't account for the flush; leave room for it. */
+    size = deflateBound(zs, in_len) + 16;
+    buf = apr_palloc(pool, size);
+
+    zs->next_in = (Bytef *) in;
+    zs->avail_in = (uInt) in_len;
+
+    for (;;) {
+        int ret;
+
+        zs->next_out = buf + len;
+        zs->avail_out = (uInt) (size - len);
+
+        ret = deflate(zs, Z_SYNC_FLUSH);
+        len = size - zs->avail_out;
+
+        if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+            return 0;
+        }
+        if (zs->avail_out > 0) {
+            break;
+        }
+        else {
+            /* Out of room (unlikely); grow the buffer and keep going. */
+            unsigned char *bigger = apr_palloc(pool, size * 2);
+
+            memcpy(bigger, buf, len);
+            buf = bigger;
+            size *= 2;
+        }
+    }
+
+    if ((len >= 4) && (buf[len - 4] == 0x00) && (buf[len - 3] == 0x00) &&
+        (buf[len - 2] == 0xFF) && (buf[len - 1] == 0xFF)) {
+        len -= 4;
+    }
+
+    *out = buf;
+    *out_len = len;
+
+    return 1;
+}
+
+/*
+ * Compresses an outgoing message for permessage-deflate if that's worthwhile.
+ * Returns 1, replacing *payload and *payload_size, if the message was
+ * compressed. Messages smaller than WebSocketDeflateMinSize, messages that
+ * follow shortly after one that barely compressed, and messages for which no
+ * deflate stream fits in the memory budget are sent as they are.
+ *
+ * The output is allocated from the frame pool, so it stays valid until the
+ * next flush.
+ */
+static int mod_websocket_deflate(WebSocketState *state,
+                                 const unsigned char **payload,
+                                 apr_size_t *payload_size)
+{
+    WebSocketDeflate *params = state->deflate;
+    WebSocketZStream *stream;
+    apr_size_t in_len = *payload_size;
+    unsigned char *buf;
+    apr_size_t len;
+    int ok;
+
+    if ((in_len < params->min_size) || (in_len > UINT_MAX)) {
+        return 0;
+    }
+    if (params->skip_messages > 0) {
+        params->skip_messages--;
+        return 0;
+    }
+    if ((stream = zstream_acquire(params, 1)) == NULL) {
+        return 0;
+    }
+
+    ok = deflate_message(&stream->zs, state->frame_pool, *payload, in_len,
+                         &buf, &len);
+    zstream_release(params, stream, !ok);
+
+    if (!ok) {
+        return 0;
+    }
+
+    /*
+     * If the data doesn't compress, stop spending CPU on it for a while. It's
+     * likely that the next few messages will be more of the same.
+     */
+    if (len * 10 > in_len * 9) {
+        params->skip_messages = DEFLATE_BACKOFF_MESSAGES;
+
+        if (params->server_no_context_takeover && (len >= in_len)) {
+            /* Nothing depends on the compressed copy; send the smaller one. */
+            return 0;
+        }
+    }
+
+    *payload = buf;
+    *payload_size = len;
+
+    return 1;
+}
+
+/*
+ * Encodes the header of an unmasked, unfragmented frame into the given buffer
+ * (at least FRAME_HEADER_MAX bytes), returning the length of the header.
+ */
+static apr_size_t encode_frame_header(unsigned char *header,
+                                      unsigned char opcode, int compressed,
+                                      apr_uint64_t payload_length)
+{
+    apr_size_t pos = 0;
+
+    header[pos++] = FRAME_SET_FIN(1) | FRAME_SET_RSV1(compressed) |
+                    FRAME_SET_OPCODE(opcode);
+    if (payload_length < 126) {
+        header[pos++] =
+            FRAME_SET_MASK(0) | FRAME_SET_LENGTH(payload_length, 0);
+    }
+    else {
+        if (payload_length < 65536) {
+            header[pos++] = FRAME_SET_MASK(0) | 126;
+        }
+        else {
+            header[pos++] = FRAME_SET_MASK(0) | 127;
+            header[pos++] = FRAME_SET_LENGTH(payload_length, 7);
+            header[pos++] = FRAME_SET_LENGTH(payload_length, 6);
+            header[pos++] = FRAME_SET_LENGTH(payload_length, 5);
+            header[pos++] = FRAME_SET_LENGTH(payload_length, 4);
+            header[pos++] = FRAME_SET_LENGTH(payload_length, 3);
+            header[pos++] = FRAME_SET_LENGTH(payload_length, 2);
+        }
+        header[pos++] = FRAME_SET_LENGTH(payload_length, 1);
+        header[pos++] = FRAME_SET_LENGTH(payload_length, 0);
+    }
+
+    return pos;
+}
+
+/*
+ * Writes a single frame to the output brigade without flushing it, using the
+ * given server state. The server state must be locked upon entering this
+ * function. buffer_size is assumed to be within the limits defined by the
+ * WebSocket protocol (i.e. fits in 63 bits).
+ *
+ * Returns the number of payload bytes buffered. Nothing reaches the client
+ * until mod_websocket_flush() is called.
+ *
+ * If permessage-deflate is in use, data frames are compressed; the return value
+ * still counts the uncompressed bytes.
+ */
+static size_t mod_websocket_write_frame(WebSocketState *state,
+                                        const int type,
+                                        const unsigned char *buffer,
+                                        const size_t buffer_size)
+{
+    const unsigned char *payload = buffer;
+    apr_size_t payload_size = (buffer != NULL) ? buffer_size : 0;
+    apr_uint64_t payload_length;
+    size_t written = 0;
+
+    if ((state->r != NULL) && (state->obb != NULL) && !state->closing) {
+        unsigned char header[FRAME_HEADER_MAX];
+        apr_size_t pos;
+        unsigned char opcode;
+        int compressed = 0;
+
+        switch (type) {
+        case MESSAGE_TYPE_TEXT:
+            opcode = OPCODE_TEXT;
+            break;
+        case MESSAGE_TYPE_BINARY:
+            opcode = OPCODE_BINARY;
+            break;
+        case MESSAGE_TYPE_PING:
+            opcode = OPCODE_PING;
+            break;
+        case MESSAGE_TYPE_PONG:
+            opcode = OPCODE_PONG;
+            break;
+        case MESSAGE_TYPE_CLOSE:
+        default:
+            state->closing = 1;
+            opcode = OPCODE_CLOSE;
+            break;
+        }
+
+        /*
+         * Make room for the frame before compressing it, since flushing clears
+         * the frame pool that holds the compressed payload.
+         */
+        if (state->direct_io &&
+            (state->direct_out.frames == DIRECT_FRAMES_MAX) &&
+            (mod_websocket_flush(state) != APR_SUCCESS)) {
+            return 0;
+        }
+
+        if ((state->deflate != NULL) && (opcode < 0x8)) {
+            compressed = mod_websocket_deflate(state, &payload, &payload_size);
+        }
+        payload_length = (apr_uint64_t) payload_size;
+
+        pos = encode_frame_header(header, opcode, compressed, payload_length);
+
+        if (state->direct_io) {
+            WebSocketDirectOutput *out = &state->direct_out;
+
+            memcpy(out->headers[out->frames], header, pos);
+            out->vec[out->nvec].iov_base = (void *) out->headers[out->frames];
+            out->vec[out->nvec].iov_len = pos;
+            out->nvec++;
+            out->frames++;
+
+            if (payload_length > 0) {
+                out->vec[out->nvec].iov_base = (void *) payload;
+                out->vec[out->nvec].iov_len = payload_size;
+                out->nvec++;
+                written = buffer_size;
+            }
+        }
+        else {
+            ap_filter_t *of = state->r->connection->output_filters;
+
+            ap_fwrite(of, state->obb, (const char *)header, pos); /* Header */
+            if (payload_length > 0) {
+                if (ap_fwrite(of, state->obb,
+                              (const char *)payload,
+                              payload_size) == APR_SUCCESS) { /* Payload Data */
+                    written = buffer_size;
+                }
+            }
+        }
+    }
+
+    return written;
+}
+
+/*
+ * Prepared messages are framed once and then sent, without copying, to any
+ * number of connections. A message holds its frame in plain form, plus a
+ * compressed form for each window size that permessage-deflate connections
+ * have asked for; those are made when first needed, by whichever connection
+ * needs them first. Since the compressed forms are made with a fresh deflate
+ * stream, they can be sent to any connection whose window is at least as large.
+ *
+ * Messages are allocated with malloc() and reference counted, since they are
+ * shared between threads. The plugin holds one reference, and every frame that
+ * hasn't been flushed to the client yet holds another.
+ */
+typedef struct
+{
+    apr_size_t len;
+    unsigned char data[1]; /* header and payload */
+} WebSocketPreparedFrame;
+
+typedef struct _WebSocketPreparedMessage
+{
+    volatile apr_uint32_t refcount;
+    unsigned char opcode;
+    const unsigned char *payload; /* within plain */
+    apr_size_t payload_size;
+    WebSocketPreparedFrame *volatile compressed[16]; /* by window bits */
+    apr_size_t buffered; /* counted against WebSocketMaxBufferedMemory */
+    WebSocketPreparedFrame plain; /* must be last */
+} WebSocketPreparedMessage;
+
+/* Marks a message that doesn't get any smaller when compressed. */
+static WebSocketPreparedFrame incompressible_frame;
+
+/*
+ * Writes a frame into the given (suitably sized) buffer, returning its total
+ * length.
+ */
+static apr_size_t build_frame(unsigned char *data, unsigned char opcode,
+                              int compressed, const unsigned char *payload,
+                              apr_size_t payload_size)
+{
+    apr_size_t pos = encode_frame_header(data, opcode, compressed,
+                                         (apr_uint64_t) payload_size);
+
+    if (payload_size > 0) {
+        memcpy(data + pos, payload, payload_size);
+    }
+
+    return pos + payload_size;
+}
+
+static void prepared_message_release(WebSocketPreparedMessage *msg)
+{
+    if (!apr_atomic_dec32(&msg->refcount)) {
+        int i;
+
+        buffered_release(msg->buffered);
+
+        for (i = 0; i < 16; ++i) {
+            if ((msg->compressed[i] != NULL) &&
+                (msg->compressed[i] != &incompressible_frame)) {
+                free(msg->compressed[i]);
+            }
+        }
+        free(msg);
+    }
+}
+
+static apr_status_t prepared_message_cleanup(void *data)
+{
+    prepared_message_release(data);
+    return APR_SUCCESS;
+}
+
+/*
+ * A bucket that refers to a prepared frame, holding a reference to its message
+ * until the last copy of the bucket is destroyed.
+ */
+typedef struct
+{
+    apr_bucket_refcount refcount;
+    WebSocketPreparedMessage *msg;
+    const unsigned char *data;
+} WebSocketPreparedBucket;
+
+static void prepared_bucket_destroy(void *data)
+{
+    WebSocketPreparedBucket *p = data;
+
+    if (apr_bucket_shared_destroy(p)) {
+        prepared_message_release(p->msg);
+        apr_bucket_free(p);
+    }
+}
+
+static apr_status_t prepared_bucket_read(apr_bucket *b, const char **str,
+                                         apr_size_t *len,
+                                         apr_read_type_e block)
+{
+    WebSocketPreparedBucket *p = b->data;
+
+    *str = (const char *) p->data + b->start;
+    *len = b->length;
+
+    return APR_SUCCESS;
+}
+
+static const apr_bucket_type_t prepared_bucket_type = {
+    "WEBSOCKET_PREPARED", 5, APR_BUCKET_DATA,
+    prepared_bucket_destroy,
+    prepared_bucket_read,
+    apr_bucket_setaside_noop, /* the data outlives the bucket */
+    apr_bucket_shared_split,
+    apr_bucket_shared_copy
+};
+
+static apr_bucket *prepared_bucket_create(WebSocketPreparedMessage *msg,
+                                          WebSocketPreparedFrame *frame,
+                                          apr_bucket_alloc_t *list)
+{
+    apr_bucket *b = apr_bucket_alloc(sizeof(*b), list);
+    WebSocketPreparedBucket *p = apr_bucket_alloc(sizeof(*p), list);
+
+    APR_BUCKET_INIT(b);
+    b->free = apr_bucket_free;
+    b->list = list;
+
+    apr_atomic_inc32(&msg->refcount);
+    p->msg = msg;
+    p->data = frame->data;
+
+    b = apr_bucket_shared_make(b, p, 0, frame->len);
+    b->type = &prepared_bucket_type;
+
+    return b;
+}
+
+/*
+ * Gets the compressed form of a prepared message for this connection, making
+ * it if no other connection has yet. Returns NULL if the message should be
+ * sent uncompressed.
+ */
+static WebSocketPreparedFrame *prepared_message_deflate(WebSocketState *state,
+                                                        WebSocketPreparedMessage *msg)
+{
+    int window_bits = state->deflate->server_max_window_bits;
+    WebSocketPreparedFrame *frame = msg->compressed[window_bits];
+
+    if (frame == NULL) {
+        WebSocketZStream *stream = zstream_borrow(1, window_bits);
+        unsigned char *buf;
+        apr_size_t len;
+        int ok;
+
+        if (stream == NULL) {
+            /* Over the memory budget; try again next time. */
+            return NULL;
+        }
+
+        ok = deflate_message(&stream->zs, state->frame_pool, msg->payload,
+                             msg->payload_size, &buf, &len);
+        zstream_return(stream, !ok);
+
+        if (!ok) {
+            return NULL;
+        }
+
+        if (len < msg->payload_size) {
+            frame = malloc(sizeof(WebSocketPreparedFrame) + FRAME_HEADER_MAX +
+                           len);
+            if (frame == NULL) {
+                return NULL;
+            }
+            frame->len = build_frame(frame->data, msg->opcode, 1, buf, len);
+        }
+        else {
+            frame = &incompressible_frame;
+        }
+
+        if (apr_atomic_casptr((volatile void **) &msg->compressed[window_bits],
+                              frame, NULL) != NULL) {
+            /* Another connection got there first; use its copy. */
+            if (frame != &incompressible_frame) {
+                free(frame);
+            }
+            frame = msg->compressed[window_bits];
+        }
+    }
+
+    return (frame != &incompressible_frame) ? frame : NULL;
+}
+
+/*
+ * Writes a prepared message to the output without flushing it, like
+ * mod_websocket_write_frame(). The frame is referenced rather than copied, and
+ * the message is kept alive until the frame has been flushed.
+ */
+static size_t mod_websocket_write_prepared(WebSocketState *state,
+                                           WebSocketPreparedMessage *msg)
+{
+    WebSocketPreparedFrame *frame = &msg->plain;
+
+    if ((state->r == NULL) || (state->obb == NULL) || state->closing) {
+        return 0;
+    }
+
+    /* As in mod_websocket_write_frame(), make room before compressing. */
+    if (state->direct_io &&
+        (state->direct_out.frames == DIRECT_FRAMES_MAX) &&
+        (mod_websocket_flush(state) != APR_SUCCESS)) {
+        return 0;
+    }
+
+    if ((state->deflate != NULL) &&
+        (msg->payload_size >= state->deflate->min_size) &&
+        (msg->payload_size <= UINT_MAX)) {
+        WebSocketPreparedFrame *compressed = prepared_message_deflate(state,
+                                                                      msg);
+
+        if (compressed != NULL) {
+            frame = compressed;
+
+            /*
+             * The client's window now holds data that our own deflate stream
+             * has never seen, so the stream can't refer back past this point.
+             */
+            if (state->deflate->deflater != NULL) {
+                deflateReset(&state->deflate->deflater->zs);
+            }
+        }
+    }
+
+    if (state->direct_io) {
+        WebSocketDirectOutput *out = &state->direct_out;
+
+        apr_atomic_inc32(&msg->refcount);
+        apr_pool_cleanup_register(state->frame_pool, msg,
+                                  prepared_message_cleanup,
+                                  apr_pool_cleanup_null);
+
+        out->vec[out->nvec].iov_base = (void *) frame->data;
+        out->vec[out->nvec].iov_len = frame->len;
+        if ((state->zerocopy.min_size > 0) &&
+            (frame->len >= state->zerocopy.min_size)) {
+            out->zerocopy[out->nvec] = msg;
+        }
+        out->nvec++;
+        out->frames++;
+    }
+    else {
+        apr_bucket_alloc_t *list = state->r->connection->bucket_alloc;
+        apr_bucket *b = prepared_bucket_create(msg, frame, list);
+
+        APR_BRIGADE_INSERT_TAIL(state->obb, b);
+    }
+
+    return msg->payload_size;
+}
+
+#if defined(HAVE_ZEROCOPY)
+
+/*
+ * Sends a single vector with MSG_ZEROCOPY, and pins msg until the kernel
+ * reports that it is done with the pages. Falls back to copying when the pin
+ * can't be recorded or the kernel is out of memory for the notifications.
+ */
+static apr_status_t zerocopy_send(WebSocketState *state, struct iovec *vec,
+                                  struct _WebSocketPreparedMessage *msg,
+                                  apr_size_t *len)
+{
+    WebSocketZeroCopy *zc = &state->zerocopy;
+    struct msghdr mh = { 0 };
+    apr_os_sock_t fd;
+    int flags = MSG_ZEROCOPY;
+    ssize_t sent;
+
+    *len = 0;
+    if (apr_os_sock_get(&fd, state->sock) != APR_SUCCESS) {
+        return APR_EBADF;
+    }
+
+    if (zc->npins == zc->pins_size) {
+        apr_size_t size = zc->pins_size ? (2 * zc->pins_size) :
+                                          DIRECT_FRAMES_MAX;
+        WebSocketZeroCopyPin *pins = realloc(zc->pins, size * sizeof(*pins));
+
+        if (pins != NULL) {
+            zc->pins = pins;
+            zc->pins_size = size;
+        }
+        else {
+            flags = 0;
+        }
+    }
+
+    mh.msg_iov = vec;
+    mh.msg_iovlen = 1;
+
+    sent = sendmsg(fd, &mh, flags);
+    if ((sent < 0) && (errno == ENOBUFS) && (flags != 0)) {
+        flags = 0;
+        sent = sendmsg(fd, &mh, flags);
+    }
+    if (sent < 0) {
+        return APR_FROM_OS_ERROR(errno);
+    }
+
+    /* Every zero-copy send that takes any data gets the next number. */
+    if ((flags != 0) && (sent > 0)) {
+        apr_atomic_inc32(&msg->refcount);
+        zc->pins[zc->npins].msg = msg;
+        zc->pins[zc->npins].id = zc->next_id++;
+        zc->npins++;
+    }
+
+    *len = (apr_size_t) sent;
+    return APR_SUCCESS;
+}
+
+/*
+ * Releases the messages of every completed zero-copy send reported on the
+ * socket's error queue, without blocking. Reading the queue also clears the
+ * POLLERR condition that the reports raise on the socket.
+ */
+static void zerocopy_reap_fd(WebSocketZeroCopy *zc, apr_os_sock_t fd)
+{
+    while (zc->npins > 0) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                                sizeof(struct sockaddr_in6))];
+        struct msghdr mh = { 0 };
+        struct cmsghdr *cm;
+
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+            struct sock_extended_err *ee;
+            apr_uint32_t lo, hi;
+            apr_size_t i, kept = 0;
+
+            if (!((cm->cmsg_level == SOL_IP) &&
+                  (cm->cmsg_type == IP_RECVERR)) &&
+                !((cm->cmsg_level == SOL_IPV6) &&
+                  (cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+
+            ee = (struct sock_extended_err *) CMSG_DATA(cm);
+            if ((ee->ee_errno != 0) ||
+                (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)) {
+                continue;
+            }
+
+            /*
+             * The sends ee_info to ee_data are complete. The numbers wrap
+             * around, so compare them by their distance from ee_info.
+             */
+            lo = ee->ee_info;
+            hi = ee->ee_data;
+            for (i = 0; i < zc->npins; ++i) {
+                if ((apr_uint32_t) (zc->pins[i].id - lo) <= hi - lo) {
+                    prepared_message_release(zc->pins[i].msg);
+                }
+                else {
+                    zc->pins[kept++] = zc->pins[i];
+                }
+            }
+            zc->npins = kept;
+
+            /*
+             * The kernel had to copy the data after all (over loopback, for
+             * instance, or to a device without scatter-gather), so pinning
+             * the pages only adds to the cost. Stop using zero-copy sends.
+             */
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->min_size = 0;
+            }
+        }
+    }
+}
+
+static void zerocopy_reap(WebSocketState *state)
+{
+    apr_os_sock_t fd;
+
+    if ((state->zerocopy.npins > 0) &&
+        (apr_os_sock_get(&fd, state->sock) == APR_SUCCESS)) {
+        zerocopy_reap_fd(&state->zerocopy, fd);
+    }
+}
+
+/*
+ * Zero-copy sends that are still in flight when their connection ends can't
+ * be released yet: the kernel may still read from their pages, and once a
+ * message is freed, malloc() can hand its memory to something else that
+ * overwrites it. Nor should the worker wait for them. Instead, the pins go to
+ * a reaper thread (one per child, started when first needed), along with a
+ * duplicate of the socket that keeps its error queue around. The reaper sleeps
+ * in poll() until the kernel reports sends done, and lets go of each socket
+ * once nothing of it is pinned anymore.
+ */
+typedef struct WebSocketZeroCopyOrphan
+{
+    struct WebSocketZeroCopyOrphan *next;
+    apr_os_sock_t fd; /* our own duplicate */
+    WebSocketZeroCopy zc;
+} WebSocketZeroCopyOrphan;
+
+static apr_pool_t *zerocopy_pool; /* for the reaper; guarded by the mutex */
+static apr_thread_mutex_t *zerocopy_mutex;
+static apr_thread_cond_t *zerocopy_cond; /* signalled for new orphans */
+static WebSocketZeroCopyOrphan *zerocopy_orphans;
+static apr_thread_t *zerocopy_thread;
+static int zerocopy_stopping;
+
+static void *APR_THREAD_FUNC zerocopy_reaper_main(apr_thread_t *thread,
+                                                  void *data)
+{
+    struct pollfd fds[ZEROCOPY_REAPER_FDS];
+    int ready = 0; /* whether poll() found anything last time */
+
+    apr_thread_mutex_lock(zerocopy_mutex);
+    while (!zerocopy_stopping) {
+        WebSocketZeroCopyOrphan **link = &zerocopy_orphans;
+        apr_size_t released = 0;
+        int nfds = 0;
+
+        if (zerocopy_orphans == NULL) {
+            apr_thread_cond_wait(zerocopy_cond, zerocopy_mutex);
+            continue;
+        }
+
+        while (*link != NULL) {
+            WebSocketZeroCopyOrphan *orphan = *link;
+            apr_size_t npins = orphan->zc.npins;
+
+            zerocopy_reap_fd(&orphan->zc, orphan->fd);
+            released += npins - orphan->zc.npins;
+
+            if (orphan->zc.npins == 0) {
+                *link = orphan->next;
+                close(orphan->fd);
+                free(orphan->zc.pins);
+                free(orphan);
+                continue;
+            }
+
+            /* Error queue reports show up as POLLERR, with no events asked. */
+            if (nfds < ZEROCOPY_REAPER_FDS) {
+                fds[nfds].fd = orphan->fd;
+                fds[nfds].events = 0;
+                fds[nfds].revents = 0;
+                nfds++;
+            }
+            link = &orphan->next;
+        }
+
+        if (nfds > 0) {
+            apr_thread_mutex_unlock(zerocopy_mutex);
+
+            /*
+             * A socket that has been hung up polls as ready all the time, so
+             * if that didn't turn up anything, wait out the interval instead.
+             */
+            if (ready && !released) {
+                apr_sleep(apr_time_from_msec(ZEROCOPY_REAPER_INTERVAL));
+                ready = 0;
+            }
+            else {
+                ready = (poll(fds, nfds, ZEROCOPY_REAPER_INTERVAL) > 0);
+            }
+
+            apr_thread_mutex_lock(zerocopy_mutex);
+        }
+    }
+    apr_thread_mutex_unlock(zerocopy_mutex);
+
+    apr_thread_exit(thread, APR_SUCCESS);
+
+    return NULL;
+}
+
+/*
+ * Stops the reaper when the child exits. Whatever it still holds is left for
+ * the exit to reclaim: releasing it now could still let the memory be reused
+ * while the kernel sends from it.
+ */
+static apr_status_t zerocopy_reaper_stop(void *data)
+{
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(zerocopy_mutex);
+    zerocopy_stopping = 1;
+    apr_thread_cond_signal(zerocopy_cond);
+    apr_thread_mutex_unlock(zerocopy_mutex);
+
+    if (zerocopy_thread != NULL) {
+        apr_thread_join(&rv, zerocopy_thread);
+        zerocopy_thread = NULL;
+    }
+
+    while (zerocopy_orphans != NULL) {
+        WebSocketZeroCopyOrphan *orphan = zerocopy_orphans;
+
+        zerocopy_orphans = orphan->next;
+        close(orphan->fd);
+        free(orphan);
+    }
+
+    return APR_SUCCESS;
+}
+
+static void zerocopy_child_init(apr_pool_t *pchild)
+{
+    apr_pool_create(&zerocopy_pool, pchild);
+    apr_thread_mutex_create(&zerocopy_mutex, APR_THREAD_MUTEX_DEFAULT, pchild);
+    apr_thread_cond_create(&zerocopy_cond, pchild);
+    zerocopy_orphans = NULL;
+    zerocopy_thread = NULL;
+    zerocopy_stopping = 0;
+
+    apr_pool_pre_cleanup_register(pchild, NULL, zerocopy_reaper_stop);
+}
+
+/*
+ * Hands an orphan to the reaper, starting the reaper if need be. Returns 0 if
+ * the reaper isn't running and can't be started.
+ */
+static int zerocopy_adopt(WebSocketZeroCopyOrphan *orphan)
+{
+    int ok;
+
+    apr_thread_mutex_lock(zerocopy_mutex);
+    if ((zerocopy_thread == NULL) && !zerocopy_stopping &&
+        (apr_thread_create(&zerocopy_thread, NULL, zerocopy_reaper_main,
+                           NULL, zerocopy_pool) != APR_SUCCESS)) {
+        zerocopy_thread = NULL;
+    }
+    ok = (zerocopy_thread != NULL) && !zerocopy_stopping;
+    if (ok) {
+        orphan->next = zerocopy_orphans;
+        zerocopy_orphans = orphan;
+        apr_thread_cond_signal(zerocopy_cond);
+    }
+    apr_thread_mutex_unlock(zerocopy_mutex);
+
+    return ok;
+}
+
+/*
+ * Lets go of the connection's zero-copy sends when it ends, without waiting:
+ * the ones the kernel is done with are released, and the rest go to the
+ * reaper. If even that fails, their messages are leaked rather than released
+ * early.
+ */
+static void zerocopy_drain(WebSocketState *state)
+{
+    WebSocketZeroCopy *zc = &state->zerocopy;
+    WebSocketZeroCopyOrphan *orphan = NULL;
+    apr_os_sock_t fd;
+
+    zerocopy_reap(state);
+
+    if (zc->npins > 0) {
+        if ((apr_os_sock_get(&fd, state->sock) == APR_SUCCESS) &&
+            ((orphan = malloc(sizeof(*orphan))) != NULL) &&
+            ((orphan->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) >= 0)) {
+            orphan->zc = *zc;
+            if (zerocopy_adopt(orphan)) {
+                orphan = NULL;
+                zc->pins = NULL;
+            }
+            else {
+                close(orphan->fd);
+            }
+        }
+        free(orphan);
+
+        if (zc->pins != NULL) {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, state->r,
+                          "could not wait for %" APR_SIZE_T_FMT " zero-copy "
+                          "sends to complete; leaking their messages",
+                          zc->npins);
+            zc->pins = NULL;
+        }
+    }
+
+    free(zc->pins);
+    zc->pins = NULL;
+    zc->npins = zc->pins_size = 0;
+}
+
+/*
+ * Turns on zero-copy sends for a connection using direct I/O. This is
+ * best-effort: kernels before 4.14 don't support SO_ZEROCOPY.
+ */
+static void enable_zerocopy(WebSocketState *state, apr_size_t min_size)
+{
+    apr_os_sock_t fd;
+    int on = 1;
+
+    if ((apr_os_sock_get(&fd, state->sock) != APR_SUCCESS) ||
+        setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, (const void *) &on,
+                   sizeof(on))) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, apr_get_netos_error(), state->r,
+                      "could not set SO_ZEROCOPY on the client socket");
+        return;
+    }
+
+    state->zerocopy.min_size = min_size;
+}
+
+#else /* !HAVE_ZEROCOPY */
+
+/* Nothing is ever marked for zero-copy; these only keep the callers simple. */
+static apr_status_t zerocopy_send(WebSocketState *state, struct iovec *vec,
+                                  struct _WebSocketPreparedMessage *msg,
+                                  apr_size_t *len)
+{
+    return apr_socket_sendv(state->sock, vec, 1, len);
+}
+
+static void zerocopy_reap(WebSocketState *state) { }
+
+static void zerocopy_drain(WebSocketState *state) { }
+
+static void zerocopy_child_init(apr_pool_t *pchild) { }
+
+static void enable_zerocopy(WebSocketState *state, apr_size_t min_size)
+{
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, APR_ENOTIMPL, state->r,
+                  "MSG_ZEROCOPY is not available on this platform; ignoring "
+                  "WebSocketZeroCopyMinSize");
+}
+
+#endif /* HAVE_ZEROCOPY */
+
+/*
+ * Writes the pending direct output to the socket with as few sendv() calls as
+ * possible, waiting for the socket to become writable whenever the kernel's
+ * buffer is full. With WebSocketMaxSendDelay, gives up with APR_TIMEUP if the
+ * client doesn't take everything within that time.
+ *
+ * Vectors marked for zero-copy are sent with their own call, so that the
+ * kernel never pins anything but a reference-counted prepared message.
+ */
+static apr_status_t mod_websocket_direct_flush(WebSocketState *state)
+{
+    WebSocketDirectOutput *out = &state->direct_out;
+    int first = 0;
+    apr_status_t rv = APR_SUCCESS;
+    apr_time_t deadline = 0;
+
+    if ((state->max_send_delay > 0) &&
+        ((out->nvec > 0) || (out->file_len > 0))) {
+        deadline = apr_time_now() + state->max_send_delay;
+    }
+
+    while ((first < out->nvec) || (out->file_len > 0)) {
+        apr_size_t len = 0;
+
+        if (first < out->nvec) {
+            struct iovec *vec = &out->vec[first];
+
+            if (out->zerocopy[first] != NULL) {
+                rv = zerocopy_send(state, vec, out->zerocopy[first], &len);
+            }
+            else {
+                int n = 1;
+
+                while ((first + n < out->nvec) &&
+                       (out->zerocopy[first + n] == NULL)) {
+                    n++;
+                }
+                rv = apr_socket_sendv(state->sock, vec, n, &len);
+            }
+
+            /* Skip past whatever was written, which may end mid-vector. */
+            while ((first < out->nvec) && (len >= vec->iov_len)) {
+                len -= vec->iov_len;
+                vec++;
+                first++;
+            }
+            if (len > 0) {
+                vec->iov_base = (char *) vec->iov_base + len;
+                vec->iov_len -= len;
+            }
+        }
+        else {
+            /* Let the kernel copy the file to the socket itself. */
+            len = out->file_len;
+            rv = apr_socket_sendfile(state->sock, out->file, NULL,
+                                     &out->file_offset, &len, 0);
+            out->file_offset += len;
+            out->file_len -= len;
+        }
+
+        if (APR_STATUS_IS_EAGAIN(rv)) {
+            apr_pollfd_t pollfd = { 0 };
+            apr_int32_t nsds;
+            apr_interval_time_t wait = -1;
+
+            pollfd.p = state->r->pool;
+            pollfd.desc_type = APR_POLL_SOCKET;
+            pollfd.reqevents = APR_POLLOUT;
+            pollfd.desc.s = state->sock;
+
+            if (deadline) {
+                wait = deadline - apr_time_now();
+                if (wait <= 0) {
+                    rv = APR_TIMEUP;
+                    break;
+                }
+            }
+
+            do {
+                rv = apr_poll(&pollfd, 1, &nsds, wait);
+            } while (APR_STATUS_IS_EINTR(rv));
+        }
+
+        if ((rv != APR_SUCCESS) && !APR_STATUS_IS_EINTR(rv)) {
+            break;
+        }
+        rv = APR_SUCCESS;
+    }
+
+    /* The frame pool holds the references of the writes themselves. */
+    memset(out->zerocopy, 0, out->nvec * sizeof(out->zerocopy[0]));
+    out->nvec = 0;
+    out->frames = 0;
+    out->file = NULL;
+    out->file_len = 0;
+
+    return rv;
+}
+
+/*
+ * Flushes every frame buffered by mod_websocket_write_frame() to the client.
+ * The server state must be locked upon entering this function.
+ *
+ * If the client didn't take the frames within WebSocketMaxSendDelay (in the
+ * filtered case, the socket timeout is set to it), the connection is evicted.
+ * Since a frame may have been cut off partway, nothing more can be written to
+ * it, not even a closing frame.
+ */
+static apr_status_t mod_websocket_flush(WebSocketState *state)
+{
+    apr_status_t rv;
+
+    if ((state->r == NULL) || (state->obb == NULL)) {
+        return APR_EINVAL;
+    }
+
+    if (state->direct_io) {
+        rv = mod_websocket_direct_flush(state);
+    }
+    else {
+        rv = ap_fflush(state->r->connection->output_filters, state->obb);
+    }
+
+    if (APR_STATUS_IS_TIMEUP(rv) && (state->max_send_delay > 0)) {
+        state->closing = 1;
+        outbox_evict(state, "client did not accept data within "
+                            "WebSocketMaxSendDelay");
+    }
+
+    /* Nothing refers to the payloads of the flushed frames anymore. */
+    if (state->frame_pool != NULL) {
+        apr_pool_clear(state->frame_pool);
+    }
+
+    return rv;
+}
+
+/*
+ * Sends data to the WebSocket connection using the given server state. The
+ * server state must be locked upon entering this function. buffer_size is
+ * assumed to be within the limits defined by the WebSocket protocol (i.e. fits
+ * in 63 bits).
+ */
+static size_t mod_websocket_send_internal(WebSocketState *state,
+                                          const int type,
+                                          const unsigned char *buffer,
+                                          const size_t buffer_size)
+{
+    size_t written = mod_websocket_write_frame(state, type, buffer,
+                                               buffer_size);
+
+    if (mod_websocket_flush(state) != APR_SUCCESS) {
+        written = 0;
+    }
+
+    return written;
+}
+
+/*
+ * Reads parts of a file for send_file() without using or moving the file's
+ * position, since a plugin may be sending the same open file to several
+ * connections at once, from different threads. On Unix, pread() does that
+ * with the file's own descriptor. Windows has no pread(), so the file is opened
+ * again by name, and read through a handle of our own.
+ */
+#if APR_HAS_LARGE_FILES && defined(_LARGEFILE64_SOURCE)
+#define file_pread pread64 /* apr_off_t is 64 bits even if off_t isn't */
+#else
+#define file_pread pread
+#endif
+
+typedef struct
+{
+    apr_file_t *file;
+    apr_pool_t *pool; /* of the private handle, if there is one */
+} WebSocketFileReader;
+
+static apr_status_t file_reader_open(WebSocketFileReader *reader,
+                                     apr_file_t *file)
+{
+#if defined(_WIN32)
+    const char *name;
+    apr_status_t rv;
+
+    reader->file = NULL;
+    if ((rv = apr_pool_create(&reader->pool, NULL)) != APR_SUCCESS) {
+        reader->pool = NULL;
+        return rv;
+    }
+    if (((rv = apr_file_name_get(&name, file)) != APR_SUCCESS) ||
+        ((rv = apr_file_open(&reader->file, name,
+                             APR_FOPEN_READ | APR_FOPEN_BINARY,
+                             APR_OS_DEFAULT, reader->pool)) != APR_SUCCESS)) {
+        apr_pool_destroy(reader->pool);
+        reader->pool = NULL;
+    }
+    return rv;
+#else
+    reader->file = file;
+    reader->pool = NULL;
+    return APR_SUCCESS;
+#endif
+}
+
+/* Reads exactly len bytes at the given offset, or fails. */
+static apr_status_t file_reader_read(WebSocketFileReader *reader,
+                                     unsigned char *buf, apr_size_t len,
+                                     apr_off_t offset)
+{
+#if defined(_WIN32)
+    apr_status_t rv = apr_file_seek(reader->file, APR_SET, &offset);
+
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_read_full(reader->file, buf, len, NULL);
+    }
+    return rv;
+#else
+    apr_os_file_t fd;
+    apr_status_t rv = apr_os_file_get(&fd, reader->file);
+
+    while ((rv == APR_SUCCESS) && (len > 0)) {
+        ssize_t n = file_pread(fd, buf, len, offset);
+
+        if (n > 0) {
+            buf += n;
+            len -= (apr_size_t) n;
+            offset += n;
+        }
+        else if (n == 0) {
+            rv = APR_EOF;
+        }
+        else {
+            rv = apr_get_os_error();
+            if (APR_STATUS_IS_EINTR(rv)) {
+                rv = APR_SUCCESS;
+            }
+        }
+    }
+    return rv;
+#endif
+}
+
+static void file_reader_close(WebSocketFileReader *reader)
+{
+    if (reader->pool != NULL) {
+        apr_pool_destroy(reader->pool);
+        reader->pool = NULL;
+    }
+}
+
+/*
+ * Writes a single fragment of a message and flushes it right away, for
+ * messages that are compressed as they're sent. Only the first fragment
+ * carries the opcode and RSV1 (RFC 7692, section 6.1).
+ */
+static apr_status_t mod_websocket_write_fragment(WebSocketState *state,
+                                                 unsigned char opcode,
+                                                 int first, int fin,
+                                                 const unsigned char *data,
+                                                 apr_size_t len)
+{
+    unsigned char header[FRAME_HEADER_MAX];
+    apr_size_t pos;
+
+    pos = encode_frame_header(header, first ? opcode : OPCODE_CONTINUATION,
+                              first, (apr_uint64_t) len);
+    if (!fin) {
+        header[0] &= (unsigned char) ~FRAME_SET_FIN(1);
+    }
+
+    if (state->direct_io) {
+        WebSocketDirectOutput *out = &state->direct_out;
+
+        memcpy(out->headers[out->frames], header, pos);
+        out->vec[out->nvec].iov_base = (void *) out->headers[out->frames];
+        out->vec[out->nvec].iov_len = pos;
+        out->nvec++;
+        if (len > 0) {
+            out->vec[out->nvec].iov_base = (void *) data;
+            out->vec[out->nvec].iov_len = len;
+            out->nvec++;
+        }
+        out->frames++;
+    }
+    else {
+        ap_filter_t *of = state->r->connection->output_filters;
+
+        ap_fwrite(of, state->obb, (const char *) header, pos);
+        if (len > 0) {
+            ap_fwrite(of, state->obb, (const char *) data, len);
+        }
+    }
+
+    return mod_websocket_flush(state);
+}
+
+/*
+ * Sends length bytes of a file, starting at offset, as a compressed message.
+ * The file is read and compressed FILE_CHUNK_SIZE bytes at a time, and sent as
+ * a fragment whenever the compressed output fills up, so that a large file
+ * never has to fit in memory. The file's position isn't touched.
+ *
+ * The last four bytes of output are always held back, since the message must
+ * end without the empty block that the final Z_SYNC_FLUSH adds.
+ *
+ * Returns the number of bytes sent, 0 on failure, or -1 (with nothing sent) if
+ * no deflate stream fits in the memory budget. A failure after the first
+ * fragment has gone out leaves the message unfinished, so the connection is
+ * evicted.
+ */
+static apr_ssize_t mod_websocket_write_file_deflated(WebSocketState *state,
+                                                     unsigned char opcode,
+                                                     apr_file_t *file,
+                                                     apr_off_t offset,
+                                                     apr_size_t length)
+{
+    WebSocketDeflate *params = state->deflate;
+    WebSocketZStream *stream;
+    z_stream *zs;
+    unsigned char *in = NULL;
+    unsigned char *out = NULL;
+    apr_size_t out_size;
+    apr_size_t held = 0; /* bytes at the start of out from the last round */
+    apr_size_t left = length;
+    WebSocketFileReader reader;
+    int first = 1;
+    int ok;
+
+    if (file_reader_open(&reader, file) != APR_SUCCESS) {
+        return 0;
+    }
+    if ((stream = zstream_acquire(params, 1)) == NULL) {
+        file_reader_close(&reader);
+        return -1;
+    }
+    zs = &stream->zs;
+
+    out_size = deflateBound(zs, FILE_CHUNK_SIZE) + 16;
+    ok = ((in = malloc(FILE_CHUNK_SIZE)) != NULL) &&
+         ((out = malloc(out_size)) != NULL);
+
+    while (ok) {
+        apr_size_t in_len = (left > FILE_CHUNK_SIZE) ? FILE_CHUNK_SIZE : left;
+        int last = (in_len == left);
+
+        if (file_reader_read(&reader, in, in_len, offset) != APR_SUCCESS) {
+            ok = 0;
+            break;
+        }
+        offset += in_len;
+        left -= in_len;
+
+        zs->next_in = in;
+        zs->avail_in = (uInt) in_len;
+
+        do {
+            apr_size_t len;
+            int ret;
+
+            zs->next_out = out + held;
+            zs->avail_out = (uInt) (out_size - held);
+
+            ret = deflate(zs, last ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+            if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+                ok = 0;
+                break;
+            }
+            len = out_size - zs->avail_out;
+
+            /* Send all but the last four bytes, which start the next round. */
+            if (len > 4) {
+                if (mod_websocket_write_fragment(state, opcode, first, 0, out,
+                                                 len - 4) != APR_SUCCESS) {
+                    ok = 0;
+                    break;
+                }
+                first = 0;
+                memmove(out, out + len - 4, 4);
+                len = 4;
+            }
+            held = len;
+        } while (zs->avail_out == 0);
+
+        if (last) {
+            break;
+        }
+    }
+
+    if (ok) {
+        /* What's held back is the end of the flush, unless zlib surprises. */
+        static const unsigned char tail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+
+        if ((held == 4) && !memcmp(out, tail, 4)) {
+            held = 0;
+        }
+        ok = (mod_websocket_write_fragment(state, opcode, first, 1, out,
+                                           held) == APR_SUCCESS);
+        first = 0;
+    }
+
+    zstream_release(params, stream, !ok);
+    file_reader_close(&reader);
+    free(in);
+    free(out);
+
+    if (!ok) {
+        if (!first) {
+            state->closing = 1;
+            outbox_evict(state, "could not finish sending a compressed file");
+        }
+        return 0;
+    }
+    return (apr_ssize_t) length;
+}
+
+/*
+ * Writes a frame with the given header, whose payload is length bytes of a
+ * file, to the output filters. The file is read FILE_CHUNK_SIZE bytes at a time,
+ * and each chunk is flushed before the next is read. A file bucket would save
+ * the copy, but reading one seeks the plugin's file, which another thread may
+ * be sending too. Returns 0 on failure; a failure after the header has gone
+ * out leaves the frame unfinished, so the connection is evicted.
+ */
+static int mod_websocket_write_file_filtered(WebSocketState *state,
+                                             const unsigned char *header,
+                                             apr_size_t pos, apr_file_t *file,
+                                             apr_off_t offset,
+                                             apr_size_t length)
+{
+    ap_filter_t *of = state->r->connection->output_filters;
+    WebSocketFileReader reader;
+    unsigned char *buf;
+    int started = 0;
+    int ok = 0;
+
+    if (file_reader_open(&reader, file) != APR_SUCCESS) {
+        return 0;
+    }
+
+    if ((buf = malloc(FILE_CHUNK_SIZE)) != NULL) {
+        for (;;) {
+            apr_size_t len = (length > FILE_CHUNK_SIZE) ? FILE_CHUNK_SIZE :
+                                                          length;
+
+            /* Read before writing the header, so a bad range sends nothing. */
+            if (file_reader_read(&reader, buf, len, offset) != APR_SUCCESS) {
+                break;
+            }
+            if (!started) {
+                started = 1;
+                ap_fwrite(of, state->obb, (const char *) header, pos);
+            }
+            if ((ap_fwrite(of, state->obb, (const char *) buf,
+                           len) != APR_SUCCESS) ||
+                (mod_websocket_flush(state) != APR_SUCCESS)) {
+                break;
+            }
+
+            offset += len;
+            length -= len;
+            if (length == 0) {
+                ok = 1;
+                break;
+            }
+        }
+        free(buf);
+    }
+
+    file_reader_close(&reader);
+
+    if (!ok && started) {
+        state->closing = 1;
+        outbox_evict(state, "could not finish sending a file");
+    }
+    return ok;
+}
+
+/*
+ * Writes a text or binary frame whose payload is length bytes of a file,
+ * starting at offset. The server state must be locked upon entering this
+ * function. The file's position is neither used nor moved.
+ *
+ * With direct I/O, the payload isn't read into memory at all: it is sent with
+ * sendfile() right away, along with everything written before it. Behind other
+ * filters, it is read and passed down in pieces. With permessage-deflate, it
+ * has to be compressed, so it is streamed through the deflate stream instead.
+ */
+static size_t mod_websocket_write_file(WebSocketState *state, const int type,
+                                       apr_file_t *file, apr_off_t offset,
+                                       apr_size_t length)
+{
+    unsigned char header[FRAME_HEADER_MAX];
+    unsigned char opcode;
+    apr_size_t pos;
+
+    if ((state->r == NULL) || (state->obb == NULL) || state->closing ||
+        ((type != MESSAGE_TYPE_TEXT) && (type != MESSAGE_TYPE_BINARY))) {
+        return 0;
+    }
+    opcode = (type == MESSAGE_TYPE_TEXT) ? OPCODE_TEXT : OPCODE_BINARY;
+
+    if (length == 0) {
+        return mod_websocket_write_frame(state, type, NULL, 0);
+    }
+
+    /* Make room for the frame; flushing would also free the payload. */
+    if (state->direct_io &&
+        (state->direct_out.frames == DIRECT_FRAMES_MAX) &&
+        (mod_websocket_flush(state) != APR_SUCCESS)) {
+        return 0;
+    }
+
+    /* Without a deflate stream to spare, the file goes out uncompressed. */
+    if ((state->deflate != NULL) && (length >= state->deflate->min_size)) {
+        apr_ssize_t sent = mod_websocket_write_file_deflated(state, opcode,
+                                                             file, offset,
+                                                             length);
+
+        if (sent >= 0) {
+            return (size_t) sent;
+        }
+    }
+
+    pos = encode_frame_header(header, opcode, 0, (apr_uint64_t) length);
+
+    if (state->direct_io) {
+        WebSocketDirectOutput *out = &state->direct_out;
+
+        memcpy(out->headers[out->frames], header, pos);
+        out->vec[out->nvec].iov_base = (void *) out->headers[out->frames];
+        out->vec[out->nvec].iov_len = pos;
+        out->nvec++;
+        out->frames++;
+
+        out->file = file;
+        out->file_offset = offset;
+        out->file_len = length;
+
+        /* Only one file fits in the output at a time. */
+        if (mod_websocket_flush(state) != APR_SUCCESS) {
+            return 0;
+        }
+    }
+    else if (!mod_websocket_write_file_filtered(state, header, pos, file,
+                                                offset, length)) {
+        return 0;
+    }
+
+    return length;
+}
+
+/*
+ * Writes the pong for the latest ping from the client, if it hasn't been
+ * answered yet, so that it goes out with the next flush. Must be called from
+ * the main thread, with the server state locked.
+ */
+static void mod_websocket_write_pong(WebSocketState *state)
+{
+    if (state->pong_pending) {
+        mod_websocket_write_frame(state, MESSAGE_TYPE_PONG, state->pong,
+                                  state->pong_len);
+        state->pong_pending = 0;
+    }
+}
+
+typedef struct
+{
+    int type;
+    const unsigned char * buffer;
+    size_t buffer_size;
+    WebSocketPreparedMessage *prepared; /* if set, sent instead of buffer */
+    apr_file_t *file; /* if set, buffer_size bytes of it are sent from offset */
+    apr_off_t offset;
+    int done;
+    size_t written;
+} WebSocketMessageData;
+
+/*
+ * Writes a message from plugin_send() or send_prepared() without flushing it.
+ * The server state must be locked upon entering this function.
+ */
+static size_t mod_websocket_write_message(WebSocketState *state,
+                                          const WebSocketMessageData *msg)
+{
+    if (msg->prepared != NULL) {
+        return mod_websocket_write_prepared(state, msg->prepared);
+    }
+    if (msg->file != NULL) {
+        return mod_websocket_write_file(state, msg->type, msg->file,
+                                        msg->offset, msg->buffer_size);
+    }
+    return mod_websocket_write_frame(state, msg->type, msg->buffer,
+                                     msg->buffer_size);
+}
+
+/*
+ * Sends a message via the WebSocket. Returns the number of bytes that are
+ * actually written.
+ *
+ * If this function is called from a different thread than the one running the
+ * main framing loop, the message will be queued and the calling thread will
+ * block until the data is written by the main thread.
+ */
+static size_t mod_websocket_send_message(const WebSocketServer *server,
+                                         WebSocketMessageData *msg)
+{
+    size_t written = 0;
+
+    if ((server != NULL) && (server->state != NULL)) {
+        WebSocketState *state = server->state;
+
+        apr_thread_mutex_lock(state->mutex);
+
+        if (apr_os_thread_equal(apr_os_thread_current(), state->main_thread)) {
+            /* This is the main thread. It's safe to write messages directly. */
+            mod_websocket_write_pong(state);
+            written = mod_websocket_write_message(state, msg);
+
+            if (mod_websocket_flush(state) != APR_SUCCESS) {
+                written = 0;
+            }
+        }
+        else if ((state->pollset != NULL) && (state->queue != NULL) &&
+                 !state->closing) {
+            /* Dispatch this message to the main thread. */
+            apr_status_t rv;
+
+            /* Queue the message. */
+            do {
+                rv = apr_queue_push(state->queue, msg);
+            } while (APR_STATUS_IS_EINTR(rv));
+
+            if (rv != APR_SUCCESS) {
+                /* Couldn't push the message onto the queue. */
+                goto send_unlock;
+            }
+
+            /* Interrupt the pollset. */
+            rv = apr_pollset_wakeup(state->pollset);
+
+            if (rv != APR_SUCCESS) {
+                /*
+                 * Couldn't wake up poll...? We can't return zero since we've
+                 * already pushed the message, and it might actually be sent...
+                 */
+                /* TODO: log. */
+            }
+
+            /* Wait for the message to be written. */
+            while (!msg->done && !state->closing) {
+                apr_thread_cond_wait(state->cond, state->mutex);
+            }
+
+            if (msg->done) {
+                written = msg->written;
+            }
+        }
+
+send_unlock:
+        apr_thread_mutex_unlock(state->mutex);
+    }
+
+    return written;
+}
+
+/*
+ * Sends a buffer of data via the WebSocket. Returns the number of bytes that
+ * are actually written.
+ */
+static size_t CALLBACK mod_websocket_plugin_send(const WebSocketServer *server,
+                                                 const int type,
+                                                 const unsigned char *buffer,
+                                                 const size_t buffer_size)
+{
+    WebSocketMessageData msg = { 0 };
+
+    /* Deal with size more that 63 bits - FIXME */
+    /* FIXME - if sending a zero-length message, the API cannot distinguish
+     * between success and failure */
+    msg.type = type;
+    msg.buffer = buffer;
+    msg.buffer_size = buffer_size;
+
+    return mod_websocket_send_message(server, &msg);
+}
+
+/*
+ * Sends length bytes of a file, starting at offset, as a single text or binary
+ * message, without reading the file into memory where possible. Returns the
+ * number of bytes written. As with send(), a call from any thread but the
+ * connection's own waits until the message has been written, so the file only
+ * needs to stay open until this returns.
+ */
+static size_t CALLBACK mod_websocket_send_file(const WebSocketServer *server,
+                                               const int type,
+                                               struct apr_file_t *file,
+                                               const uint64_t offset,
+                                               const size_t length)
+{
+    WebSocketMessageData msg = { 0 };
+    /* The range has to fit in an apr_off_t, which is signed, maybe 32-bit. */
+    apr_uint64_t max_offset = (sizeof(apr_off_t) < 8) ? APR_INT32_MAX :
+                                                        APR_INT64_MAX;
+
+    if ((file == NULL) || (offset > max_offset) ||
+        ((apr_uint64_t) length > max_offset - offset)) {
+        return 0;
+    }
+
+    msg.type = type;
+    msg.buffer_size = length;
+    msg.file = file;
+    msg.offset = (apr_off_t) offset;
+
+    return mod_websocket_send_message(server, &msg);
+}
+
+/*
+ * Frames (but doesn't send) a text or binary message, so that it can be sent
+ * to many connections with send_prepared() without being copied or compressed
+ * again for each one. The caller owns the returned message and must pass it to
+ * release_message() when done; it may be sent from any thread, to connections
+ * on any thread, in the meantime. Returns NULL on failure.
+ */
+static WebSocketPreparedMessage *CALLBACK mod_websocket_prepare_message(const WebSocketServer *server,
+                                                                       const int type,
+                                                                       const unsigned char *buffer,
+                                                                       const size_t buffer_size)
+{
+    WebSocketPreparedMessage *msg;
+    unsigned char opcode;
+
+    switch (type) {
+    case MESSAGE_TYPE_TEXT:
+        opcode = OPCODE_TEXT;
+        break;
+    case MESSAGE_TYPE_BINARY:
+        opcode = OPCODE_BINARY;
+        break;
+    default:
+        return NULL;
+    }
+
+    if ((buffer == NULL) && (buffer_size > 0)) {
+        return NULL;
+    }
+
+    msg = malloc(sizeof(WebSocketPreparedMessage) + FRAME_HEADER_MAX +
+                 buffer_size);
+    if (msg == NULL) {
+        return NULL;
+    }
+    memset(msg, 0, sizeof(WebSocketPreparedMessage));
+
+    msg->refcount = 1;
+    msg->opcode = opcode;
+    msg->plain.len = build_frame(msg->plain.data, opcode, 0, buffer,
+                                 buffer_size);
+    msg->payload = msg->plain.data + (msg->plain.len - buffer_size);
+    msg->payload_size = buffer_size;
+
+    return msg;
+}
+
+/*
+ * Sends a prepared message via the WebSocket, exactly as plugin_send() would.
+ * Returns the number of (uncompressed) payload bytes written.
+ */
+static size_t CALLBACK mod_websocket_send_prepared(const WebSocketServer *server,
+                                                   WebSocketPreparedMessage *message)
+{
+    WebSocketMessageData msg = { 0 };
+
+    if (message == NULL) {
+        return 0;
+    }
+
+    msg.prepared = message;
+
+    return mod_websocket_send_message(server, &msg);
+}
+
+/*
+ * Drops the caller's reference to a prepared message. The message is freed
+ * once every frame that refers to it has been flushed.
+ */
+static void CALLBACK mod_websocket_release_message(const WebSocketServer *server,
+                                                   WebSocketPreparedMessage *message)
+{
+    if (message != NULL) {
+        prepared_message_release(message);
+    }
+}
+
+static void CALLBACK mod_websocket_plugin_close(const WebSocketServer *
+                                                server)
+{
+    if (server != NULL) {
+        /* Send closing handshake */
+        mod_websocket_plugin_send(server, MESSAGE_TYPE_CLOSE, NULL, 0);
+    }
+}
+
+/*
+ * Timers are run by the framing loop itself: it wakes up from poll() in time
+ * for the earliest deadline and calls every timer that has come due. They are
+ * allocated with malloc() rather than from a pool, since plugins may add and
+ * cancel them from any thread.
+ */
+typedef struct _WebSocketTimer
+{
+    struct _WebSocketTimer *next;
+    apr_interval_time_t interval;
+    apr_time_t deadline;
+    WS_TimerCallback callback;
+    void *data;
+} WebSocketTimer;
+
+/*
+ * Adds a timer that calls the given callback on the framing loop every
+ * interval_ms milliseconds, until it is cancelled or the connection closes.
+ * Returns NULL on failure.
+ */
+static WebSocketTimer *CALLBACK mod_websocket_timer_add(const WebSocketServer *server,
+                                                        const unsigned int interval_ms,
+                                                        WS_TimerCallback callback,
+                                                        void *data)
+{
+    WebSocketTimer *timer = NULL;
+
+    if ((server != NULL) && (server->state != NULL) &&
+        (interval_ms > 0) && (callback != NULL) &&
+        ((timer = malloc(sizeof(WebSocketTimer))) != NULL)) {
+        WebSocketState *state = server->state;
+
+        timer->interval = apr_time_from_msec(interval_ms);
+        timer->deadline = apr_time_now() + timer->interval;
+        timer->callback = callback;
+        timer->data = data;
+
+        apr_thread_mutex_lock(state->timer_mutex);
+        timer->next = state->timers;
+        state->timers = timer;
+        apr_thread_mutex_unlock(state->timer_mutex);
+
+        if (!apr_os_thread_equal(apr_os_thread_current(), state->main_thread)) {
+            /* The framing loop may be asleep; make it recompute its timeout. */
+            apr_thread_mutex_lock(state->mutex);
+            if (state->pollset != NULL) {
+                apr_pollset_wakeup(state->pollset);
+            }
+            apr_thread_mutex_unlock(state->mutex);
+        }
+    }
+
+    return timer;
+}
+
+/*
+ * Cancels a timer returned by mod_websocket_timer_add(). After this returns,
+ * the callback will not be called again (unless this is called from another
+ * thread while the callback is running). A timer may only be cancelled once.
+ */
+static void CALLBACK mod_websocket_timer_cancel(const WebSocketServer *server,
+                                                WebSocketTimer *timer)
+{
+    if ((server != NULL) && (server->state != NULL) && (timer != NULL)) {
+        WebSocketState *state = server->state;
+        WebSocketTimer **link;
+
+        apr_thread_mutex_lock(state->timer_mutex);
+        for (link = &state->timers; *link != NULL; link = &(*link)->next) {
+            if (*link == timer) {
+                *link = timer->next;
+                free(timer);
+                break;
+            }
+        }
+        apr_thread_mutex_unlock(state->timer_mutex);
+    }
+}
+
+/*
+ * Calls every timer that has come due. Returns the time until the next
+ * deadline, or -1 if there are no timers.
+ *
+ * The timer mutex is not held during the callbacks, so they may freely add and
+ * cancel timers (including their own).
+ */
+static apr_interval_time_t mod_websocket_run_timers(const WebSocketServer *server)
+{
+    WebSocketState *state = server->state;
+    WebSocketTimer *timer;
+    apr_interval_time_t next = -1;
+    apr_time_t now = apr_time_now();
+
+    for (;;) {
+        WS_TimerCallback callback = NULL;
+        void *data = NULL;
+
+        apr_thread_mutex_lock(state->timer_mutex);
+        for (timer = state->timers; timer != NULL; timer = timer->next) {
+            if (timer->deadline <= now) {
+                callback = timer->callback;
+                data = timer->data;
+
+                /* If we've fallen behind, don't try to catch up. */
+                timer->deadline += timer->interval;
+                if (timer->deadline <= now) {
+                    timer->deadline = now + timer->interval;
+                }
+                break;
+            }
+        }
+        apr_thread_mutex_unlock(state->timer_mutex);
+
+        if (callback == NULL) {
+            break;
+        }
+        callback(server, data);
+    }
+
+    now = apr_time_now();
+
+    apr_thread_mutex_lock(state->timer_mutex);
+    for (timer = state->timers; timer != NULL; timer = timer->next) {
+        apr_interval_time_t remaining = timer->deadline - now;
+
+        if (remaining < 0) {
+            remaining = 0;
+        }
+        if ((next < 0) || (remaining < next)) {
+            next = remaining;
+        }
+    }
+    apr_thread_mutex_unlock(state->timer_mutex);
+
+    return next;
+}
+
+/*
+ * The publish/subscribe hub lets connections in the same child process
+ * subscribe to named topics, so that a plugin can send a message to every
+ * subscriber with a single publish() call.
+ *
+ * Each topic keeps an array of its subscriptions, and each subscription knows
+ * its own index in that array, so subscribing and unsubscribing take constant
+ * time no matter how many connections share a topic. The hub's mutex only
+ * guards the table of topics; a publish holds just the topic's own mutex while
+ * it hands the message to each subscriber. Publishing never writes to a socket:
+ * the message is put in the connection's outbox, and its framing loop sends it.
+ *
+ * Lock order: a connection's sub_mutex, then hub_mutex, then a topic's mutex,
+ * then a connection's outbox_mutex.
+ */
+typedef struct _WebSocketOutboxEntry
+{
+    struct _WebSocketOutboxEntry *next;
+    WebSocketPreparedMessage *msg;
+    const char *key;    /* conflation key, or NULL */
+    apr_time_t expires; /* dropped if not written by then, unless 0 */
+} WebSocketOutboxEntry;
+
+typedef struct
+{
+    apr_pool_t *pool;
+    const char *name;
+    apr_thread_mutex_t *mutex;
+    apr_uint32_t refcount; /* subscriptions and publishes; guarded by hub_mutex */
+    struct _WebSocketSubscription **subscribers;
+    apr_size_t count;
+    apr_size_t capacity;
+} WebSocketTopic;
+
+typedef struct _WebSocketSubscription
+{
+    struct _WebSocketSubscription *next; /* in the connection's list */
+    WebSocketTopic *topic;
+    WebSocketState *state;
+    apr_size_t index; /* in topic->subscribers */
+} WebSocketSubscription;
+
+static apr_thread_mutex_t *hub_mutex;
+static apr_pool_t *hub_pool;
+static apr_hash_t *hub_topics;
+
+/*
+ * Looks up a topic and takes a reference to it, optionally creating it.
+ * Returns NULL if the topic doesn't exist (or can't be created).
+ */
+static WebSocketTopic *hub_topic_get(const char *name, int create)
+{
+    WebSocketTopic *topic;
+
+    apr_thread_mutex_lock(hub_mutex);
+
+    topic = apr_hash_get(hub_topics, name, APR_HASH_KEY_STRING);
+
+    if ((topic == NULL) && create) {
+        apr_pool_t *pool;
+
+        if (apr_pool_create(&pool, hub_pool) == APR_SUCCESS) {
+            topic = apr_pcalloc(pool, sizeof(WebSocketTopic));
+            topic->pool = pool;
+            topic->name = apr_pstrdup(pool, name);
+
+            if (apr_thread_mutex_create(&topic->mutex,
+                                        APR_THREAD_MUTEX_DEFAULT,
+                                        pool) == APR_SUCCESS) {
+                apr_hash_set(hub_topics, topic->name, APR_HASH_KEY_STRING,
+                             topic);
+            }
+            else {
+                apr_pool_destroy(pool);
+                topic = NULL;
+            }
+        }
+    }
+
+    if (topic != NULL) {
+        topic->refcount++;
+    }
+
+    apr_thread_mutex_unlock(hub_mutex);
+
+    return topic;
+}
+
+/* Drops a reference to a topic, freeing it once nothing refers to it. */
+static void hub_topic_put(WebSocketTopic *topic)
+{
+    apr_thread_mutex_lock(hub_mutex);
+
+    if (--topic->refcount == 0) {
+        apr_hash_set(hub_topics, topic->name, APR_HASH_KEY_STRING, NULL);
+        free(topic->subscribers);
+        apr_pool_destroy(topic->pool);
+    }
+
+    apr_thread_mutex_unlock(hub_mutex);
+}
+
+/*
+ * Message data held in memory -- incoming messages being put back together,
+ * and messages published to connections that haven't sent them yet -- is
+ * counted per child against WebSocketMaxBufferedMemory, so that many
+ * connections that are each within their own limits can't add up to more than
+ * the child can hold. Nothing is counted unless the limit is set.
+ */
+static apr_thread_mutex_t *buffered_mutex;
+static apr_size_t buffered_memory; /* bytes currently counted */
+
+/*
+ * Counts len more bytes of message data. Returns 0, without counting them, if
+ * that would go over the limit, unless force is set.
+ */
+static int buffered_reserve(apr_size_t len, int force)
+{
+    int fits;
+
+    if (!buffered_memory_limit) {
+        return 1;
+    }
+
+    apr_thread_mutex_lock(buffered_mutex);
+    fits = (buffered_memory + len <= buffered_memory_limit);
+    if (fits || force) {
+        buffered_memory += len;
+    }
+    apr_thread_mutex_unlock(buffered_mutex);
+
+    return fits || force;
+}
+
+static void buffered_release(apr_size_t len)
+{
+    if (buffered_memory_limit && len) {
+        apr_thread_mutex_lock(buffered_mutex);
+        buffered_memory -= len;
+        apr_thread_mutex_unlock(buffered_mutex);
+    }
+}
+
+/*
+ * Messages in the outbox may carry a conflation key. A new message with the
+ * same key as one that hasn't been sent yet replaces it in place, so for data
+ * where only the latest value matters, a slow client's backlog is bounded by
+ * the number of keys rather than by the rate of updates. The waiting keyed
+ * entries are found through a small open-addressed hash table, which is
+ * emptied whenever the framing loop takes the outbox.
+ */
+static apr_size_t outbox_key_slot(WebSocketState *state, const char *key)
+{
+    apr_ssize_t len = APR_HASH_KEY_STRING;
+    apr_size_t mask = state->outbox_keys_size - 1;
+    apr_size_t slot = apr_hashfunc_default(key, &len) & mask;
+
+    while ((state->outbox_keys[slot] != NULL) &&
+           strcmp(state->outbox_keys[slot]->key, key)) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+/*
+ * Adds an entry to the key table, growing it as needed so that it stays at
+ * most half full. Returns 0 if the table couldn't be grown.
+ */
+static int outbox_key_add(WebSocketState *state, WebSocketOutboxEntry *entry)
+{
+    if ((state->outbox_keys_count + 1) * 2 > state->outbox_keys_size) {
+        apr_size_t size = state->outbox_keys_size ?
+                          (state->outbox_keys_size * 2) : 64;
+        WebSocketOutboxEntry **old = state->outbox_keys;
+        apr_size_t old_size = state->outbox_keys_size;
+        apr_size_t i;
+
+        state->outbox_keys = calloc(size, sizeof(*state->outbox_keys));
+        if (state->outbox_keys == NULL) {
+            state->outbox_keys = old;
+            return 0;
+        }
+        state->outbox_keys_size = size;
+
+        for (i = 0; i < old_size; ++i) {
+            if (old[i] != NULL) {
+                state->outbox_keys[outbox_key_slot(state, old[i]->key)] =
+                    old[i];
+            }
+        }
+        free(old);
+    }
+
+    state->outbox_keys[outbox_key_slot(state, entry->key)] = entry;
+    state->outbox_keys_count++;
+
+    return 1;
+}
+
+/*
+ * Marks a connection as too slow to keep, and wakes up its framing loop to
+ * close it. Nothing more is queued for it in the meantime. The outbox must be
+ * locked upon entering outbox_evict_locked().
+ */
+static void outbox_evict_locked(WebSocketState *state, const char *reason)
+{
+    if (state->evicted == NULL) {
+        state->evicted = reason;
+        if (state->pollset != NULL) {
+            apr_pollset_wakeup(state->pollset);
+        }
+    }
+}
+
+static void outbox_evict(WebSocketState *state, const char *reason)
+{
+    apr_thread_mutex_lock(state->outbox_mutex);
+    outbox_evict_locked(state, reason);
+    apr_thread_mutex_unlock(state->outbox_mutex);
+}
+
+/*
+ * Enforces WebSocketMaxPendingBytes, WebSocketMaxSendDelay, and
+ * WebSocketMaxBufferedMemory for a message about to be published to a
+ * connection, evicting the connection if it has fallen too far behind. This is
+ * checked by the publisher, so that a connection stuck writing to a slow
+ * client is evicted (and stops taking memory) even though its own thread can't
+ * notice. The outbox must be locked.
+ *
+ * A message is shared by every connection it is queued for, so it is counted
+ * against WebSocketMaxBufferedMemory only once, by the first connection to
+ * admit it, until its last reference is released. Only the thread that made
+ * the message queues it, so that needs no lock of its own.
+ */
+static int outbox_admit(WebSocketState *state, WebSocketPreparedMessage *msg)
+{
+    apr_size_t size = msg->plain.len;
+
+    if (state->evicted != NULL) {
+        return 0;
+    }
+
+    if ((state->max_pending_bytes > 0) &&
+        (state->pending_bytes + size > state->max_pending_bytes)) {
+        outbox_evict_locked(state, "more than WebSocketMaxPendingBytes "
+                                   "waiting to be sent");
+        return 0;
+    }
+
+    if ((state->max_send_delay > 0) && state->pending_since &&
+        (apr_time_now() - state->pending_since > state->max_send_delay)) {
+        outbox_evict_locked(state, "a message waited longer than "
+                                   "WebSocketMaxSendDelay to be sent");
+        return 0;
+    }
+
+    /*
+     * Once the child is out of memory for buffered messages, the connections
+     * that are furthest behind (and so hold the most of it) are let go, so
+     * that the ones keeping up don't lose anything. A message that is already
+     * counted adds nothing, but is still refused while the child is over.
+     */
+    if (!buffered_reserve(msg->buffered ? 0 : size,
+                          state->pending_bytes < state->low_watermark)) {
+        outbox_evict_locked(state, "WebSocketMaxBufferedMemory reached with "
+                                   "data waiting to be sent");
+        return 0;
+    }
+    if (buffered_memory_limit) {
+        msg->buffered = size;
+    }
+
+    return 1;
+}
+
+/*
+ * Puts a message in a connection's outbox, waking up its framing loop if the
+ * outbox was empty. The loop takes the whole outbox at once, so one wakeup is
+ * enough no matter how many messages arrive in the meantime.
+ *
+ * If a key is given and a message with the same key is still waiting, the new
+ * message takes its place instead. If an expiry time is given, the message is
+ * dropped instead of written if it is still waiting by then.
+ *
+ * Returns 0 if the message couldn't be queued, including when the connection
+ * is being evicted for falling behind.
+ */
+static int outbox_push(WebSocketState *state, WebSocketPreparedMessage *msg,
+                       const char *key, apr_time_t expires)
+{
+    apr_size_t key_len = (key != NULL) ? (strlen(key) + 1) : 0;
+    WebSocketOutboxEntry *entry = malloc(sizeof(WebSocketOutboxEntry) +
+                                         key_len);
+    WebSocketPreparedMessage *replaced = NULL;
+
+    if (entry == NULL) {
+        return 0;
+    }
+
+    entry->next = NULL;
+    entry->msg = msg;
+    entry->key = NULL;
+    entry->expires = expires;
+
+    apr_thread_mutex_lock(state->outbox_mutex);
+
+    if (!outbox_admit(state, msg)) {
+        apr_thread_mutex_unlock(state->outbox_mutex);
+        free(entry);
+        return 0;
+    }
+
+    apr_atomic_inc32(&msg->refcount);
+
+    if (key != NULL) {
+        WebSocketOutboxEntry *waiting = NULL;
+
+        if (state->outbox_keys_count > 0) {
+            waiting = state->outbox_keys[outbox_key_slot(state, key)];
+        }
+
+        if (waiting != NULL) {
+            replaced = waiting->msg;
+            waiting->msg = msg;
+            waiting->expires = expires;
+            state->pending_bytes -= replaced->plain.len;
+        }
+        else {
+            entry->key = memcpy(entry + 1, key, key_len);
+            if (!outbox_key_add(state, entry)) {
+                entry->key = NULL; /* queue it anyway, just unconflated */
+            }
+        }
+    }
+
+    state->pending_bytes += msg->plain.len;
+    if (state->pending_bytes >= state->low_watermark) {
+        state->backed_up = 1;
+    }
+
+    if (replaced == NULL) {
+        if (state->outbox_tail != NULL) {
+            state->outbox_tail->next = entry;
+        }
+        else {
+            state->outbox = entry;
+            if (state->max_send_delay > 0) {
+                state->outbox_since = apr_time_now();
+                if (!state->pending_since) {
+                    state->pending_since = state->outbox_since;
+                }
+            }
+            if (state->pollset != NULL) {
+                apr_pollset_wakeup(state->pollset);
+            }
+        }
+        state->outbox_tail = entry;
+    }
+
+    apr_thread_mutex_unlock(state->outbox_mutex);
+
+    if (replaced != NULL) {
+        prepared_message_release(replaced);
+        free(entry);
+    }
+
+    return 1;
+}
+
+/* Takes every message waiting in a connection's outbox, oldest first. */
+static WebSocketOutboxEntry *outbox_take(WebSocketState *state)
+{
+    WebSocketOutboxEntry *entries;
+
+    apr_thread_mutex_lock(state->outbox_mutex);
+    entries = state->outbox;
+    state->outbox = state->outbox_tail = NULL;
+    if (state->outbox_keys_count > 0) {
+        memset(state->outbox_keys, 0,
+               state->outbox_keys_size * sizeof(*state->outbox_keys));
+        state->outbox_keys_count = 0;
+    }
+    apr_thread_mutex_unlock(state->outbox_mutex);
+
+    return entries;
+}
+
+/*
+ * Called once the messages taken from the outbox have been flushed, to stop
+ * counting them against the connection's limits. They stop counting against
+ * WebSocketMaxBufferedMemory once they are released.
+ */
+static void outbox_flushed(WebSocketState *state, apr_size_t bytes)
+{
+    apr_thread_mutex_lock(state->outbox_mutex);
+    state->pending_bytes -= bytes;
+    state->pending_since = (state->outbox != NULL) ? state->outbox_since : 0;
+    apr_thread_mutex_unlock(state->outbox_mutex);
+}
+
+/* Frees a list of outbox entries, dropping their messages. */
+static void outbox_free(WebSocketOutboxEntry *entries)
+{
+    while (entries != NULL) {
+        WebSocketOutboxEntry *entry = entries;
+
+        entries = entry->next;
+        prepared_message_release(entry->msg);
+        free(entry);
+    }
+}
+
+/* Removes a subscription from its topic. The subscription itself is freed. */
+static void hub_remove(WebSocketSubscription *sub)
+{
+    WebSocketTopic *topic = sub->topic;
+    WebSocketSubscription *last;
+
+    apr_thread_mutex_lock(topic->mutex);
+    last = topic->subscribers[--topic->count];
+    topic->subscribers[sub->index] = last;
+    last->index = sub->index;
+    apr_thread_mutex_unlock(topic->mutex);
+
+    hub_topic_put(topic);
+    free(sub);
+}
+
+/*
+ * Subscribes the connection to a topic, so that it receives every message
+ * published to that topic. Returns 1 on success (including if the connection
+ * was already subscribed), and 0 on failure.
+ */
+static int CALLBACK mod_websocket_subscribe(const WebSocketServer *server,
+                                            const char *name)
+{
+    WebSocketState *state;
+    WebSocketSubscription *sub;
+    WebSocketTopic *topic;
+    int ret = 0;
+
+    if ((server == NULL) || (server->state == NULL) || (name == NULL)) {
+        return 0;
+    }
+    state = server->state;
+
+    apr_thread_mutex_lock(state->sub_mutex);
+
+    if (state->unsubscribed) {
+        goto subscribe_unlock;
+    }
+
+    for (sub = state->subscriptions; sub != NULL; sub = sub->next) {
+        if (!strcmp(sub->topic->name, name)) {
+            ret = 1;
+            goto subscribe_unlock;
+        }
+    }
+
+    if ((sub = malloc(sizeof(WebSocketSubscription))) == NULL) {
+        goto subscribe_unlock;
+    }
+    if ((topic = hub_topic_get(name, 1)) == NULL) {
+        free(sub);
+        goto subscribe_unlock;
+    }
+
+    sub->topic = topic;
+    sub->state = state;
+
+    apr_thread_mutex_lock(topic->mutex);
+    if (topic->count == topic->capacity) {
+        apr_size_t capacity = topic->capacity ? (topic->capacity * 2) : 16;
+        WebSocketSubscription **subscribers =
+            realloc(topic->subscribers, capacity * sizeof(*subscribers));
+
+        if (subscribers != NULL) {
+            topic->subscribers = subscribers;
+            topic->capacity = capacity;
+        }
+    }
+    if (topic->count < topic->capacity) {
+        sub->index = topic->count;
+        topic->subscribers[topic->count++] = sub;
+        ret = 1;
+    }
+    apr_thread_mutex_unlock(topic->mutex);
+
+    if (ret) {
+        sub->next = state->subscriptions;
+        state->subscriptions = sub;
+    }
+    else {
+        hub_topic_put(topic);
+        free(sub);
+    }
+
+subscribe_unlock:
+    apr_thread_mutex_unlock(state->sub_mutex);
+
+    return ret;
+}
+
+/* Unsubscribes the connection from a topic. */
+static void CALLBACK mod_websocket_unsubscribe(const WebSocketServer *server,
+                                               const char *name)
+{
+    WebSocketState *state;
+    WebSocketSubscription **sub;
+
+    if ((server == NULL) || (server->state == NULL) || (name == NULL)) {
+        return;
+    }
+    state = server->state;
+
+    apr_thread_mutex_lock(state->sub_mutex);
+    for (sub = &state->subscriptions; *sub != NULL; sub = &(*sub)->next) {
+        if (!strcmp((*sub)->topic->name, name)) {
+            WebSocketSubscription *found = *sub;
+
+            *sub = found->next;
+            hub_remove(found);
+            break;
+        }
+    }
+    apr_thread_mutex_unlock(state->sub_mutex);
+}
+
+/*
+ * Removes every subscription when the connection closes. Once this returns, no
+ * publisher can reach the connection.
+ */
+static void hub_unsubscribe_all(WebSocketState *state)
+{
+    apr_thread_mutex_lock(state->sub_mutex);
+    state->unsubscribed = 1;
+    while (state->subscriptions != NULL) {
+        WebSocketSubscription *sub = state->subscriptions;
+
+        state->subscriptions = sub->next;
+        hub_remove(sub);
+    }
+    apr_thread_mutex_unlock(state->sub_mutex);
+
+    outbox_free(outbox_take(state));
+
+    /* None of what was left will be sent now. */
+    apr_thread_mutex_lock(state->outbox_mutex);
+    state->pending_bytes = 0;
+    apr_thread_mutex_unlock(state->outbox_mutex);
+}
+
+/*
+ * Queues a message, with an optional conflation key and expiry time, for every
+ * connection in this process that is subscribed to the topic. Returns the
+ * number of connections the message was queued for.
+ */
+static size_t hub_publish_local(const char *name, const char *key,
+                                apr_time_t expires, const int type,
+                                const unsigned char *buffer,
+                                const size_t buffer_size)
+{
+    WebSocketTopic *topic;
+    WebSocketPreparedMessage *msg;
+    size_t count = 0;
+    apr_size_t i;
+
+    if ((topic = hub_topic_get(name, 0)) == NULL) {
+        return 0;
+    }
+
+    msg = mod_websocket_prepare_message(NULL, type, buffer, buffer_size);
+    if (msg != NULL) {
+        apr_thread_mutex_lock(topic->mutex);
+        for (i = 0; i < topic->count; ++i) {
+            count += outbox_push(topic->subscribers[i]->state, msg, key,
+                                 expires);
+        }
+        apr_thread_mutex_unlock(topic->mutex);
+
+        prepared_message_release(msg);
+    }
+
+    hub_topic_put(topic);
+
+    return count;
+}
+
+#if defined(HAVE_BROADCAST_BUS)
+
+/*
+ * With WebSocketBroadcastBusSize, published messages are also written to a
+ * ring buffer in shared memory, and every child process runs a thread that
+ * reads the ring and hands each message from another process to its own
+ * subscribers.
+ *
+ * Writers take a global mutex. Readers take no lock at all, so a reader that
+ * falls more than a ring's length behind will find its data overwritten. Every
+ * writer first advances "reserved" past the bytes it is about to overwrite,
+ * and then advances "head" once the record is complete, so a reader can tell
+ * whether what it copied was intact by checking "reserved" afterwards. The
+ * offsets are byte counts that wrap at 2^32; since the ring's size is a power
+ * of two, they wrap along with the ring.
+ *
+ * A record never wraps around the end of the ring; the space left at the end is
+ * filled with a padding record instead. Records are padded to BUS_ALIGN bytes,
+ * which is also the size of the header, so there is always room for one.
+ */
+typedef struct
+{
+    volatile apr_uint32_t reserved;      /* bytes claimed by writers */
+    volatile apr_uint32_t head;          /* bytes completely written */
+    volatile apr_uint32_t next_child_id;
+    volatile apr_uint32_t waiters;       /* readers asleep on "head" */
+    apr_uint32_t size;                   /* of the ring; a power of two */
+} WebSocketBusHeader;
+
+#define BUS_RECORD_PAD -2
+
+typedef struct
+{
+    apr_uint32_t len;       /* of the whole record, including padding */
+    apr_uint32_t origin;    /* the child that published it */
+    apr_int32_t type;       /* message type, or BUS_RECORD_PAD */
+    apr_uint32_t topic_len; /* including the terminating NUL */
+    apr_uint32_t key_len;   /* likewise, or 0 if there is no key */
+    apr_uint32_t data_len;
+    apr_int64_t expires;    /* an apr_time_t, or 0 */
+} WebSocketBusRecord;
+
+static apr_shm_t *bus_shm;
+static server_rec *bus_server;
+static apr_global_mutex_t *bus_mutex;
+static const char *bus_mutex_file;
+static apr_uint32_t bus_child_id;
+static apr_thread_t *bus_thread;
+static volatile apr_uint32_t bus_stopping;
+
+static WebSocketBusHeader *bus_header(void)
+{
+    return apr_shm_baseaddr_get(bus_shm);
+}
+
+static unsigned char *bus_ring(void)
+{
+    return (unsigned char *) bus_header() +
+           APR_ALIGN(sizeof(WebSocketBusHeader), BUS_ALIGN);
+}
+
+/* Reads a shared offset, with a full memory barrier. */
+static apr_uint32_t bus_load(volatile apr_uint32_t *offset)
+{
+    return apr_atomic_add32(offset, 0);
+}
+
+/*
+ * Waits for something to be published past the given position, for at most
+ * BUS_POLL_INTERVAL_MAX so that the reader notices when the child is stopping.
+ * On Linux, the reader sleeps on "head" itself with a futex, and is woken by
+ * bus_wake(). Elsewhere (or while a record can't be copied), it polls, with an
+ * interval that doubles from BUS_POLL_INTERVAL while nothing turns up.
+ */
+static void bus_wait(apr_uint32_t position, apr_interval_time_t *interval)
+{
+#if defined(HAVE_BUS_FUTEX)
+    WebSocketBusHeader *bus = bus_header();
+
+    if (bus_load(&bus->head) == position) {
+        struct timespec timeout;
+
+        timeout.tv_sec = BUS_POLL_INTERVAL_MAX / APR_USEC_PER_SEC;
+        timeout.tv_nsec = (BUS_POLL_INTERVAL_MAX % APR_USEC_PER_SEC) * 1000;
+
+        /*
+         * The kernel only puts us to sleep if "head" still equals position,
+         * and a publisher moving it afterwards will see us in "waiters".
+         */
+        apr_atomic_inc32(&bus->waiters);
+        syscall(SYS_futex, (void *) &bus->head, FUTEX_WAIT, position,
+                &timeout, NULL, 0);
+        apr_atomic_dec32(&bus->waiters);
+        return;
+    }
+#endif
+
+    apr_sleep(*interval);
+    *interval = (*interval < BUS_POLL_INTERVAL_MAX / 2) ?
+                (*interval * 2) : BUS_POLL_INTERVAL_MAX;
+}
+
+/* Wakes up the readers sleeping in bus_wait(), once "head" has moved. */
+static void bus_wake(WebSocketBusHeader *bus)
+{
+#if defined(HAVE_BUS_FUTEX)
+    if (bus_load(&bus->waiters) > 0) {
+        syscall(SYS_futex, (void *) &bus->head, FUTEX_WAKE, INT_MAX,
+                NULL, NULL, 0);
+    }
+#endif
+}
+
+/*
+ * Writes a published message to the bus for the other processes. Messages
+ * bigger than a quarter of the ring are only published locally, since they
+ * would overrun every reader at once.
+ */
+static void bus_publish(const char *name, const char *key, apr_time_t expires,
+                        const int type, const unsigned char *buffer,
+                        const size_t buffer_size)
+{
+    WebSocketBusHeader *bus;
+    WebSocketBusRecord *rec;
+    apr_size_t topic_len = strlen(name) + 1;
+    apr_size_t key_len = (key != NULL) ? (strlen(key) + 1) : 0;
+    apr_size_t len;
+    apr_uint32_t head;
+    apr_uint32_t offset;
+    apr_uint32_t total;
+
+    if ((bus_shm == NULL) || (buffer_size > UINT_MAX)) {
+        return;
+    }
+    bus = bus_header();
+
+    len = APR_ALIGN(sizeof(WebSocketBusRecord) + topic_len + key_len +
+                    buffer_size, BUS_ALIGN);
+    if (len > (bus->size / 4)) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, bus_server,
+                     "message for topic %s is too large for the broadcast "
+                     "bus; publishing it only within this process", name);
+        return;
+    }
+
+    if (apr_global_mutex_lock(bus_mutex) != APR_SUCCESS) {
+        return;
+    }
+
+    head = bus->head;
+    offset = head & (bus->size - 1);
+    total = (apr_uint32_t) len;
+
+    if (offset + len > bus->size) {
+        /* Pad out the end of the ring and start over at the beginning. */
+        total += bus->size - offset;
+    }
+
+    apr_atomic_xchg32(&bus->reserved, head + total);
+
+    if (offset + len > bus->size) {
+        rec = (WebSocketBusRecord *) (bus_ring() + offset);
+        rec->len = bus->size - offset;
+        rec->type = BUS_RECORD_PAD;
+        offset = 0;
+    }
+
+    rec = (WebSocketBusRecord *) (bus_ring() + offset);
+    rec->len = (apr_uint32_t) len;
+    rec->origin = bus_child_id;
+    rec->type = type;
+    rec->topic_len = (apr_uint32_t) topic_len;
+    rec->key_len = (apr_uint32_t) key_len;
+    rec->data_len = (apr_uint32_t) buffer_size;
+    rec->expires = expires;
+    memcpy(rec + 1, name, topic_len);
+    if (key_len > 0) {
+        memcpy((char *) (rec + 1) + topic_len, key, key_len);
+    }
+    if (buffer_size > 0) {
+        memcpy((char *) (rec + 1) + topic_len + key_len, buffer, buffer_size);
+    }
+
+    apr_atomic_xchg32(&bus->head, head + total);
+
+    apr_global_mutex_unlock(bus_mutex);
+
+    bus_wake(bus);
+}
+
+/*
+ * A record copied out of the ring. This is only used by the reader thread, so
+ * it is allocated with malloc() rather than from one of the child's pools.
+ */
+typedef struct
+{
+    char *buf;
+    apr_size_t size;
+} WebSocketBusCopy;
+
+/*
+ * Delivers every message published by other processes since the given
+ * position, advancing it. Returns the number of records read.
+ */
+static int bus_deliver(apr_uint32_t *position, WebSocketBusCopy *copy)
+{
+    WebSocketBusHeader *bus = bus_header();
+    apr_uint32_t size = bus->size;
+    apr_uint32_t head = bus_load(&bus->head);
+    int count = 0;
+
+    while (*position != head) {
+        apr_uint32_t offset = *position & (size - 1);
+        WebSocketBusRecord rec;
+        int valid;
+
+        memcpy(&rec, bus_ring() + offset, sizeof(rec));
+
+        /* A record being overwritten may hold garbage; check before using it. */
+        valid = (rec.len >= sizeof(rec)) && !(rec.len % BUS_ALIGN) &&
+                (rec.len <= size - offset);
+        if (valid && (rec.type != BUS_RECORD_PAD)) {
+            valid = (rec.topic_len > 0) &&
+                    (rec.topic_len <= rec.len - sizeof(rec)) &&
+                    (rec.key_len <= rec.len - sizeof(rec) - rec.topic_len) &&
+                    (rec.data_len <= rec.len - sizeof(rec) - rec.topic_len -
+                                     rec.key_len);
+            if (valid && (copy->size < rec.len)) {
+                char *bigger = realloc(copy->buf, rec.len);
+
+                if (bigger == NULL) {
+                    break; /* try again later */
+                }
+                copy->buf = bigger;
+                copy->size = rec.len;
+            }
+            if (valid) {
+                memcpy(copy->buf, bus_ring() + offset + sizeof(rec),
+                       rec.topic_len + rec.key_len + rec.data_len);
+            }
+        }
+
+        if ((bus_load(&bus->reserved) - *position) > size) {
+            valid = 0;
+        }
+
+        if (!valid) {
+            /* The writers lapped us; skip ahead to the newest data. */
+            apr_uint32_t skipped;
+
+            head = bus_load(&bus->head);
+            skipped = head - *position;
+            *position = head;
+
+            ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, bus_server,
+                         "broadcast bus reader overrun; dropped up to %u "
+                         "bytes of published messages (consider raising "
+                         "WebSocketBroadcastBusSize)", skipped);
+            break;
+        }
+
+        *position += rec.len;
+        count++;
+
+        if ((rec.type != BUS_RECORD_PAD) && (rec.origin != bus_child_id) &&
+            (copy->buf[rec.topic_len - 1] == '\0') &&
+            (!rec.key_len ||
+             (copy->buf[rec.topic_len + rec.key_len - 1] == '\0'))) {
+            const char *key = rec.key_len ? (copy->buf + rec.topic_len) : NULL;
+
+            hub_publish_local(copy->buf, key, rec.expires, rec.type,
+                              (unsigned char *) copy->buf + rec.topic_len +
+                              rec.key_len, rec.data_len);
+        }
+    }
+
+    return count;
+}
+
+/* Reads the bus for this child process until the child exits. */
+static void *APR_THREAD_FUNC bus_thread_main(apr_thread_t *thread, void *data)
+{
+    WebSocketBusCopy copy = { NULL, 0 };
+    apr_uint32_t position = bus_load(&bus_header()->head);
+    apr_interval_time_t interval = BUS_POLL_INTERVAL;
+
+    while (!apr_atomic_read32(&bus_stopping)) {
+        if (bus_deliver(&position, &copy)) {
+            interval = BUS_POLL_INTERVAL;
+        }
+        else {
+            bus_wait(position, &interval);
+        }
+    }
+
+    free(copy.buf);
+    apr_thread_exit(thread, APR_SUCCESS);
+
+    return NULL;
+}
+
+static apr_status_t bus_thread_stop(void *data)
+{
+    apr_status_t rv;
+
+    apr_atomic_set32(&bus_stopping, 1);
+    apr_thread_join(&rv, bus_thread);
+
+    return APR_SUCCESS;
+}
+
+/* Creates the ring and its mutex in the parent process. */
+static int bus_create(apr_pool_t *pconf, server_rec *s)
+{
+    apr_size_t header_size = APR_ALIGN(sizeof(WebSocketBusHeader), BUS_ALIGN);
+    apr_status_t rv;
+
+    bus_shm = NULL;
+    if (!bus_size) {
+        return OK;
+    }
+
+    rv = apr_shm_create(&bus_shm, header_size + bus_size, NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "could not create the WebSocket broadcast bus");
+        bus_shm = NULL;
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rv = ap_global_mutex_create(&bus_mutex, &bus_mutex_file, BUS_MUTEX_TYPE,
+                                NULL, s, pconf, 0);
+    if (rv != APR_SUCCESS) {
+        bus_shm = NULL;
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    memset(bus_header(), 0, header_size);
+    bus_header()->size = (apr_uint32_t) bus_size;
+
+    return OK;
+}
+
+/* Attaches a child process to the bus, and starts its reader. */
+static void bus_child_init(apr_pool_t *pchild, server_rec *s)
+{
+    apr_status_t rv;
+
+    if (bus_shm == NULL) {
+        return;
+    }
+
+    rv = apr_global_mutex_child_init(&bus_mutex, bus_mutex_file, pchild);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "could not attach to the WebSocket broadcast bus mutex");
+        bus_shm = NULL;
+        return;
+    }
+
+    bus_child_id = apr_atomic_inc32(&bus_header()->next_child_id) + 1;
+
+    bus_server = s;
+    bus_stopping = 0;
+    rv = apr_thread_create(&bus_thread, NULL, bus_thread_main, NULL, pchild);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                     "could not start the WebSocket broadcast bus reader");
+        bus_shm = NULL;
+        return;
+    }
+
+    /* Stop the reader before the hub it delivers to goes away. */
+    apr_pool_pre_cleanup_register(pchild, NULL, bus_thread_stop);
+}
+
+#endif /* HAVE_BROADCAST_BUS */
+
+/*
+ * Publishes a message to the topic's subscribers in this process and, with
+ * WebSocketBroadcastBusSize, in the others. Returns the number of connections
+ * in this process that the message was queued for.
+ */
+static size_t hub_publish(const char *name, const char *key, apr_time_t expires,
+                          const int type, const unsigned char *buffer,
+                          const size_t buffer_size)
+{
+    if ((name == NULL) ||
+        ((type != MESSAGE_TYPE_TEXT) && (type != MESSAGE_TYPE_BINARY)) ||
+        ((buffer == NULL) && (buffer_size > 0))) {
+        return 0;
+    }
+
+#if defined(HAVE_BROADCAST_BUS)
+    bus_publish(name, key, expires, type, buffer, buffer_size);
+#endif
+
+    return hub_publish_local(name, key, expires, type, buffer, buffer_size);
+}
+
+/*
+ * Queues a text or binary message for this connection without waiting for it
+ * to be written. Returns the number of bytes queued.
+ */
+static size_t outbox_send(const WebSocketServer *server, const char *key,
+                          apr_time_t expires, const int type,
+                          const unsigned char *buffer,
+                          const size_t buffer_size)
+{
+    WebSocketPreparedMessage *msg;
+    size_t queued = 0;
+
+    if ((server == NULL) || (server->state == NULL)) {
+        return 0;
+    }
+
+    msg = mod_websocket_prepare_message(server, type, buffer, buffer_size);
+    if (msg != NULL) {
+        if (!server->state->closing &&
+            outbox_push(server->state, msg, key, expires)) {
+            queued = buffer_size;
+        }
+        prepared_message_release(msg);
+    }
+
+    return queued;
+}
+
+/*
+ * Converts a time to live from the plugin API into an expiry time, where a TTL
+ * of 0 means the message never expires.
+ */
+static apr_time_t ttl_to_expiry(const unsigned int ttl_ms)
+{
+    return ttl_ms ? (apr_time_now() + apr_time_from_msec(ttl_ms)) : 0;
+}
+
+/*
+ * Like publish(), but with a conflation key: for each subscriber, a message
+ * with the same key that is still waiting to be sent is replaced by this one.
+ * A NULL key queues the message like publish() does.
+ */
+static size_t CALLBACK mod_websocket_publish_conflated(const WebSocketServer *server,
+                                                       const char *name,
+                                                       const char *key,
+                                                       const int type,
+                                                       const unsigned char *buffer,
+                                                       const size_t buffer_size)
+{
+    return hub_publish(name, key, 0, type, buffer, buffer_size);
+}
+
+/*
+ * Queues a text or binary message for this connection without waiting for it
+ * to be written, replacing any waiting message with the same conflation key.
+ * Returns the number of bytes queued.
+ */
+static size_t CALLBACK mod_websocket_send_conflated(const WebSocketServer *server,
+                                                    const char *key,
+                                                    const int type,
+                                                    const unsigned char *buffer,
+                                                    const size_t buffer_size)
+{
+    if (key == NULL) {
+        return 0;
+    }
+
+    return outbox_send(server, key, 0, type, buffer, buffer_size);
+}
+
+/*
+ * Like publish(), but each subscriber drops the message instead of sending it
+ * if it hasn't been written within ttl_ms milliseconds.
+ */
+static size_t CALLBACK mod_websocket_publish_expiring(const WebSocketServer *server,
+                                                      const char *name,
+                                                      const int type,
+                                                      const unsigned char *buffer,
+                                                      const size_t buffer_size,
+                                                      const unsigned int ttl_ms)
+{
+    return hub_publish(name, NULL, ttl_to_expiry(ttl_ms), type, buffer,
+                       buffer_size);
+}
+
+/*
+ * Queues a text or binary message for this connection without waiting for it
+ * to be written, to be dropped instead if it hasn't been written within ttl_ms
+ * milliseconds. Returns the number of bytes queued.
+ */
+static size_t CALLBACK mod_websocket_send_expiring(const WebSocketServer *server,
+                                                   const int type,
+                                                   const unsigned char *buffer,
+                                                   const size_t buffer_size,
+                                                   const unsigned int ttl_ms)
+{
+    return outbox_send(server, NULL, ttl_to_expiry(ttl_ms), type, buffer,
+                       buffer_size);
+}
+
+/*
+ * Returns the number of bytes queued for this connection (with publish(),
+ * send_conflated(), and the like) that haven't been written to the client yet.
+ * Plugins can use this to pace themselves, and then wait for on_writable().
+ */
+static size_t CALLBACK mod_websocket_pending_bytes(const WebSocketServer *server)
+{
+    size_t pending = 0;
+
+    if ((server != NULL) && (server->state != NULL)) {
+        apr_thread_mutex_lock(server->state->outbox_mutex);
+        pending = server->state->pending_bytes;
+        apr_thread_mutex_unlock(server->state->outbox_mutex);
+    }
+
+    return pending;
+}
+
+/*
+ * Stops reading from the client until resume_read() is called, so that a
+ * plugin that can't keep up with incoming messages can push back on the
+ * client. Messages that have already been read may still be delivered.
+ */
+static void CALLBACK mod_websocket_pause_read(const WebSocketServer *server)
+{
+    if ((server != NULL) && (server->state != NULL)) {
+        apr_thread_mutex_lock(server->state->outbox_mutex);
+        server->state->read_paused = 1;
+        apr_thread_mutex_unlock(server->state->outbox_mutex);
+    }
+}
+
+/* Starts reading from the client again after pause_read(). */
+static void CALLBACK mod_websocket_resume_read(const WebSocketServer *server)
+{
+    if ((server != NULL) && (server->state != NULL)) {
+        WebSocketState *state = server->state;
+
+        apr_thread_mutex_lock(state->outbox_mutex);
+        if (state->read_paused) {
+            state->read_paused = 0;
+            if (state->pollset != NULL) {
+                apr_pollset_wakeup(state->pollset);
+            }
+        }
+        apr_thread_mutex_unlock(state->outbox_mutex);
+    }
+}
+
+/*
+ * Returns a pool for allocations that are only needed while the current
+ * message is handled. It is cleared as soon as on_message() returns, so a
+ * plugin that allocates for every message doesn't make a long-lived connection
+ * grow. Returns NULL if called from any thread but the connection's own.
+ */
+static struct apr_pool_t *CALLBACK mod_websocket_message_pool(const WebSocketServer *server)
+{
+    if ((server != NULL) && (server->state != NULL) &&
+        apr_os_thread_equal(apr_os_thread_current(),
+                            server->state->main_thread)) {
+        return server->state->message_pool;
+    }
+    return NULL;
+}
+
+/*
+ * Hands the buffer of the message being delivered to on_message() over to the
+ * plugin, which must eventually pass it to free_message(). The module starts
+ * the next message in a buffer of its own. Once detached, the buffer no longer
+ * counts against WebSocketMaxBufferedMemory.
+ *
+ * Returns NULL if called outside on_message() or from any thread but the
+ * connection's own, and for messages that were spilled to a temporary file. It
+ * may also return NULL for an empty message. The plugin has to copy those.
+ */
+static unsigned char *CALLBACK mod_websocket_detach_message(const WebSocketServer *server)
+{
+    if ((server != NULL) && (server->state != NULL) &&
+        (server->state->delivered != NULL) &&
+        apr_os_thread_equal(apr_os_thread_current(),
+                            server->state->main_thread)) {
+        WebSocketMessageBuf *mb = server->state->delivered;
+        unsigned char *buf = mb->buf;
+
+        mb->buf = NULL;
+        mb->len = mb->size = 0;
+        server->state->delivered = NULL;
+        return buf;
+    }
+    return NULL;
+}
+
+/*
+ * Frees a buffer returned by detach_message(). It may be called from any
+ * thread, even after the connection has closed. NULL is ignored.
+ */
+static void CALLBACK mod_websocket_free_message(unsigned char *buffer)
+{
+    free(buffer);
+}
+
+/*
+ * Returns a pool for the plugin's long-lived state, which is destroyed after
+ * on_disconnect() returns. Unlike the request pool, nothing but the plugin
+ * allocates from it. Like any pool, it isn't thread-safe.
+ */
+static struct apr_pool_t *CALLBACK mod_websocket_connection_pool(const WebSocketServer *server)
+{
+    if ((server != NULL) && (server->state != NULL)) {
+        return server->state->connection_pool;
+    }
+    return NULL;
+}
+
+/*
+ * Sends a text or binary message to every connection subscribed to a topic,
+ * including this one if it is subscribed. The message is framed (and
+ * compressed) once for all of them, and queued rather than written, so this
+ * returns without waiting for any client. With WebSocketBroadcastBusSize, it
+ * is also passed on to subscribers in the other server processes.
+ *
+ * Returns the number of connections in this process that the message was
+ * queued for. The server argument is only used to find this function; any
+ * connection's will do.
+ */
+static size_t CALLBACK mod_websocket_publish(const WebSocketServer *server,
+                                             const char *name,
+                                             const int type,
+                                             const unsigned char *buffer,
+                                             const size_t buffer_size)
+{
+    return mod_websocket_publish_conflated(server, name, NULL, type, buffer,
+                                           buffer_size);
+}
 
 /*
  * Read a buffer of data from the input stream.
+ *
+ * When the connection uses direct I/O, the core input filter is read until it
+ * first runs dry (it may still hold data that arrived along with the
+ * handshake), after which the socket is read directly.
  */
-static apr_status_t mod_websocket_read_nonblock(request_rec *r,
+static apr_status_t mod_websocket_read_nonblock(WebSocketState *state,
                                                 apr_bucket_brigade *bb,
                                                 char *buffer,
                                                 apr_size_t *bufsiz)
 {
+    request_rec *r = state->r;
     apr_status_t rv;
 
+    if (state->direct_input) {
+        rv = apr_socket_recv(state->sock, buffer, bufsiz);
+
+        if ((rv == APR_SUCCESS) && (*bufsiz == 0)) {
+            rv = APR_EAGAIN;
+        }
+        return rv;
+    }
+
     if ((rv = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES,
                              APR_NONBLOCK_READ, *bufsiz)) == APR_SUCCESS) {
         rv = apr_brigade_flatten(bb, buffer, bufsiz);
@@ -612,6 +4344,14 @@ static apr_status_t mod_websocket_read_nonblock(request_rec *r,
 
         apr_brigade_cleanup(bb);
     }
+    else if (APR_STATUS_IS_EAGAIN(rv) && state->direct_io) {
+        /*
+         * Nothing is buffered in the core input filter anymore. From now on,
+         * read from the socket without blocking.
+         */
+        apr_socket_timeout_set(state->sock, 0);
+        state->direct_input = 1;
+    }
 
     if ((rv == APR_SUCCESS) && (*bufsiz == 0)) {
         /*
@@ -690,56 +4430,278 @@ static const char* parse_token_list_strict(apr_pool_t *p, const char *tok,
 
             *((const char **) apr_array_push(tokens)) = token;
         }
-
+
+        /*
+         * ap_get_token() breaks tokens on whitespace, semicolons, and commas.
+         * Make sure that we only get commas after a token.
+         */
+        if (*tok == ',') {
+            ++tok;
+        } else if (*tok) {
+            return apr_psprintf(p, "Encountered illegal separator '\\x%.2x'",
+                                (unsigned int) *tok);
+        }
+    }
+
+    return NULL;
+#endif
+}
+
+/*
+ * The client-supplied WebSocket protocol entry consists of a list of
+ * client-side supported protocols. Parse the list, and populate an array with
+ * those protocol names.
+ */
+static apr_status_t parse_protocol(request_rec *r,
+                                   apr_array_header_t *protocols)
+{
+    const char *sec_websocket_protocol;
+    const char *error;
+
+    sec_websocket_protocol = apr_table_get(r->headers_in,
+                                           "Sec-WebSocket-Protocol");
+
+    if (!sec_websocket_protocol) {
+        /* A missing header means we have no requested subprotocols. */
+        return APR_SUCCESS;
+    }
+
+    error = parse_token_list_strict(r->pool, sec_websocket_protocol, protocols);
+
+    if (!error && apr_is_empty_array(protocols)) {
+        /* Sec-WebSocket-Protocol must contain at least one valid token. */
+        error = "Header contains no subprotocols";
+    }
+
+    if (error) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, APR_SUCCESS, r,
+                      "Client sent invalid Sec-WebSocket-Protocol: %s", error);
+        return APR_EINVAL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Checks whether a character may appear in an HTTP token (RFC 7230). */
+static int is_token_char(char c)
+{
+    return (c > 0x20) && (c < 0x7F) && !strchr("()<>@,;:\\\"/[]?={}", c);
+}
+
+/* Skips optional whitespace. */
+static const char *skip_ows(const char *s)
+{
+    while ((*s == ' ') || (*s == '\t')) {
+        ++s;
+    }
+    return s;
+}
+
+/*
+ * Reads a token from *s and advances past it. Returns NULL if *s does not start
+ * with a token.
+ */
+static const char *read_token(apr_pool_t *p, const char **s)
+{
+    const char *end = *s;
+    const char *token;
+
+    while (is_token_char(*end)) {
+        ++end;
+    }
+    if (end == *s) {
+        return NULL;
+    }
+
+    token = apr_pstrmemdup(p, *s, end - *s);
+    *s = end;
+    return token;
+}
+
+/*
+ * Reads a quoted-string from *s (which must point at the opening quote),
+ * removing the quoting, and advances past it. Returns NULL if the string is not
+ * terminated.
+ */
+static const char *read_quoted_string(apr_pool_t *p, const char **s)
+{
+    const char *c = *s + 1;
+    char *value = apr_palloc(p, strlen(c) + 1);
+    char *v = value;
+
+    while (*c && (*c != '"')) {
+        if ((*c == '\\') && c[1]) {
+            ++c;
+        }
+        *v++ = *c++;
+    }
+    if (*c != '"') {
+        return NULL;
+    }
+
+    *v = '\0';
+    *s = c + 1;
+    return value;
+}
+
+/*
+ * Parses a *_max_window_bits value. Returns -1 unless it is a number from 8 to
+ * 15 without leading zeroes.
+ */
+static int parse_window_bits(const char *value)
+{
+    int bits;
+
+    if (!apr_isdigit(value[0]) || (value[0] == '0') ||
+        (value[1] && (!apr_isdigit(value[1]) || value[2]))) {
+        return -1;
+    }
+
+    bits = atoi(value);
+    return ((bits >= 8) && (bits <= 15)) ? bits : -1;
+}
+
+/*
+ * Applies one parameter of a permessage-deflate offer. Returns 0 if the
+ * parameter is invalid, repeated, or asks for something we can't do, in which
+ * case the whole offer has to be declined.
+ */
+static int apply_deflate_param(WebSocketDeflate *offer, const char *param,
+                               const char *value)
+{
+    int bits = 0;
+
+    if (!strcasecmp(param, "server_no_context_takeover")) {
+        if (value || offer->server_no_context_takeover) {
+            return 0;
+        }
+        offer->server_no_context_takeover = 1;
+    }
+    else if (!strcasecmp(param, "client_no_context_takeover")) {
+        if (value || offer->client_no_context_takeover) {
+            return 0;
+        }
+        offer->client_no_context_takeover = 1;
+    }
+    else if (!strcasecmp(param, "server_max_window_bits")) {
+        if (!value || offer->server_max_window_bits ||
+            ((bits = parse_window_bits(value)) < 0)) {
+            return 0;
+        }
         /*
-         * ap_get_token() breaks tokens on whitespace, semicolons, and commas.
-         * Make sure that we only get commas after a token.
+         * zlib can't produce a raw DEFLATE stream with a 256-byte window (it
+         * silently uses 512 bytes instead), so we can't honor a limit of 8.
          */
-        if (*tok == ',') {
-            ++tok;
-        } else if (*tok) {
-            return apr_psprintf(p, "Encountered illegal separator '\\x%.2x'",
-                                (unsigned int) *tok);
+        if (bits == 8) {
+            return 0;
         }
+        offer->server_max_window_bits = bits;
+    }
+    else if (!strcasecmp(param, "client_max_window_bits")) {
+        if (offer->client_max_window_bits ||
+            (value && ((bits = parse_window_bits(value)) < 0))) {
+            return 0;
+        }
+        /* Our inflater always uses the largest window, so there's no need to
+         * limit the client's. */
+        offer->client_max_window_bits = value ? bits : 15;
+    }
+    else {
+        return 0;
     }
 
-    return NULL;
-#endif
+    return 1;
 }
 
 /*
- * The client-supplied WebSocket protocol entry consists of a list of
- * client-side supported protocols. Parse the list, and populate an array with
- * those protocol names.
+ * Looks for a permessage-deflate offer (RFC 7692) in the client's
+ * Sec-WebSocket-Extensions and accepts the first one we can satisfy, filling
+ * in the negotiated parameters. Returns the Sec-WebSocket-Extensions value to
+ * respond with, or NULL if the connection should go ahead uncompressed.
  */
-static apr_status_t parse_protocol(request_rec *r,
-                                   apr_array_header_t *protocols)
+static const char *negotiate_deflate(request_rec *r, WebSocketDeflate *deflate)
 {
-    const char *sec_websocket_protocol;
-    const char *error;
-
-    sec_websocket_protocol = apr_table_get(r->headers_in,
-                                           "Sec-WebSocket-Protocol");
+    const char *s = apr_table_get(r->headers_in, "Sec-WebSocket-Extensions");
 
-    if (!sec_websocket_protocol) {
-        /* A missing header means we have no requested subprotocols. */
-        return APR_SUCCESS;
+    if (!s) {
+        return NULL;
     }
 
-    error = parse_token_list_strict(r->pool, sec_websocket_protocol, protocols);
+    while (*s) {
+        WebSocketDeflate offer = { 0 };
+        const char *name;
+        int acceptable;
 
-    if (!error && apr_is_empty_array(protocols)) {
-        /* Sec-WebSocket-Protocol must contain at least one valid token. */
-        error = "Header contains no subprotocols";
-    }
+        /* Skip empty list elements. */
+        while ((*s == ',') || (*s == ' ') || (*s == '\t')) {
+            ++s;
+        }
+        if (!*s) {
+            break;
+        }
 
-    if (error) {
-        ap_log_rerror(APLOG_MARK, APLOG_INFO, APR_SUCCESS, r,
-                      "Client sent invalid Sec-WebSocket-Protocol: %s", error);
-        return APR_EINVAL;
+        if (!(name = read_token(r->pool, &s))) {
+            goto malformed;
+        }
+        acceptable = !strcasecmp(name, "permessage-deflate");
+
+        s = skip_ows(s);
+        while (*s == ';') {
+            const char *param;
+            const char *value = NULL;
+
+            s = skip_ows(s + 1);
+            if (!(param = read_token(r->pool, &s))) {
+                goto malformed;
+            }
+
+            s = skip_ows(s);
+            if (*s == '=') {
+                s = skip_ows(s + 1);
+                value = (*s == '"') ? read_quoted_string(r->pool, &s)
+                                    : read_token(r->pool, &s);
+                if (!value) {
+                    goto malformed;
+                }
+                s = skip_ows(s);
+            }
+
+            if (acceptable) {
+                acceptable = apply_deflate_param(&offer, param, value);
+            }
+        }
+
+        if (*s && (*s != ',')) {
+            goto malformed;
+        }
+
+        if (acceptable) {
+            const char *response = apr_pstrcat(r->pool, "permessage-deflate",
+                (offer.server_no_context_takeover ?
+                    "; server_no_context_takeover" : ""),
+                (offer.client_no_context_takeover ?
+                    "; client_no_context_takeover" : ""),
+                (offer.server_max_window_bits ?
+                    apr_psprintf(r->pool, "; server_max_window_bits=%d",
+                                 offer.server_max_window_bits) : ""),
+                NULL);
+
+            if (!offer.server_max_window_bits) {
+                offer.server_max_window_bits = 15;
+            }
+            *deflate = offer;
+
+            return response;
+        }
     }
 
-    return APR_SUCCESS;
+    return NULL;
+
+malformed:
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, APR_SUCCESS, r,
+                  "Client sent invalid Sec-WebSocket-Extensions; proceeding "
+                  "without extensions");
+    return NULL;
 }
 
 /*
@@ -842,20 +4804,105 @@ static const char *make_supported_version_header(apr_pool_t *pool)
     return apr_array_pstrcat(pool, versions, ',');
 }
 
+/*
+ * Makes room for size bytes in the buffer, at least doubling it so that a
+ * message arriving in many frames isn't moved for each. Returns 0 if out of
+ * memory.
+ */
+static int message_buf_grow(WebSocketMessageBuf *mb, apr_size_t size)
+{
+    unsigned char *buf;
+
+    if (size <= mb->size) {
+        return 1;
+    }
+    if ((mb->size > 0) && (size < 2 * mb->size)) {
+        size = 2 * mb->size;
+    }
+
+    if ((buf = realloc(mb->buf, size)) == NULL) {
+        return 0;
+    }
+    mb->buf = buf;
+    mb->size = size;
+    return 1;
+}
+
+static void message_buf_free(WebSocketMessageBuf *mb)
+{
+    free(mb->buf);
+    mb->buf = NULL;
+    mb->len = mb->size = 0;
+}
+
 typedef struct _WebSocketFrameData
 {
-    struct ap_varbuf message_buf;
+    WebSocketMessageBuf message_buf;
     unsigned char fin;
     unsigned char opcode;
     unsigned int utf8_state;
     apr_int64_t message_length; /* length of the current message so far */
+    apr_size_t buffered; /* of that, counted against WebSocketMaxBufferedMemory */
+    int compressed; /* RSV1 was set on the first frame (permessage-deflate) */
 } WebSocketFrameData;
 
+/*
+ * A token bucket for one of the inbound rate limits. It fills at "rate" tokens
+ * per second, up to one second's worth, and a client may go into debt by one
+ * frame or block at most. The level is kept in millionths of a token, so that
+ * it can be topped up every microsecond.
+ */
+typedef struct
+{
+    apr_int64_t rate;   /* per second; 0 for no limit */
+    apr_int64_t level;
+    apr_time_t updated;
+} WebSocketTokenBucket;
+
+static void token_bucket_init(WebSocketTokenBucket *bucket, apr_int64_t rate,
+                              apr_time_t now)
+{
+    bucket->rate = rate;
+    bucket->level = rate * APR_USEC_PER_SEC;
+    bucket->updated = now;
+}
+
+/*
+ * Takes the given number of tokens from the bucket. Returns 0 if there were
+ * enough, or else how long it will take to pay back the debt.
+ */
+static apr_interval_time_t token_bucket_take(WebSocketTokenBucket *bucket,
+                                             apr_int64_t tokens,
+                                             apr_time_t now)
+{
+    apr_int64_t capacity = bucket->rate * APR_USEC_PER_SEC;
+
+    /* Check the elapsed time first, so that a long idle can't overflow. */
+    if (now - bucket->updated >= (capacity - bucket->level) / bucket->rate) {
+        bucket->level = capacity;
+    }
+    else {
+        bucket->level += (now - bucket->updated) * bucket->rate;
+    }
+    bucket->updated = now;
+
+    bucket->level -= tokens * APR_USEC_PER_SEC;
+    if (bucket->level >= 0) {
+        return 0;
+    }
+    return (-bucket->level + bucket->rate - 1) / bucket->rate;
+}
+
 /* Variables that need to persist across calls to mod_websocket_handle_incoming */
 typedef struct
 {
     int framing_state;
     int closing; /* should the connection be closed due to incoming data? */
+    int close_received; /* did the client send a Close frame? */
+    int message_received; /* was a message delivered since the last check? */
+    apr_time_t last_read;    /* when data last arrived from the client */
+    apr_time_t last_message; /* when a message last arrived from the client */
+    apr_time_t ping_sent;    /* when an unanswered keepalive ping was sent */
     unsigned short status_code;
     /* XXX fin and opcode appear to be duplicated with frame; can they be removed? */
     unsigned char fin;
@@ -863,6 +4910,10 @@ typedef struct
     WebSocketFrameData control_frame;
     WebSocketFrameData message_frame;
     WebSocketFrameData *frame;
+    WebSocketMessageBuf inflate_buf; /* the current message, decompressed */
+    WebSocketMessageBuf *pieces; /* earlier parts of it, for on_message_iov() */
+    apr_size_t npieces;
+    apr_size_t pieces_size;
     apr_int64_t payload_length; /* length of the current frame */
     apr_int64_t mask_offset;
     apr_int64_t extension_bytes_remaining;
@@ -870,6 +4921,12 @@ typedef struct
     int masking;
     int mask_index;
     unsigned char mask[4];
+    WebSocketTokenBucket message_bucket; /* WebSocketMessageRateLimit */
+    WebSocketTokenBucket byte_bucket;    /* WebSocketByteRateLimit */
+    WebSocketTokenBucket control_bucket; /* WebSocketControlRateLimit */
+    apr_time_t throttled_until; /* don't read from the client before then */
+    apr_pool_t *spill_pool;  /* holds spill_file; NULL unless spilling */
+    apr_file_t *spill_file;  /* the current message, over WebSocketSpillThreshold */
 } WebSocketReadState;
 
 /*
@@ -1025,6 +5082,292 @@ static int is_trusted_origin(request_rec *r, websocket_config_rec *conf,
     return 0;
 }
 
+/*
+ * Decompresses a complete permessage-deflate message into out. Fails with
+ * APR_ENOSPC as soon as the output grows past limit bytes, so that a small but
+ * highly compressed message can't be used to exhaust memory, or with
+ * APR_EGENERAL if the data isn't a valid DEFLATE stream.
+ */
+static apr_status_t mod_websocket_inflate(WebSocketDeflate *deflate,
+                                          const unsigned char *in,
+                                          apr_size_t in_len,
+                                          WebSocketMessageBuf *out,
+                                          apr_int64_t limit)
+{
+    static const unsigned char tail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+    WebSocketZStream *stream = zstream_acquire(deflate, 0);
+    z_stream *zs;
+    apr_status_t rv = APR_SUCCESS;
+    int tail_added = 0;
+
+    if (stream == NULL) {
+        return APR_ENOMEM;
+    }
+    zs = &stream->zs;
+
+    out->len = 0;
+    zs->avail_in = 0;
+
+    for (;;) {
+        int ret;
+
+        if (zs->avail_in == 0) {
+            if (in_len > 0) {
+                zs->next_in = (Bytef *) in;
+                zs->avail_in = (in_len > UINT_MAX) ? UINT_MAX : (uInt) in_len;
+                in += zs->avail_in;
+                in_len -= zs->avail_in;
+            }
+            else if (!tail_added) {
+                /* Put back the empty block that the client stripped off. */
+                zs->next_in = (Bytef *) tail;
+                zs->avail_in = sizeof(tail);
+                tail_added = 1;
+            }
+        }
+
+        if ((out->size - out->len < BLOCK_DATA_SIZE) &&
+            !message_buf_grow(out, out->len + BLOCK_DATA_SIZE)) {
+            rv = APR_ENOMEM;
+            break;
+        }
+        zs->next_out = (Bytef *) out->buf + out->len;
+        zs->avail_out = (out->size - out->len > UINT_MAX) ?
+                        UINT_MAX : (uInt) (out->size - out->len);
+
+        ret = inflate(zs, Z_SYNC_FLUSH);
+        out->len = (unsigned char *) zs->next_out - out->buf;
+
+        if ((apr_int64_t) out->len > limit) {
+            rv = APR_ENOSPC;
+            break;
+        }
+
+        if (ret == Z_STREAM_END) {
+            /* The client ended the stream with a final block; start over. */
+            inflateReset(zs);
+        }
+        else if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+            rv = APR_EGENERAL;
+            break;
+        }
+
+        if (tail_added && (zs->avail_in == 0) && (zs->avail_out > 0)) {
+            break;
+        }
+    }
+
+    zstream_release(deflate, stream, (rv != APR_SUCCESS));
+
+    return rv;
+}
+
+/*
+ * Charges the client against one of its rate limits. Returns 0 if the client is
+ * within the limit. Otherwise, depending on WebSocketRateLimitAction, either
+ * sets the status code to close the connection with (which the caller must
+ * then do), or holds off reading from the client until it is back within the
+ * limit, and returns 1.
+ */
+static int mod_websocket_rate_limit(const WebSocketServer *server,
+                                    WebSocketReadState *state,
+                                    websocket_config_rec *conf,
+                                    WebSocketTokenBucket *bucket,
+                                    apr_int64_t tokens,
+                                    const char *directive)
+{
+    apr_time_t now;
+    apr_interval_time_t wait;
+
+    if (bucket->rate <= 0) {
+        return 0;
+    }
+
+    now = apr_time_now();
+    if ((wait = token_bucket_take(bucket, tokens, now)) == 0) {
+        return 0;
+    }
+
+    if (conf->rate_limit_close) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, APR_SUCCESS, server->state->r,
+                      "closing WebSocket connection: client exceeded %s",
+                      directive);
+        state->status_code = STATUS_CODE_POLICY_VIOLATION;
+    }
+    else if (now + wait > state->throttled_until) {
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE1, APR_SUCCESS, server->state->r,
+                      "client exceeded %s; not reading for %" APR_TIME_T_FMT
+                      " microseconds", directive, wait);
+        state->throttled_until = now + wait;
+    }
+
+    return 1;
+}
+
+/*
+ * For a plugin with on_message_iov(), a message that arrives in several frames
+ * isn't put together in one buffer, which would have to be moved each time it
+ * grows. Instead, the message so far is set aside as a piece before a large
+ * enough frame, which then starts a buffer of its own. Smaller pieces are still
+ * gathered, so that a client can't make the module allocate for every byte.
+ */
+static int pieces_push(WebSocketReadState *state)
+{
+    if (state->npieces == state->pieces_size) {
+        apr_size_t size = state->pieces_size ? (2 * state->pieces_size) : 8;
+        WebSocketMessageBuf *pieces = realloc(state->pieces,
+                                              size * sizeof(*pieces));
+
+        if (pieces == NULL) {
+            return 0;
+        }
+        state->pieces = pieces;
+        state->pieces_size = size;
+    }
+
+    state->pieces[state->npieces++] = state->frame->message_buf;
+    memset(&state->frame->message_buf, 0, sizeof(state->frame->message_buf));
+    return 1;
+}
+
+/* Frees the pieces of the current message; the array is kept for the next. */
+static void pieces_clear(WebSocketReadState *state)
+{
+    apr_size_t i;
+
+    for (i = 0; i < state->npieces; ++i) {
+        message_buf_free(&state->pieces[i]);
+    }
+    state->npieces = 0;
+}
+
+/*
+ * Hands a complete message to on_message_iov(): the pieces set aside so far,
+ * followed by the rest of the message, which is given as payload.
+ */
+static void mod_websocket_deliver_iov(const WebSocketServer *server,
+                                      WebSocketReadState *state,
+                                      websocket_config_rec *conf,
+                                      void *plugin_private, int type,
+                                      unsigned char *payload,
+                                      apr_size_t payload_len)
+{
+    WebSocketIovec *iov = apr_palloc(server->state->message_pool,
+                                     (state->npieces + 1) * sizeof(*iov));
+    apr_size_t total = payload_len;
+    apr_size_t count;
+
+    for (count = 0; count < state->npieces; ++count) {
+        iov[count].buffer = state->pieces[count].buf;
+        iov[count].buffer_size = state->pieces[count].len;
+        total += state->pieces[count].len;
+    }
+
+    /* Leave out an empty last piece, unless it's the whole message. */
+    if ((payload_len > 0) || (count == 0)) {
+        iov[count].buffer = payload;
+        iov[count].buffer_size = payload_len;
+        count++;
+    }
+
+    conf->plugin->on_message_iov(plugin_private, server, type, iov, count,
+                                 total);
+}
+
+/*
+ * A message over WebSocketSpillThreshold is put together in an unlinked
+ * temporary file instead of on the heap, and handed to the plugin as a memory
+ * map of that file, so that the page cache holds large uploads rather than
+ * the child's heap. Control frames are never spilled, nor are compressed
+ * messages, which have to be decompressed into memory anyway.
+ */
+static int is_spilling(const WebSocketReadState *state)
+{
+    return (state->spill_file != NULL) &&
+           (state->frame == &state->message_frame);
+}
+
+static apr_status_t spill_write(WebSocketReadState *state,
+                                const unsigned char *data, apr_size_t len)
+{
+    return apr_file_write_full(state->spill_file, data, len, NULL);
+}
+
+/* Throws away the temporary file, along with any map of it. */
+static void spill_end(WebSocketReadState *state)
+{
+    if (state->spill_pool != NULL) {
+        apr_pool_destroy(state->spill_pool);
+        state->spill_pool = NULL;
+        state->spill_file = NULL;
+    }
+}
+
+/*
+ * Starts spilling the current message, moving whatever has been read of it so
+ * far out of memory.
+ */
+static apr_status_t spill_start(request_rec *r, WebSocketReadState *state)
+{
+    WebSocketFrameData *frame = state->frame;
+    apr_int32_t flags = APR_FOPEN_CREATE | APR_FOPEN_READ | APR_FOPEN_WRITE |
+                        APR_FOPEN_EXCL;
+    const char *tmpdir;
+    char *path;
+    apr_size_t i;
+    apr_status_t rv;
+
+#if defined(_WIN32)
+    /* An open file can't be removed on Windows; let APR do it on close. */
+    flags |= APR_FOPEN_DELONCLOSE;
+#endif
+
+    if ((rv = apr_pool_create(&state->spill_pool, r->pool)) != APR_SUCCESS) {
+        state->spill_pool = NULL;
+        return rv;
+    }
+
+    if ((rv = apr_temp_dir_get(&tmpdir, state->spill_pool)) == APR_SUCCESS) {
+        path = apr_pstrcat(state->spill_pool, tmpdir, "/websocket.XXXXXX",
+                           NULL);
+        rv = apr_file_mktemp(&state->spill_file, path, flags,
+                             state->spill_pool);
+    }
+
+    if (rv == APR_SUCCESS) {
+#if !defined(_WIN32)
+        /*
+         * Nothing needs the name, so don't leave the file behind on a crash.
+         * Once removed, the name may be reused by another connection, which
+         * is why the file isn't opened with APR_FOPEN_DELONCLOSE here.
+         */
+        apr_file_remove(path, state->spill_pool);
+#endif
+
+        for (i = 0; (i < state->npieces) && (rv == APR_SUCCESS); ++i) {
+            rv = spill_write(state, state->pieces[i].buf,
+                             state->pieces[i].len);
+        }
+        if (rv == APR_SUCCESS) {
+            rv = spill_write(state, frame->message_buf.buf,
+                             frame->message_buf.len);
+        }
+    }
+
+    if (rv != APR_SUCCESS) {
+        spill_end(state);
+        return rv;
+    }
+
+    /* Give back the memory the message was using. */
+    pieces_clear(state);
+    message_buf_free(&frame->message_buf);
+    buffered_release(frame->buffered);
+    frame->buffered = 0;
+
+    return APR_SUCCESS;
+}
+
 /**
  * Reads from the given data block until the end of the block or a frame
  * boundary is encountered, handling plugin callbacks as messages are received.
@@ -1055,11 +5398,15 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
 
     switch (state->framing_state) {
     case DATA_FRAMING_START:
+    {
         /*
-         * Since we don't currently support any extensions,
-         * the reserve bits must be 0
+         * RSV1 marks a compressed message if permessage-deflate is in use.
+         * Since we don't support any other extensions, the other reserved
+         * bits must be 0.
          */
-        if ((FRAME_GET_RSV1(block[block_offset]) != 0) ||
+        int compressed = FRAME_GET_RSV1(block[block_offset]);
+
+        if ((compressed && (server->state->deflate == NULL)) ||
             (FRAME_GET_RSV2(block[block_offset]) != 0) ||
             (FRAME_GET_RSV3(block[block_offset]) != 0)) {
             state->status_code = STATUS_CODE_PROTOCOL_ERROR;
@@ -1071,7 +5418,7 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
         state->framing_state = DATA_FRAMING_PAYLOAD_LENGTH;
 
         if (state->opcode >= 0x8) { /* Control frame */
-            if (state->fin) {
+            if (state->fin && !compressed) {
                 state->frame = &state->control_frame;
                 state->frame->opcode = state->opcode;
                 state->frame->utf8_state = UTF8_VALID;
@@ -1087,14 +5434,16 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
                 if (state->frame->fin) {
                     state->frame->opcode = state->opcode;
                     state->frame->utf8_state = UTF8_VALID;
+                    state->frame->compressed = compressed;
                 }
                 else {
                     state->status_code = STATUS_CODE_PROTOCOL_ERROR;
                     return 0;
                 }
             }
-            else if (state->frame->fin ||
+            else if (state->frame->fin || compressed ||
                      ((state->opcode = state->frame->opcode) == 0)) {
+                /* Only the first frame of a message may set RSV1. */
                 state->status_code = STATUS_CODE_PROTOCOL_ERROR;
                 return 0;
             }
@@ -1106,6 +5455,7 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
         if (block_offset >= block_size) {
             break; /* Only break if we need more data */
         }
+    }
 
     case DATA_FRAMING_PAYLOAD_LENGTH:
         state->payload_length = (apr_int64_t)
@@ -1157,7 +5507,41 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
                                       STATUS_CODE_RESERVED;
                 return 0;
             }
-            else if (state->masking != 0) {
+
+            if ((conf->spill_threshold > 0) && (state->opcode < 0x8) &&
+                !state->frame->compressed && (state->spill_file == NULL) &&
+                (state->frame->message_length > conf->spill_threshold)) {
+                apr_status_t rv = spill_start(server->state->r, state);
+
+                if (rv != APR_SUCCESS) {
+                    /* Not fatal; the message just stays in memory. */
+                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv,
+                                  server->state->r,
+                                  "could not spill large message to a "
+                                  "temporary file");
+                }
+            }
+
+            /*
+             * Control frames are small enough not to count, and spilled
+             * messages don't stay in memory.
+             */
+            if ((state->opcode < 0x8) && (state->payload_length > 0) &&
+                !is_spilling(state)) {
+                if (!buffered_reserve((apr_size_t) state->payload_length, 0)) {
+                    ap_log_rerror(APLOG_MARK, APLOG_INFO, APR_SUCCESS,
+                                  server->state->r,
+                                  "refusing message from client: "
+                                  "WebSocketMaxBufferedMemory reached");
+                    state->status_code =
+                        (server->state->protocol_version >= 13) ?
+                        STATUS_CODE_MESSAGE_TOO_LARGE : STATUS_CODE_RESERVED;
+                    return 0;
+                }
+                state->frame->buffered += (apr_size_t) state->payload_length;
+            }
+
+            if (state->masking != 0) {
                 state->framing_state = DATA_FRAMING_MASK;
             }
             else {
@@ -1190,10 +5574,29 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
     case DATA_FRAMING_EXTENSION_DATA:
         /* Deal with extension data when we support them -- FIXME */
         if (state->extension_bytes_remaining == 0) {
-            if (state->payload_length > 0) {
-                ap_varbuf_grow(&state->frame->message_buf,
-                               state->frame->message_buf.strlen +
-                                   state->payload_length);
+            WebSocketMessageBuf *mb = &state->frame->message_buf;
+            apr_size_t size;
+            int ok = 1;
+
+            if (plugin_takes_iov(conf->plugin) &&
+                (state->frame == &state->message_frame) &&
+                !state->frame->compressed && !is_spilling(state) &&
+                (mb->len >= BLOCK_DATA_SIZE) &&
+                (state->payload_length >= BLOCK_DATA_SIZE)) {
+                ok = pieces_push(state);
+            }
+
+            /* When spilling, only what's read between writes to the file. */
+            size = is_spilling(state) ?
+                   (SPILL_CHUNK_SIZE + BLOCK_DATA_SIZE) :
+                   (mb->len + (apr_size_t) state->payload_length);
+
+            if (!ok || !message_buf_grow(mb, size)) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_ENOMEM,
+                              server->state->r,
+                              "could not allocate memory for a message");
+                state->status_code = STATUS_CODE_INTERNAL_ERROR;
+                return 0;
             }
             state->framing_state = DATA_FRAMING_APPLICATION_DATA;
         }
@@ -1203,9 +5606,8 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
     {
         apr_int64_t block_data_length;
         apr_int64_t block_length = 0;
-        apr_size_t message_len = state->frame->message_buf.strlen;
-        unsigned char *message_data =
-            (unsigned char*) state->frame->message_buf.buf;
+        apr_size_t message_len = state->frame->message_buf.len;
+        unsigned char *message_data = state->frame->message_buf.buf;
 
         block_length = block_size - block_offset;
         block_data_length = (state->payload_length > block_length) ?
@@ -1216,7 +5618,8 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
             int validate = 0; /* whether we need to validate UTF-8 */
             apr_int64_t skip_bytes = 0; /* number of bytes to skip during validation */
 
-            if (state->opcode == OPCODE_TEXT) {
+            if ((state->opcode == OPCODE_TEXT) && !state->frame->compressed) {
+                /* Compressed text is validated once it is decompressed. */
                 validate = 1;
             } else if (state->opcode == OPCODE_CLOSE) {
                 /*
@@ -1262,7 +5665,8 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
             memcpy(&message_data[message_len], &block[block_offset],
                    block_data_length);
 
-            if (state->opcode == OPCODE_TEXT) {
+            if ((state->opcode == OPCODE_TEXT) && !state->frame->compressed) {
+                /* Compressed text is validated once it is decompressed. */
                 validate = 1;
             } else if (state->opcode == OPCODE_CLOSE) {
                 /*
@@ -1294,8 +5698,94 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
         }
         state->payload_length -= block_data_length;
 
+        if (is_spilling(state) &&
+            ((message_len >= SPILL_CHUNK_SIZE) ||
+             (state->fin && (state->payload_length == 0)))) {
+            apr_status_t rv = spill_write(state, message_data, message_len);
+
+            if (rv != APR_SUCCESS) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, server->state->r,
+                              "could not write large message to a "
+                              "temporary file");
+                state->status_code = STATUS_CODE_INTERNAL_ERROR;
+                return 0;
+            }
+            message_len = 0;
+        }
+
         if (state->payload_length == 0) {
             int message_type = MESSAGE_TYPE_INVALID;
+            unsigned char *payload = message_data;
+            apr_size_t payload_len = message_len;
+            WebSocketMessageBuf *delivered = &state->frame->message_buf;
+
+            /* (An invalid text message is refused below, unread.) */
+            if (state->fin && is_spilling(state) &&
+                (state->frame->utf8_state != UTF8_INVALID)) {
+                apr_mmap_t *mm;
+                apr_status_t rv;
+
+                /*
+                 * Map it writable, since on_message() may modify the buffer;
+                 * that only changes the temporary file.
+                 */
+                rv = apr_mmap_create(&mm, state->spill_file, 0,
+                                     (apr_size_t) state->frame->message_length,
+                                     APR_MMAP_READ | APR_MMAP_WRITE,
+                                     state->spill_pool);
+                if (rv != APR_SUCCESS) {
+                    ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, server->state->r,
+                                  "could not map large message from a "
+                                  "temporary file");
+                    state->status_code = STATUS_CODE_INTERNAL_ERROR;
+                    return 0;
+                }
+                payload = mm->mm;
+                payload_len = mm->size;
+                delivered = NULL;
+            }
+
+            if (state->fin && state->frame->compressed) {
+                apr_status_t rv = mod_websocket_inflate(server->state->deflate,
+                                                        message_data,
+                                                        message_len,
+                                                        &state->inflate_buf,
+                                                        conf->message_limit);
+
+                if (APR_STATUS_IS_ENOSPC(rv)) {
+                    state->status_code =
+                        (server->state->protocol_version >= 13) ?
+                        STATUS_CODE_MESSAGE_TOO_LARGE : STATUS_CODE_RESERVED;
+                    return 0;
+                }
+                else if (APR_STATUS_IS_ENOMEM(rv)) {
+                    ap_log_rerror(APLOG_MARK, APLOG_ERR, rv, server->state->r,
+                                  "could not allocate memory for a message");
+                    state->status_code = STATUS_CODE_INTERNAL_ERROR;
+                    return 0;
+                }
+                else if (rv != APR_SUCCESS) {
+                    ap_log_rerror(APLOG_MARK, APLOG_INFO, rv, server->state->r,
+                                  "could not decompress message from client");
+                    state->status_code = STATUS_CODE_PROTOCOL_ERROR;
+                    return 0;
+                }
+
+                payload = state->inflate_buf.buf;
+                payload_len = state->inflate_buf.len;
+                delivered = &state->inflate_buf;
+
+                if (state->opcode == OPCODE_TEXT) {
+                    unsigned int utf8_state = UTF8_VALID;
+                    apr_size_t i;
+
+                    for (i = 0; (i < payload_len) &&
+                                (utf8_state != UTF8_INVALID); i++) {
+                        utf8_state = validate_utf8[utf8_state + payload[i]];
+                    }
+                    state->frame->utf8_state = utf8_state;
+                }
+            }
 
             switch (state->opcode) {
             case OPCODE_TEXT:
@@ -1313,6 +5803,8 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
                 break;
 
             case OPCODE_CLOSE:
+                state->close_received = 1;
+
                 if (!is_valid_status_code(message_data, message_len,
                                           !conf->allow_reserved)) {
                     state->status_code = STATUS_CODE_PROTOCOL_ERROR;
@@ -1324,13 +5816,34 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
                 return 0;
 
             case OPCODE_PING:
-                apr_thread_mutex_lock(server->state->mutex);
-                mod_websocket_send_internal(server->state, MESSAGE_TYPE_PONG,
-                                            message_data, message_len);
-                apr_thread_mutex_unlock(server->state->mutex);
+                /*
+                 * A client over its limit is slowed down by reading it less
+                 * often, but its ping is still answered (RFC 6455, section
+                 * 5.5.2), unless the connection is being closed for it.
+                 */
+                if (mod_websocket_rate_limit(server, state, conf,
+                                             &state->control_bucket, 1,
+                                             "WebSocketControlRateLimit") &&
+                    conf->rate_limit_close) {
+                    return 0;
+                }
+                /*
+                 * Only the latest of several pings needs an answer (RFC 6455,
+                 * section 5.5.3), so the pong waits to go out with the next
+                 * flush, and later pings replace it until then.
+                 */
+                memcpy(server->state->pong, message_data, message_len);
+                server->state->pong_len = message_len;
+                server->state->pong_pending = 1;
                 break;
 
             case OPCODE_PONG:
+                if (mod_websocket_rate_limit(server, state, conf,
+                                             &state->control_bucket, 1,
+                                             "WebSocketControlRateLimit") &&
+                    conf->rate_limit_close) {
+                    return 0;
+                }
                 break;
 
             default:
@@ -1339,24 +5852,54 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
             }
 
             if (state->fin && (message_type != MESSAGE_TYPE_INVALID)) {
-                conf->plugin->on_message(plugin_private, server, message_type,
-                                         message_data, message_len);
+                if (mod_websocket_rate_limit(server, state, conf,
+                                             &state->message_bucket, 1,
+                                             "WebSocketMessageRateLimit") &&
+                    conf->rate_limit_close) {
+                    return 0;
+                }
+                /* A message in pieces can't be handed over as a whole. */
+                server->state->delivered = (state->npieces == 0) ?
+                                           delivered : NULL;
+                if (plugin_takes_iov(conf->plugin)) {
+                    mod_websocket_deliver_iov(server, state, conf,
+                                              plugin_private, message_type,
+                                              payload, payload_len);
+                }
+                else {
+                    conf->plugin->on_message(plugin_private, server,
+                                             message_type, payload,
+                                             payload_len);
+                }
+                server->state->delivered = NULL;
+                apr_pool_clear(server->state->message_pool);
+                state->message_received = 1;
             }
 
             /* Get ready for the next frame. */
             state->framing_state = DATA_FRAMING_START;
 
             if (state->fin) {
-                apr_pool_t *pool = state->frame->message_buf.pool;
-
-                ap_varbuf_free(&state->frame->message_buf);
-                ap_varbuf_init(pool, &state->frame->message_buf, 0);
+                /* Even if the plugin kept it, the next message gets its own. */
+                message_buf_free(&state->frame->message_buf);
+                pieces_clear(state);
 
                 state->frame->message_length = 0;
+                buffered_release(state->frame->buffered);
+                state->frame->buffered = 0;
+
+                if (is_spilling(state)) {
+                    spill_end(state);
+                }
                 message_len = 0;
+
+                if (state->frame->compressed) {
+                    message_buf_free(&state->inflate_buf);
+                    state->frame->compressed = 0;
+                }
             }
         }
-        state->frame->message_buf.strlen = message_len;
+        state->frame->message_buf.len = message_len;
         break;
     }
 
@@ -1378,53 +5921,269 @@ static apr_size_t mod_websocket_handle_frame(const WebSocketServer *server,
 
 /**
  * Handles as many bytes as possible from the given block, calling the plugin
- * as necessary and storing interim state in the WebSocketReadState.
+ * as necessary and storing interim state in the WebSocketReadState. Stops
+ * early if the client goes over a rate limit, so that the rest of the block
+ * waits along with the data that hasn't been read yet.
  *
- * Errors are indicated by setting the state->status_code and marking the
- * connection for closure.
+ * Returns the number of bytes handled. Errors are indicated by setting the
+ * state->status_code and marking the connection for closure.
  */
-static void mod_websocket_handle_incoming(const WebSocketServer *server,
-                                          unsigned char *block,
-                                          apr_size_t block_size,
-                                          WebSocketReadState *state,
-                                          websocket_config_rec *conf,
-                                          void *plugin_private)
+static apr_size_t mod_websocket_handle_incoming(const WebSocketServer *server,
+                                                unsigned char *block,
+                                                apr_size_t block_size,
+                                                WebSocketReadState *state,
+                                                websocket_config_rec *conf,
+                                                void *plugin_private)
 {
     apr_size_t handled_bytes;
+    apr_size_t total = 0;
 
-    while (block_size > 0) {
+    while ((block_size > 0) && !state->throttled_until) {
         handled_bytes = mod_websocket_handle_frame(server, block, block_size,
                                                    state, conf, plugin_private);
 
         if (!handled_bytes) {
             /* Close the connection. */
             state->closing = 1;
-            return;
+            break;
         }
 
         block += handled_bytes;
         block_size -= handled_bytes;
+        total += handled_bytes;
     }
+
+    return total;
 }
 
-static void mod_websocket_handle_outgoing(const WebSocketServer *server,
-                                          WebSocketMessageData *msg)
+/*
+ * Writes every message currently waiting in the outgoing queue (up to
+ * QUEUE_CAPACITY of them), along with everything published to the connection
+ * and the pong for the latest ping, and sends them to the client with a single
+ * flush, rather than paying for a flush and a write syscall per message.
+ *
+ * Returns APR_EAGAIN if there was nothing to write.
+ */
+static apr_status_t mod_websocket_handle_outgoing(const WebSocketServer *server)
 {
-    apr_thread_mutex_lock(server->state->mutex);
-    msg->written = mod_websocket_send_internal(server->state, msg->type,
-                                               msg->buffer, msg->buffer_size);
+    WebSocketState *state = server->state;
+    WebSocketMessageData *batch[QUEUE_CAPACITY];
+    WebSocketOutboxEntry *published;
+    WebSocketOutboxEntry *entry;
+    apr_size_t published_bytes = 0;
+    apr_status_t rv = APR_SUCCESS;
+    int count = 0;
+    int i;
+
+    while (count < QUEUE_CAPACITY) {
+        void *el;
+
+        do {
+            rv = apr_queue_trypop(state->queue, &el);
+        } while (APR_STATUS_IS_EINTR(rv));
+
+        if (rv != APR_SUCCESS) {
+            break;
+        }
+        batch[count++] = el;
+    }
+
+    published = outbox_take(state);
+
+    if (!count && (published == NULL) && !state->pong_pending) {
+        return rv;
+    }
+
+    apr_thread_mutex_lock(state->mutex);
+
+    mod_websocket_write_pong(state);
+    for (i = 0; i < count; ++i) {
+        batch[i]->written = mod_websocket_write_message(state, batch[i]);
+    }
+    for (entry = published; entry != NULL; entry = entry->next) {
+        published_bytes += entry->msg->plain.len;
+
+        /* Don't spend the client's bandwidth on stale data. */
+        if (entry->expires && (entry->expires <= apr_time_now())) {
+            state->expired++;
+            continue;
+        }
+        mod_websocket_write_prepared(state, entry->msg);
+    }
+
+    if (mod_websocket_flush(state) != APR_SUCCESS) {
+        for (i = 0; i < count; ++i) {
+            batch[i]->written = 0;
+        }
+    }
 
     /*
-     * Notify plugin_send() that the message has been sent.
+     * Notify plugin_send() that the messages have been sent.
      *
-     * XXX Wake up _all_ the waiting threads, since we don't know which one owns
-     * this message. This is contentious if there are a lot of threads writing
-     * in parallel.
+     * XXX Wake up _all_ the waiting threads, since we don't know which ones
+     * own these messages. This is contentious if there are a lot of threads
+     * writing in parallel.
      */
-    msg->done = 1;
-    apr_thread_cond_broadcast(server->state->cond);
+    for (i = 0; i < count; ++i) {
+        batch[i]->done = 1;
+    }
+    apr_thread_cond_broadcast(state->cond);
+
+    apr_thread_mutex_unlock(state->mutex);
+
+    /* The written frames hold their own references to the messages. */
+    if (published != NULL) {
+        outbox_flushed(state, published_bytes);
+        outbox_free(published);
+    }
+
+    return (APR_STATUS_IS_EAGAIN(rv) ? APR_SUCCESS : rv);
+}
+
+/*
+ * Returns the shorter of two poll() timeouts, where a negative timeout means
+ * "wait forever".
+ */
+static apr_interval_time_t min_timeout(apr_interval_time_t a,
+                                       apr_interval_time_t b)
+{
+    if (a < 0) {
+        return b;
+    }
+    if (b < 0) {
+        return a;
+    }
+    return (a < b) ? a : b;
+}
+
+/*
+ * Enforces WebSocketPingInterval and WebSocketIdleTimeout. The socket has no
+ * timeout once the connection is upgraded, so without these a client that
+ * vanished without closing its connection would hold on to it forever.
+ *
+ * A ping is sent once the client has been silent for a full ping interval; if
+ * the client still hasn't sent anything one interval after that, the
+ * connection is marked for closure with 1001 (Going Away). The same happens if
+ * no message (as opposed to control frames) arrives within the idle timeout.
+ *
+ * Returns the time until the next check is due, or -1 if neither directive is
+ * in effect.
+ */
+static apr_interval_time_t mod_websocket_check_keepalive(const WebSocketServer *server,
+                                                         WebSocketReadState *state,
+                                                         websocket_config_rec *conf,
+                                                         int data_read)
+{
+    apr_interval_time_t next = -1;
+    apr_time_t now;
+
+    if ((conf->ping_interval <= 0) && (conf->idle_timeout <= 0)) {
+        return -1;
+    }
 
-    apr_thread_mutex_unlock(server->state->mutex);
+    now = apr_time_now();
+
+    if (data_read) {
+        state->last_read = now;
+        state->ping_sent = 0; /* the client is alive; no need for an answer */
+    }
+    if (state->message_received) {
+        state->last_message = now;
+        state->message_received = 0;
+    }
+
+    if (conf->idle_timeout > 0) {
+        next = state->last_message + conf->idle_timeout - now;
+
+        if (next <= 0) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, APR_SUCCESS, server->state->r,
+                          "closing WebSocket connection: no message received "
+                          "within WebSocketIdleTimeout");
+            state->status_code = STATUS_CODE_GOING_AWAY;
+            state->closing = 1;
+            return 0;
+        }
+    }
+
+    if (conf->ping_interval > 0) {
+        apr_interval_time_t remaining;
+
+        if (state->ping_sent) {
+            remaining = state->ping_sent + conf->ping_interval - now;
+
+            if (remaining <= 0) {
+                ap_log_rerror(APLOG_MARK, APLOG_INFO, APR_SUCCESS,
+                              server->state->r,
+                              "closing WebSocket connection: keepalive ping "
+                              "went unanswered");
+                state->status_code = STATUS_CODE_GOING_AWAY;
+                state->closing = 1;
+                return 0;
+            }
+        }
+        else {
+            remaining = state->last_read + conf->ping_interval - now;
+
+            if (remaining <= 0) {
+                apr_thread_mutex_lock(server->state->mutex);
+                mod_websocket_send_internal(server->state, MESSAGE_TYPE_PING,
+                                            NULL, 0);
+                apr_thread_mutex_unlock(server->state->mutex);
+
+                state->ping_sent = now;
+                remaining = conf->ping_interval;
+            }
+        }
+
+        next = min_timeout(next, remaining);
+    }
+
+    return next;
+}
+
+/*
+ * Closes the connection with 1008 (Policy Violation) if it has been evicted for
+ * falling behind WebSocketMaxPendingBytes or WebSocketMaxSendDelay.
+ */
+static void mod_websocket_check_evicted(const WebSocketServer *server,
+                                        WebSocketReadState *state)
+{
+    const char *reason;
+
+    apr_thread_mutex_lock(server->state->outbox_mutex);
+    reason = server->state->evicted;
+    apr_thread_mutex_unlock(server->state->outbox_mutex);
+
+    if (reason != NULL) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, APR_SUCCESS, server->state->r,
+                      "closing slow WebSocket connection: %s", reason);
+        state->status_code = STATUS_CODE_POLICY_VIOLATION;
+        state->closing = 1;
+    }
+}
+
+/*
+ * Calls the plugin's on_writable() once a connection that had backed up to
+ * WebSocketLowWatermark has drained below it again.
+ */
+static void mod_websocket_check_writable(const WebSocketServer *server,
+                                         websocket_config_rec *conf,
+                                         void *plugin_private)
+{
+    WebSocketState *state = server->state;
+    int writable = 0;
+
+    apr_thread_mutex_lock(state->outbox_mutex);
+    if (state->backed_up && (state->pending_bytes < state->low_watermark)) {
+        state->backed_up = 0;
+        writable = 1;
+    }
+    apr_thread_mutex_unlock(state->outbox_mutex);
+
+    if (writable && (conf->plugin->version >= WEBSOCKET_PLUGIN_VERSION_1) &&
+        (conf->plugin->on_writable != NULL)) {
+        conf->plugin->on_writable(plugin_private, server);
+    }
 }
 
 /*
@@ -1440,10 +6199,92 @@ static apr_socket_t *get_conn_socket(conn_rec *conn)
 #endif
 }
 
+/*
+ * Checks whether a filter chain consists of nothing but the given core filter.
+ * If both directions qualify, nothing transforms the stream (no TLS, no
+ * compression, no logging of I/O), and the connection may use the socket
+ * directly.
+ */
+static int is_core_filter_chain(ap_filter_t *filter, const char *core_name)
+{
+    for (; filter != NULL; filter = filter->next) {
+        if ((filter->frec == NULL) || (filter->frec->name == NULL) ||
+            strcasecmp(filter->frec->name, core_name)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Asks the kernel to busy-poll the device queue for the client socket instead
+ * of sleeping when a read finds no data. This is best-effort: raising the value
+ * above the net.core.busy_read sysctl requires CAP_NET_ADMIN.
+ */
+static void set_kernel_busy_poll(request_rec *r, apr_interval_time_t usec)
+{
+#if defined(SO_BUSY_POLL)
+    apr_os_sock_t fd;
+    int value = (int) usec;
+
+    if ((apr_os_sock_get(&fd, get_conn_socket(r->connection)) != APR_SUCCESS) ||
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, (const void *) &value,
+                   sizeof(value))) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, apr_get_netos_error(), r,
+                      "could not set SO_BUSY_POLL on the client socket");
+    }
+#else
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, APR_ENOTIMPL, r,
+                  "SO_BUSY_POLL is not available on this platform; ignoring "
+                  "WebSocketKernelBusyPoll");
+#endif
+}
+
+/*
+ * Returns whether reading is paused, either by the plugin or by a rate limit,
+ * and adds the socket to (or removes it from) the pollset to match, so that a
+ * paused connection isn't woken up by input that it won't read.
+ */
+static int mod_websocket_read_paused(WebSocketState *state,
+                                     WebSocketReadState *read_state,
+                                     const apr_pollfd_t *pollfd,
+                                     int *polling)
+{
+    int paused;
+
+    apr_thread_mutex_lock(state->outbox_mutex);
+    paused = state->read_paused;
+    apr_thread_mutex_unlock(state->outbox_mutex);
+
+    if (read_state->throttled_until) {
+        if (apr_time_now() < read_state->throttled_until) {
+            paused = 1;
+        }
+        else {
+            read_state->throttled_until = 0;
+        }
+    }
+
+    if (paused && *polling) {
+        apr_pollset_remove(state->pollset, pollfd);
+        *polling = 0;
+    }
+    else if (!paused && !*polling) {
+        apr_pollset_add(state->pollset, pollfd);
+        *polling = 1;
+    }
+
+    return paused;
+}
+
 /*
  * The data framing handler requires that the server state mutex is locked by
  * the caller upon entering this function. It will be locked when leaving too.
  *
+ * Returns nonzero if the closing handshake was completed, i.e. the client sent
+ * a Close frame and our Close frame was written in response.
+ *
  * The framing loop is the only place where data is written to or read from the
  * socket via the bucket brigades, to prevent simultaneous access to the
  * brigades.  Having a read-only thread and a write-only thread isn't good
@@ -1454,9 +6295,9 @@ static apr_socket_t *get_conn_socket(conn_rec *conn)
  * Outgoing messages queued from another thread (by mod_websocket_plugin_send())
  * are dequeued and written here.
  */
-static void mod_websocket_data_framing(const WebSocketServer *server,
-                                       websocket_config_rec *conf,
-                                       void *plugin_private)
+static int mod_websocket_data_framing(const WebSocketServer *server,
+                                      websocket_config_rec *conf,
+                                      void *plugin_private)
 {
     WebSocketState *state = server->state;
     request_rec *r = state->r;
@@ -1466,44 +6307,93 @@ static void mod_websocket_data_framing(const WebSocketServer *server,
     const apr_pollfd_t *signalled;
     apr_int32_t pollcnt;
     apr_queue_t * queue;
+    apr_pool_t *frame_pool;
+    int handshake_done = 0;
 
     if (((ibb = apr_brigade_create(r->pool, r->connection->bucket_alloc)) != NULL) &&
         ((obb = apr_brigade_create(r->pool, r->connection->bucket_alloc)) != NULL) &&
         (apr_pollset_create(&pollset, 1, r->pool, APR_POLLSET_WAKEABLE) == APR_SUCCESS) &&
-        (apr_queue_create(&queue, QUEUE_CAPACITY, r->pool) == APR_SUCCESS)) {
+        (apr_queue_create(&queue, QUEUE_CAPACITY, r->pool) == APR_SUCCESS) &&
+        (apr_pool_create(&frame_pool, r->pool) == APR_SUCCESS)) {
         unsigned char block[BLOCK_DATA_SIZE];
         apr_size_t block_size;
+        unsigned char *block_next = block; /* what's left of the block */
+        apr_size_t block_left = 0;
         unsigned char status_code_buffer[2];
         WebSocketReadState read_state = { 0 };
+        apr_time_t idle_since = 0;
+        int polling_input = 1; /* the socket is in the pollset */
 
         read_state.framing_state = DATA_FRAMING_START;
         read_state.status_code = STATUS_CODE_OK;
 
-        ap_varbuf_init(r->pool, &read_state.control_frame.message_buf, 0);
-        read_state.control_frame.message_buf.strlen = 0;
         read_state.control_frame.fin = 1;
         read_state.control_frame.opcode = 8;
         read_state.control_frame.utf8_state = UTF8_VALID;
 
-        ap_varbuf_init(r->pool, &read_state.message_frame.message_buf, 0);
-        read_state.message_frame.message_buf.strlen = 0;
         read_state.message_frame.fin = 1;
         read_state.message_frame.opcode = 0;
         read_state.message_frame.utf8_state = UTF8_VALID;
 
         read_state.frame = &read_state.control_frame;
         read_state.opcode = 0xFF;
+        read_state.last_read = read_state.last_message = apr_time_now();
+
+        token_bucket_init(&read_state.message_bucket, conf->message_rate,
+                          read_state.last_read);
+        token_bucket_init(&read_state.byte_bucket, conf->byte_rate,
+                          read_state.last_read);
+        token_bucket_init(&read_state.control_bucket, conf->control_rate,
+                          read_state.last_read);
 
         state->queue = queue;
+        state->frame_pool = frame_pool;
+
+        state->sock = get_conn_socket(r->connection);
+
+        /*
+         * Without any filters besides the core network filters, frames can be
+         * read from and written to the socket directly, skipping the bucket
+         * allocations and filter dispatch for every frame.
+         *
+         * There is deliberately no io_uring backend here. The framing loop
+         * waits for each read and flush before going on, so a ring would
+         * still take one io_uring_enter() per operation, no fewer syscalls
+         * than recv() and writev(); the batching it would buy is done above
+         * (reads until EAGAIN) and in mod_websocket_handle_outgoing() (one
+         * flush for the whole queue). Registered buffers don't pay off
+         * either, since payloads come from a different plugin or prepared
+         * buffer for nearly every message. io_uring is also often disabled
+         * (kernel.io_uring_disabled, container seccomp profiles), so this
+         * path would remain the common one.
+         */
+        state->direct_io =
+            is_core_filter_chain(r->input_filters, "core_in") &&
+            is_core_filter_chain(r->connection->output_filters, "core");
+
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                      "using %s I/O for WebSocket connection",
+                      state->direct_io ? "direct socket" : "filtered");
+
+        /* Zero-copy sends need the raw socket, so they only come with it. */
+        if (state->direct_io && (conf->zerocopy_min_size > 0)) {
+            enable_zerocopy(state, conf->zerocopy_min_size);
+        }
 
         /* Initialize the pollset */
         pollfd.p = r->pool;
         pollfd.desc_type = APR_POLL_SOCKET;
         pollfd.reqevents = APR_POLLIN;
-        pollfd.desc.s = get_conn_socket(state->r->connection);
+        pollfd.desc.s = state->sock;
         apr_pollset_add(pollset, &pollfd);
 
+        apr_thread_mutex_lock(state->outbox_mutex);
         state->pollset = pollset;
+        apr_thread_mutex_unlock(state->outbox_mutex);
+
+        if ((conf->busy_poll > 0) && conf->kernel_busy_poll) {
+            set_kernel_busy_poll(r, conf->busy_poll);
+        }
 
         /* Allow the plugin to now write to the client */
         state->obb = obb;
@@ -1517,19 +6407,68 @@ static void mod_websocket_data_framing(const WebSocketServer *server,
         while (!read_state.closing) {
             apr_status_t rv;
             apr_interval_time_t timeout;
-            WebSocketMessageData *msg;
+            apr_interval_time_t timer_timeout;
+            apr_interval_time_t keepalive_timeout;
             int work_done = 0;
+            int data_read = 0;
+            int i;
+            int spinning = 0;
+            int paused = mod_websocket_read_paused(state, &read_state, &pollfd,
+                                                   &polling_input);
+
+            /*
+             * Check to see if there is any data to read. Keep reading until
+             * the socket is drained (or we've handled READ_BATCH_BLOCKS worth
+             * of data) so that a burst of incoming frames costs one trip
+             * through poll() instead of one per block. Stop early if the
+             * plugin pauses reading or the client goes over a rate limit; the
+             * client's unread data then stays in the TCP buffers, which pushes
+             * back on the client.
+             */
+            rv = APR_EAGAIN;
+            for (i = 0; !paused && (i < READ_BATCH_BLOCKS); ++i) {
+                apr_size_t handled;
+
+                /* Finish any block that a rate limit cut short first. */
+                if (!block_left) {
+                    block_size = sizeof(block);
+                    rv = mod_websocket_read_nonblock(state, ibb, (char *)block,
+                                                     &block_size);
+
+                    if (rv != APR_SUCCESS) {
+                        break;
+                    }
 
-            /* Check to see if there is any data to read. */
-            block_size = sizeof(block);
-            rv = mod_websocket_read_nonblock(r, ibb, (char *)block, &block_size);
+                    if (mod_websocket_rate_limit(server, &read_state, conf,
+                                                 &read_state.byte_bucket,
+                                                 block_size,
+                                                 "WebSocketByteRateLimit") &&
+                        conf->rate_limit_close) {
+                        read_state.closing = 1;
+                        break;
+                    }
 
-            if (rv == APR_SUCCESS) {
-                mod_websocket_handle_incoming(server, block, block_size,
-                                              &read_state, conf, plugin_private);
+                    block_next = block;
+                    block_left = block_size;
+                }
+
+                handled = mod_websocket_handle_incoming(server, block_next,
+                                                        block_left,
+                                                        &read_state, conf,
+                                                        plugin_private);
+                block_next += handled;
+                block_left -= handled;
                 work_done = 1;
+                data_read = 1;
+
+                if (read_state.closing) {
+                    break;
+                }
+                paused = mod_websocket_read_paused(state, &read_state, &pollfd,
+                                                   &polling_input);
             }
-            else if (!APR_STATUS_IS_EAGAIN(rv)) {
+
+            if ((rv != APR_SUCCESS) && !APR_STATUS_IS_EAGAIN(rv)) {
                 /*
                  * APR_EOF just means the client aborted the TCP connection; no
                  * point in spamming the logs with errors in that case.
@@ -1543,14 +6482,9 @@ static void mod_websocket_data_framing(const WebSocketServer *server,
             }
 
             /* Check to see if there is any data to write. */
-            do {
-                void *el;
-                rv = apr_queue_trypop(state->queue, &el);
-                msg = el;
-            } while (APR_STATUS_IS_EINTR(rv));
+            rv = mod_websocket_handle_outgoing(server);
 
             if (rv == APR_SUCCESS) {
-                mod_websocket_handle_outgoing(server, msg);
                 work_done = 1;
             }
             else if (!APR_STATUS_IS_EAGAIN(rv)) {
@@ -1561,6 +6495,37 @@ static void mod_websocket_data_framing(const WebSocketServer *server,
                 break;
             }
 
+            /* Drop the connection if it can't keep up with what it's sent. */
+            mod_websocket_check_evicted(server, &read_state);
+            if (read_state.closing) {
+                break;
+            }
+
+            /* Let a paced plugin know that it can queue more. */
+            mod_websocket_check_writable(server, conf, plugin_private);
+
+            /* Unpin the messages that the kernel has finished sending. */
+            zerocopy_reap(state);
+
+            /* Fire any timers that have come due. */
+            timer_timeout = mod_websocket_run_timers(server);
+
+            /*
+             * Ping quiet clients, and drop the ones that have gone away. A
+             * client can't be heard while reading is paused, so don't hold
+             * its silence against it.
+             */
+            if (paused) {
+                data_read = 1;
+                read_state.message_received = 1;
+            }
+            keepalive_timeout = mod_websocket_check_keepalive(server,
+                                                              &read_state,
+                                                              conf, data_read);
+            if (read_state.closing) {
+                break;
+            }
+
             /*
              * If there's nothing to do, wait for new work to come in.
              *
@@ -1573,10 +6538,38 @@ static void mod_websocket_data_framing(const WebSocketServer *server,
              *
              * NOTE: The wakeup pipe is drained only during apr_pollset_poll(),
              * so we call it each iteration to avoid filling it up. We only
-             * block in poll() (negative timeout) if there was no work done
-             * during the current iteration.
+             * block in poll() if there was no work done during the current
+             * iteration, and then only until the next timer is due (with no
+             * timers, the timeout is negative and we block indefinitely).
+             *
+             * With WebSocketBusyPoll, keep spinning on the nonblocking read
+             * and trypop above for a bounded window after the last piece of
+             * work, so that a message arriving shortly afterwards doesn't pay
+             * for a scheduler wakeup.
              */
-            timeout = work_done ? 0 : -1;
+            if (work_done) {
+                idle_since = 0;
+            }
+            else if (conf->busy_poll > 0) {
+                apr_time_t now = apr_time_now();
+
+                if (!idle_since) {
+                    idle_since = now;
+                }
+                spinning = ((now - idle_since) < conf->busy_poll);
+            }
+
+            timeout = (work_done || spinning) ?
+                      0 : min_timeout(timer_timeout, keepalive_timeout);
+
+            /* A throttled client may be read again once its time is up. */
+            if (read_state.throttled_until) {
+                apr_interval_time_t throttle_timeout =
+                    read_state.throttled_until - apr_time_now();
+
+                timeout = min_timeout(timeout, (throttle_timeout > 0) ?
+                                               throttle_timeout : 0);
+            }
             rv = apr_pollset_poll(state->pollset, timeout, &pollcnt, &signalled);
 
             if ((rv != APR_SUCCESS) && !APR_STATUS_IS_EINTR(rv) &&
@@ -1588,29 +6581,48 @@ static void mod_websocket_data_framing(const WebSocketServer *server,
             }
         }
 
-        ap_varbuf_free(&read_state.message_frame.message_buf);
-        ap_varbuf_free(&read_state.control_frame.message_buf);
+        message_buf_free(&read_state.message_frame.message_buf);
+        message_buf_free(&read_state.control_frame.message_buf);
+        message_buf_free(&read_state.inflate_buf);
+        pieces_clear(&read_state);
+        free(read_state.pieces);
+        buffered_release(read_state.message_frame.buffered);
+        buffered_release(read_state.control_frame.buffered);
+        spill_end(&read_state);
 
         /* Send server-side closing handshake */
         status_code_buffer[0] = (read_state.status_code >> 8) & 0xFF;
         status_code_buffer[1] = read_state.status_code & 0xFF;
 
         apr_thread_mutex_lock(state->mutex);
-        mod_websocket_send_internal(state, MESSAGE_TYPE_CLOSE,
-                                    status_code_buffer,
-                                    sizeof(status_code_buffer));
+        if ((mod_websocket_send_internal(state, MESSAGE_TYPE_CLOSE,
+                                         status_code_buffer,
+                                         sizeof(status_code_buffer)) != 0) &&
+            read_state.close_received) {
+            handshake_done = 1;
+        }
+
+        /* Nothing more is sent; hand any zero-copy sends to the reaper. */
+        zerocopy_drain(state);
 
         /* We are done with the bucket brigades */
         state->obb = NULL;
         apr_brigade_destroy(ibb);
         apr_brigade_destroy(obb);
 
+        apr_thread_mutex_lock(state->outbox_mutex);
         state->pollset = NULL;
+        apr_thread_mutex_unlock(state->outbox_mutex);
         apr_pollset_destroy(pollset);
 
         state->queue = NULL;
         apr_queue_term(queue);
+
+        state->frame_pool = NULL;
+        apr_pool_destroy(frame_pool);
     }
+
+    return handshake_done;
 }
 
 /*
@@ -1655,6 +6667,51 @@ static int is_websocket_upgrade(request_rec *r)
     return upgrade_connection;
 }
 
+/*
+ * Closes the client connection once we're done with it, without holding on to
+ * the worker thread any longer than necessary. The socket itself belongs to
+ * the MPM, which closes it after we return; closing it here as well could
+ * close some other connection that has been given the same descriptor since.
+ *
+ * An asynchronous MPM (event) performs its own lingering close without tying
+ * up a thread, and so do the others for connections that ended abnormally.
+ * But if the client completed the closing handshake there is nothing left for
+ * it to send, so there's no reason to linger: shut the socket down, and mark
+ * the connection aborted so that the MPM closes it right away.
+ */
+static void close_client_connection(request_rec *r, int handshake_done)
+{
+    conn_rec *c = r->connection;
+    int async = 0;
+
+    c->keepalive = AP_CONN_CLOSE;
+
+    /*
+     * Make sure nothing the core does to finish the request (e.g. sending the
+     * end of the response through the HTTP filters) can reach the client.
+     */
+    r->output_filters = c->output_filters;
+    r->proto_output_filters = c->output_filters;
+
+#if defined(AP_MPMQ_IS_ASYNC)
+    if (ap_mpm_query(AP_MPMQ_IS_ASYNC, &async) != APR_SUCCESS) {
+        async = 0;
+    }
+#endif
+
+    ap_log_cerror(APLOG_MARK, APLOG_INFO, APR_SUCCESS, c,
+                  "closing client connection%s",
+                  (async || !handshake_done) ? " (deferred to the MPM)" : "");
+
+    if (async || !handshake_done) {
+        return;
+    }
+
+    ap_flush_conn(c);
+    apr_socket_shutdown(get_conn_socket(c), APR_SHUTDOWN_READWRITE);
+    c->aborted = 1;
+}
+
 /*
  * This function creates the WebSocketState and WebSocketServer structures that
  * will be used for the entire connection, sets up the plugin that will handle
@@ -1664,27 +6721,57 @@ static int is_websocket_upgrade(request_rec *r)
 static void handle_websocket_connection(request_rec *r,
                                         websocket_config_rec *conf,
                                         apr_int64_t protocol_version,
-                                        apr_array_header_t *protocols)
+                                        apr_array_header_t *protocols,
+                                        WebSocketDeflate *deflate)
 {
     WebSocketState state = {
         r, NULL, apr_os_thread_current(), NULL, NULL, protocols, 0,
         protocol_version, NULL, NULL
     };
     WebSocketServer server = {
-        sizeof(WebSocketServer), 1, &state,
+        sizeof(WebSocketServer), WEBSOCKET_SERVER_VERSION_11, &state,
         mod_websocket_request, mod_websocket_header_get,
         mod_websocket_header_set,
         mod_websocket_protocol_count,
         mod_websocket_protocol_index,
         mod_websocket_protocol_set,
-        mod_websocket_plugin_send, mod_websocket_plugin_close
+        mod_websocket_plugin_send, mod_websocket_plugin_close,
+        mod_websocket_timer_add, mod_websocket_timer_cancel,
+        mod_websocket_prepare_message, mod_websocket_send_prepared,
+        mod_websocket_release_message,
+        mod_websocket_subscribe, mod_websocket_unsubscribe,
+        mod_websocket_publish,
+        mod_websocket_send_conflated, mod_websocket_publish_conflated,
+        mod_websocket_send_expiring, mod_websocket_publish_expiring,
+        mod_websocket_pending_bytes,
+        mod_websocket_pause_read, mod_websocket_resume_read,
+        mod_websocket_message_pool, mod_websocket_connection_pool,
+        mod_websocket_send_file,
+        mod_websocket_detach_message, mod_websocket_free_message
     };
     void *plugin_private = NULL;
+    int handshake_done = 0;
 
     apr_thread_mutex_create(&state.mutex,
                             APR_THREAD_MUTEX_DEFAULT,
                             r->pool);
     apr_thread_cond_create(&state.cond, r->pool);
+    apr_thread_mutex_create(&state.timer_mutex,
+                            APR_THREAD_MUTEX_DEFAULT,
+                            r->pool);
+    apr_thread_mutex_create(&state.outbox_mutex,
+                            APR_THREAD_MUTEX_DEFAULT,
+                            r->pool);
+    apr_thread_mutex_create(&state.sub_mutex,
+                            APR_THREAD_MUTEX_DEFAULT,
+                            r->pool);
+    state.deflate = deflate;
+    state.max_pending_bytes = conf->max_pending_bytes;
+    state.max_send_delay = conf->max_send_delay;
+    state.low_watermark = conf->low_watermark;
+
+    apr_pool_create(&state.connection_pool, r->pool);
+    apr_pool_create(&state.message_pool, state.connection_pool);
 
     apr_thread_mutex_lock(state.mutex);
 
@@ -1696,11 +6783,12 @@ static void handle_websocket_connection(request_rec *r,
         ((plugin_private =
           conf->plugin->on_connect(&server)) != NULL)) {
         /*
-         * Now that the connection has been established,
-         * disable the socket timeout
+         * Now that the connection has been established, disable the socket
+         * timeout, except to bound how long a write may wait for the client
          */
         apr_socket_timeout_set(get_conn_socket(r->connection),
-                               -1);
+                               (conf->max_send_delay > 0) ?
+                               conf->max_send_delay : -1);
 
         /* Set response status code and status line */
         r->status = HTTP_SWITCHING_PROTOCOLS;
@@ -1714,8 +6802,13 @@ static void handle_websocket_connection(request_rec *r,
                       "established new WebSocket connection");
 
         /* The main data framing loop */
-        mod_websocket_data_framing(&server, conf,
-                                   plugin_private);
+        handshake_done = mod_websocket_data_framing(&server, conf,
+                                                    plugin_private);
+
+        /* Make the connection's statistics available to the access log. */
+        apr_table_setn(r->notes, "websocket-expired",
+                       apr_psprintf(r->pool, "%" APR_UINT64_T_FMT,
+                                    state.expired));
 
         /* Wake up any waiting plugin_sends before closing */
         apr_thread_cond_broadcast(state.cond);
@@ -1744,10 +6837,30 @@ static void handle_websocket_connection(request_rec *r,
     }
 
     /* Close the connection */
-    ap_log_cerror(APLOG_MARK, APLOG_INFO, APR_SUCCESS,
-                  r->connection, "closing client connection");
-    ap_lingering_close(r->connection);
+    close_client_connection(r, handshake_done);
+
+    /* Stop receiving published messages */
+    hub_unsubscribe_all(&state);
 
+    /* Free any timers the plugin didn't cancel */
+    while (state.timers != NULL) {
+        WebSocketTimer *timer = state.timers;
+
+        state.timers = timer->next;
+        free(timer);
+    }
+    free(state.outbox_keys);
+
+    /* The plugin is done with the connection; so are its pools. */
+    apr_pool_destroy(state.connection_pool);
+
+    if (deflate != NULL) {
+        zstream_release_all(deflate);
+    }
+
+    apr_thread_mutex_destroy(state.sub_mutex);
+    apr_thread_mutex_destroy(state.outbox_mutex);
+    apr_thread_mutex_destroy(state.timer_mutex);
     apr_thread_cond_destroy(state.cond);
     apr_thread_mutex_destroy(state.mutex);
 }
@@ -1791,6 +6904,7 @@ static int mod_websocket_method_handler(request_rec *r)
     apr_int64_t protocol_version;
     apr_array_header_t *protocols;
     websocket_config_rec *conf;
+    WebSocketDeflate *deflate = NULL;
 
     if (strcmp(r->handler, "websocket-handler") || !r->headers_in) {
         /* We're not configured as a handler for this request. */
@@ -1877,11 +6991,32 @@ static int mod_websocket_method_handler(request_rec *r)
     apr_table_setn(r->headers_out, "Upgrade", "websocket");
     apr_table_setn(r->headers_out, "Connection", "Upgrade");
 
+    if (conf->deflate && zstream_over_budget()) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                      "WebSocketDeflateMemoryLimit reached; not offering "
+                      "compression to this connection");
+    }
+    else if (conf->deflate) {
+        const char *extensions;
+
+        deflate = apr_pcalloc(r->pool, sizeof(WebSocketDeflate));
+        extensions = negotiate_deflate(r, deflate);
+
+        if (extensions != NULL) {
+            deflate->min_size = conf->deflate_min_size;
+            apr_table_setn(r->headers_out, "Sec-WebSocket-Extensions",
+                           extensions);
+        }
+        else {
+            deflate = NULL;
+        }
+    }
+
     /* Set the expected acceptance response */
     mod_websocket_handshake(r, sec_websocket_key);
 
     /* We're ready to go. Take control of the connection. */
-    handle_websocket_connection(r, conf, protocol_version, protocols);
+    handle_websocket_connection(r, conf, protocol_version, protocols, deflate);
 
     return OK;
 }
@@ -1902,6 +7037,60 @@ static const command_rec websocket_cmds[] = {
     AP_INIT_TAKE1("WebSocketMaxMessageSize",
                   mod_websocket_conf_max_message_size, NULL, OR_AUTHCFG,
                   "Maximum size (in bytes) of a message to accept; default is 33554432 bytes (32 MB)"),
+    AP_INIT_TAKE1("WebSocketSpillThreshold",
+                  mod_websocket_conf_spill_threshold, NULL, OR_AUTHCFG,
+                  "Size (in bytes) above which an incoming message is put together in a temporary file instead of memory; default is 0 (never)"),
+    AP_INIT_TAKE1("WebSocketPingInterval", mod_websocket_conf_ping_interval,
+                  NULL, OR_AUTHCFG,
+                  "Time a client may stay silent before it is sent a keepalive ping, and then has to answer it; default is 0 (no pings)"),
+    AP_INIT_TAKE1("WebSocketIdleTimeout", mod_websocket_conf_idle_timeout,
+                  NULL, OR_AUTHCFG,
+                  "Time after which a connection without any incoming messages is closed; default is 0 (no timeout)"),
+    AP_INIT_FLAG("WebSocketPerMessageDeflate", mod_websocket_conf_deflate,
+                 NULL, OR_AUTHCFG,
+                 "Specifies whether to accept the permessage-deflate extension (RFC 7692); default is Off"),
+    AP_INIT_TAKE1("WebSocketDeflateMinSize",
+                  mod_websocket_conf_deflate_min_size, NULL, OR_AUTHCFG,
+                  "Size (in bytes) below which messages are sent uncompressed; default is 64"),
+    AP_INIT_TAKE1("WebSocketDeflateMemoryLimit",
+                  mod_websocket_conf_deflate_memory_limit, NULL, RSRC_CONF,
+                  "Most memory (in bytes) that compression contexts may use in each child process; default is 0 (no limit)"),
+    AP_INIT_TAKE1("WebSocketMaxPendingBytes",
+                  mod_websocket_conf_max_pending_bytes, NULL, OR_AUTHCFG,
+                  "Bytes that may be published to a connection without being sent before it is closed; default is 0 (no limit)"),
+    AP_INIT_TAKE1("WebSocketMaxSendDelay", mod_websocket_conf_max_send_delay,
+                  NULL, OR_AUTHCFG,
+                  "Time a message may wait to be sent before the connection is closed; default is 0 (no limit)"),
+    AP_INIT_TAKE1("WebSocketMessageRateLimit", mod_websocket_conf_message_rate,
+                  NULL, OR_AUTHCFG,
+                  "Messages per second a client may send; default is 0 (no limit)"),
+    AP_INIT_TAKE1("WebSocketByteRateLimit", mod_websocket_conf_byte_rate,
+                  NULL, OR_AUTHCFG,
+                  "Bytes per second a client may send; default is 0 (no limit)"),
+    AP_INIT_TAKE1("WebSocketControlRateLimit", mod_websocket_conf_control_rate,
+                  NULL, OR_AUTHCFG,
+                  "Control frames (pings, pongs) per second a client may send; default is 0 (no limit)"),
+    AP_INIT_TAKE1("WebSocketRateLimitAction",
+                  mod_websocket_conf_rate_limit_action, NULL, OR_AUTHCFG,
+                  "What to do with a client over a rate limit (Delay|Close); default is Delay"),
+    AP_INIT_TAKE1("WebSocketLowWatermark", mod_websocket_conf_low_watermark,
+                  NULL, OR_AUTHCFG,
+                  "Bytes pending below which a backed-up connection is reported writable to the plugin; default is 65536"),
+    AP_INIT_TAKE1("WebSocketMaxBufferedMemory",
+                  mod_websocket_conf_max_buffered_memory, NULL, RSRC_CONF,
+                  "Most memory (in bytes) that incoming and unsent messages may use in each child process; default is 0 (no limit)"),
+    AP_INIT_TAKE1("WebSocketZeroCopyMinSize",
+                  mod_websocket_conf_zerocopy_min_size, NULL, OR_AUTHCFG,
+                  "Size (in bytes) from which published frames are sent with MSG_ZEROCOPY on Linux; default is 0 (never)"),
+    AP_INIT_TAKE1("WebSocketBroadcastBusSize", mod_websocket_conf_bus_size,
+                  NULL, RSRC_CONF,
+                  "Size (in bytes) of the shared memory used to publish messages to every server process; default is 0 (publish only within a process)"),
+    AP_INIT_TAKE1("WebSocketBusyPoll", mod_websocket_conf_busy_poll, NULL,
+                  OR_AUTHCFG,
+                  "Microseconds to spin on the connection before blocking when idle; default is 0 (never spin)"),
+    AP_INIT_FLAG("WebSocketKernelBusyPoll", mod_websocket_conf_kernel_busy_poll,
+                 NULL, OR_AUTHCFG,
+                 "Specifies whether WebSocketBusyPoll also sets SO_BUSY_POLL on the client socket"),
 
     /* Obsolete alias for WebSocketMaxMessageSize. */
     AP_INIT_TAKE1("MaxMessageSize", mod_websocket_conf_max_message_size, NULL,
@@ -1909,9 +7098,65 @@ static const command_rec websocket_cmds[] = {
     {NULL}
 };
 
+static int mod_websocket_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                    apr_pool_t *ptemp)
+{
+    /* Forget the global settings from before a restart. */
+    zstream_memory_limit = 0;
+    buffered_memory_limit = 0;
+    bus_size = 0;
+
+#if defined(HAVE_BROADCAST_BUS)
+    ap_mutex_register(pconf, BUS_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+#endif
+
+    return OK;
+}
+
+static int mod_websocket_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                     apr_pool_t *ptemp, server_rec *s)
+{
+#if defined(HAVE_BROADCAST_BUS)
+    return bus_create(pconf, s);
+#else
+    return OK;
+#endif
+}
+
+static void mod_websocket_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_allocator_t *allocator;
+
+    apr_thread_mutex_create(&zstream_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    apr_thread_mutex_create(&buffered_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    apr_pool_cleanup_register(p, NULL, zstream_cleanup_idle,
+                              apr_pool_cleanup_null);
+
+    /*
+     * Topics come and go on every thread, so the hub gets an allocator of its
+     * own; everything allocated from it is guarded by hub_mutex.
+     */
+    apr_thread_mutex_create(&hub_mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    apr_allocator_create(&allocator);
+    apr_pool_create_ex(&hub_pool, p, NULL, allocator);
+    apr_allocator_owner_set(allocator, hub_pool);
+    hub_topics = apr_hash_make(hub_pool);
+
+    zerocopy_child_init(p);
+
+#if defined(HAVE_BROADCAST_BUS)
+    bus_child_init(p, s);
+#endif
+}
+
 /* Declare the handlers for other events. */
 static void mod_websocket_register_hooks(apr_pool_t *p)
 {
+    ap_hook_pre_config(mod_websocket_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_post_config(mod_websocket_post_config, NULL, NULL,
+                        APR_HOOK_MIDDLE);
+    ap_hook_child_init(mod_websocket_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+
     /* Register for method calls. */
     ap_hook_handler(mod_websocket_method_handler, NULL, NULL,
                     APR_HOOK_FIRST - 1);
@@ -0,0 +1,112 @@
+#! /usr/bin/env python3
+#
+# Measures how much server CPU time an abusive client can burn, by flooding one
+# or more locations on the test server with pings or tiny messages and
+# sampling the CPU time used by the server processes meanwhile.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Usage:
+#
+#     $ make start-test-server
+#     $ cd test
+#     $ ./bench_abuse.py [--mode ping|message] [--seconds N] [path ...]
+#
+# The default paths are /echo and /rate-limit-delay. Cycles are estimated from
+# the current CPU frequency, so treat them as a rough figure.
+
+import argparse
+import asyncio
+import sys
+import time
+
+import psutil
+import websockets
+
+sys.path.insert(0, 'pytest')
+from test_fixtures import make_root
+
+SERVER_NAMES = ('httpd', 'apache2')
+
+def server_processes():
+    return [ p for p in psutil.process_iter(['name'])
+             if p.info['name'] in SERVER_NAMES ]
+
+def server_cpu_time(procs):
+    """Returns the total user and system CPU time of the given processes."""
+    total = 0.0
+    for p in procs:
+        try:
+            times = p.cpu_times()
+            total += times.user + times.system
+        except psutil.NoSuchProcess:
+            pass
+    return total
+
+async def flood(uri, mode, seconds):
+    """Floods the given location, returning the number of frames sent."""
+    sent = 0
+
+    async with websockets.connect(uri) as conn:
+        deadline = time.monotonic() + seconds
+
+        while time.monotonic() < deadline and conn.open:
+            for _ in range(100):
+                if mode == 'ping':
+                    # Don't wait for the pongs; an attacker wouldn't.
+                    await conn.ping(str(sent))
+                else:
+                    await conn.send('x')
+                sent += 1
+
+            # Let the client discard anything the server sends back.
+            await asyncio.sleep(0)
+
+    return sent
+
+async def main():
+    parser = argparse.ArgumentParser(description="Measure the server CPU time an abusive client can use.")
+    parser.add_argument('paths', nargs='*',
+                        default=['/echo', '/rate-limit-delay'])
+    parser.add_argument('--mode', choices=['ping', 'message'], default='ping')
+    parser.add_argument('--seconds', type=float, default=5.0)
+    args = parser.parse_args()
+
+    root = make_root("ws")
+    procs = server_processes()
+    if not procs:
+        sys.exit("no running server processes found ({})".format(
+                 ', '.join(SERVER_NAMES)))
+
+    freq = psutil.cpu_freq()
+    hz = (freq.current * 1e6) if freq else 0
+
+    print("{:<24} {:>12} {:>12} {:>14}".format("path", "frames/s",
+                                               "server CPU %", "cycles/frame"))
+    for path in args.paths:
+        before = server_cpu_time(procs)
+        start = time.monotonic()
+
+        sent = await flood(root + path, args.mode, args.seconds)
+
+        elapsed = time.monotonic() - start
+        used = server_cpu_time(procs) - before
+
+        print("{:<24} {:>12.0f} {:>12.1f} {:>14.0f}".format(
+                  path,
+                  sent / elapsed,
+                  100.0 * used / elapsed,
+                  (used * hz / sent) if sent else 0))
+
+if __name__ == '__main__':
+    asyncio.get_event_loop().run_until_complete(main())
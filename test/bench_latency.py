@@ -0,0 +1,84 @@
+#! /usr/bin/env python3
+#
+# Measures WebSocket round-trip latency against one or more echo endpoints on
+# the test server and reports the median and 99th percentile for each.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Usage:
+#
+#     $ make start-test-server
+#     $ cd test
+#     $ ./bench_latency.py [--count N] [--gap SECONDS] [path ...]
+#
+# The default paths are /echo and /echo-busy-poll. The gap between messages
+# lets the server go idle, which is where busy polling makes a difference.
+
+import argparse
+import asyncio
+import statistics
+import sys
+import time
+
+import websockets
+
+sys.path.insert(0, 'pytest')
+from test_fixtures import make_root
+
+def percentile(samples, p):
+    """Returns the pth percentile of a sorted list of samples."""
+    index = min(len(samples) - 1, int(round(p / 100.0 * (len(samples) - 1))))
+    return samples[index]
+
+async def measure(uri, count, gap, payload):
+    samples = []
+
+    async with websockets.connect(uri) as conn:
+        # Warm up the connection before measuring.
+        await conn.send(payload)
+        await conn.recv()
+
+        for _ in range(count):
+            await asyncio.sleep(gap)
+
+            start = time.perf_counter()
+            await conn.send(payload)
+            await conn.recv()
+            samples.append(time.perf_counter() - start)
+
+    return sorted(samples)
+
+async def main():
+    parser = argparse.ArgumentParser(description="Measure WebSocket round-trip latency.")
+    parser.add_argument('paths', nargs='*',
+                        default=['/echo', '/echo-busy-poll'])
+    parser.add_argument('--count', type=int, default=2000)
+    parser.add_argument('--gap', type=float, default=0.001)
+    parser.add_argument('--size', type=int, default=64)
+    args = parser.parse_args()
+
+    root = make_root("ws")
+    payload = 'x' * args.size
+
+    print("{:<24} {:>10} {:>10} {:>10}".format("path", "p50 (us)", "p99 (us)",
+                                              "mean (us)"))
+    for path in args.paths:
+        samples = await measure(root + path, args.count, args.gap, payload)
+        print("{:<24} {:>10.1f} {:>10.1f} {:>10.1f}".format(
+                  path,
+                  percentile(samples, 50) * 1e6,
+                  percentile(samples, 99) * 1e6,
+                  statistics.mean(samples) * 1e6))
+
+if __name__ == '__main__':
+    asyncio.get_event_loop().run_until_complete(main())
@@ -0,0 +1,116 @@
+#! /usr/bin/env python3
+#
+# Measures the server CPU time spent per gigabyte of large published messages,
+# with and without WebSocketZeroCopyMinSize, by flooding a subscribed
+# connection through the pubsub plugin and sampling the CPU time used by the
+# server processes meanwhile.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Usage:
+#
+#     $ make start-test-server
+#     $ cd test
+#     $ ./bench_zerocopy.py [--host HOST] [--megabytes N] [path ...]
+#
+# The default paths are /pubsub and /pubsub-zerocopy. Over loopback the kernel
+# copies zero-copy sends anyway (and the server soon stops making them), so the
+# difference only shows with the client on another machine: point --host at
+# the server from there. Server CPU time can only be sampled when the server
+# runs on the same machine as this script; otherwise only throughput is shown.
+
+import argparse
+import asyncio
+import sys
+import time
+
+import psutil
+import websockets
+
+sys.path.insert(0, 'pytest')
+from test_fixtures import HOST, make_root
+
+SERVER_NAMES = ('httpd', 'apache2')
+
+MESSAGE_SIZE = 65536 # the largest that the pubsub plugin floods with
+BATCH = 64
+
+def server_processes():
+    return [ p for p in psutil.process_iter(['name'])
+             if p.info['name'] in SERVER_NAMES ]
+
+def server_cpu_time(procs):
+    """Returns the total user and system CPU time of the given processes."""
+    total = 0.0
+    for p in procs:
+        try:
+            times = p.cpu_times()
+            total += times.user + times.system
+        except psutil.NoSuchProcess:
+            pass
+    return total
+
+async def receive(uri, total):
+    """Has the given location publish total bytes to us; returns bytes seen."""
+    received = 0
+
+    # Compression would hide the cost of the sends themselves.
+    async with websockets.connect(uri, compression=None,
+                                  max_size=2 * MESSAGE_SIZE) as conn:
+        await conn.send("subscribe bench-zerocopy")
+        await conn.recv()
+
+        while received < total:
+            await conn.send("flood bench-zerocopy {} {}".format(BATCH,
+                                                                MESSAGE_SIZE))
+            for _ in range(BATCH + 1):
+                message = await conn.recv()
+                if isinstance(message, bytes):
+                    received += len(message)
+
+    return received
+
+async def main():
+    parser = argparse.ArgumentParser(description="Measure the server CPU time spent per GB of large published messages.")
+    parser.add_argument('paths', nargs='*',
+                        default=['/pubsub', '/pubsub-zerocopy'])
+    parser.add_argument('--host', default=HOST)
+    parser.add_argument('--megabytes', type=int, default=1024)
+    args = parser.parse_args()
+
+    root = make_root("ws", args.host)
+    procs = server_processes()
+    if not procs:
+        print("no local server processes found ({}); not sampling CPU "
+              "time".format(', '.join(SERVER_NAMES)))
+
+    print("{:<24} {:>10} {:>12} {:>16}".format("path", "MB/s",
+                                               "server CPU %", "CPU s per GB"))
+    for path in args.paths:
+        before = server_cpu_time(procs)
+        start = time.monotonic()
+
+        received = await receive(root + path, args.megabytes * 1024 * 1024)
+
+        elapsed = time.monotonic() - start
+        used = server_cpu_time(procs) - before
+        gigabytes = received / float(1024 ** 3)
+
+        print("{:<24} {:>10.0f} {:>12} {:>16}".format(
+                  path,
+                  received / elapsed / (1024 * 1024),
+                  "{:.1f}".format(100.0 * used / elapsed) if procs else "-",
+                  "{:.3f}".format(used / gigabytes) if procs else "-"))
+
+if __name__ == '__main__':
+    asyncio.get_event_loop().run_until_complete(main())
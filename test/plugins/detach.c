@@ -0,0 +1,116 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "websocket_plugin.h"
+
+#include <string.h>
+
+#include "apr_strings.h"
+#include "httpd.h"
+
+/*
+ * The detach plugin takes over the buffer of every message with
+ * detach_message(), and holds on to it until the next message arrives. It
+ * then sends the previous message back from that buffer, so a client receives
+ * each message one message late:
+ *
+ *     the first message         replies "none"
+ *     an empty message          replies "null", since it can't be detached
+ *
+ * The last message is freed when the client disconnects.
+ */
+
+EXPORT WebSocketPlugin *CALLBACK detach_init(void);
+
+static void *CALLBACK on_connect(const WebSocketServer *);
+static size_t CALLBACK on_message(void *, const WebSocketServer *, int,
+                                  unsigned char *, size_t);
+static void CALLBACK on_disconnect(void *, const WebSocketServer *);
+
+static WebSocketPlugin plugin = {
+    sizeof(WebSocketPlugin),
+    WEBSOCKET_PLUGIN_VERSION_0,
+    NULL, /* destroy */
+    on_connect,
+    on_message,
+    on_disconnect,
+};
+
+extern EXPORT WebSocketPlugin *CALLBACK detach_init(void) { return &plugin; }
+
+struct detach_data
+{
+    WS_Message_Free free_message; /* outlives the server structure */
+    unsigned char *kept;          /* the previous message, if any */
+    size_t kept_size;
+    int kept_type;
+};
+
+static void *CALLBACK on_connect(const WebSocketServer *server)
+{
+    struct detach_data *data;
+
+    /* Refuse the connection if the server can't hand messages over. */
+    if (server->version < WEBSOCKET_SERVER_VERSION_11) {
+        return NULL;
+    }
+
+    data = apr_pcalloc(server->connection_pool(server), sizeof(*data));
+    data->free_message = server->free_message;
+    return data;
+}
+
+static void send_text(const WebSocketServer *server, const char *text)
+{
+    server->send(server, MESSAGE_TYPE_TEXT, (const unsigned char *) text,
+                 strlen(text));
+}
+
+static size_t CALLBACK on_message(void *private, const WebSocketServer *server,
+                                  int type, unsigned char *buf, size_t bufsize)
+{
+    struct detach_data *data = private;
+    unsigned char *detached = server->detach_message(server);
+
+    if (detached == NULL) {
+        send_text(server, "null");
+        return bufsize;
+    }
+
+    /* The buffer is the one the message came in, and it's ours to keep. */
+    if (detached != buf) {
+        send_text(server, "wrong buffer");
+    }
+    else if (data->kept != NULL) {
+        server->send(server, data->kept_type, data->kept, data->kept_size);
+    }
+    else {
+        send_text(server, "none");
+    }
+
+    data->free_message(data->kept);
+    data->kept = detached;
+    data->kept_size = bufsize;
+    data->kept_type = type;
+
+    return bufsize;
+}
+
+static void CALLBACK on_disconnect(void *private,
+                                   const WebSocketServer *server)
+{
+    struct detach_data *data = private;
+
+    data->free_message(data->kept);
+}
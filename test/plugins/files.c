@@ -0,0 +1,107 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "websocket_plugin.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "apr_file_io.h"
+#include "apr_strings.h"
+#include "httpd.h"
+
+/*
+ * The files plugin writes FILE_SIZE bytes to a temporary file when a client
+ * connects, where byte i is (i % 251). The text command
+ *
+ *     file <offset> <length>    sends that part of the file with send_file()
+ *
+ * lets tests check what arrives. Anything else is echoed.
+ */
+
+#define FILE_SIZE (1024 * 1024)
+
+EXPORT WebSocketPlugin *CALLBACK files_init(void);
+
+static void *CALLBACK on_connect(const WebSocketServer *);
+static size_t CALLBACK on_message(void *, const WebSocketServer *, int,
+                                  unsigned char *, size_t);
+
+static WebSocketPlugin plugin = {
+    sizeof(WebSocketPlugin),
+    WEBSOCKET_PLUGIN_VERSION_0,
+    NULL, /* destroy */
+    on_connect,
+    on_message,
+    NULL, /* on_disconnect */
+};
+
+extern EXPORT WebSocketPlugin *CALLBACK files_init(void) { return &plugin; }
+
+static void *CALLBACK on_connect(const WebSocketServer *server)
+{
+    apr_pool_t *pool;
+    apr_file_t *file;
+    const char *tmpdir;
+    char *path;
+    unsigned char *data;
+    apr_size_t i;
+
+    /* Refuse the connection if the server can't send files. */
+    if (server->version < WEBSOCKET_SERVER_VERSION_10) {
+        return NULL;
+    }
+
+    /* The file is closed (and deleted) along with the connection. */
+    pool = server->connection_pool(server);
+
+    if (apr_temp_dir_get(&tmpdir, pool) != APR_SUCCESS) {
+        return NULL;
+    }
+    path = apr_pstrcat(pool, tmpdir, "/websocket-files.XXXXXX", NULL);
+    if (apr_file_mktemp(&file, path, 0, pool) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    data = apr_palloc(pool, FILE_SIZE);
+    for (i = 0; i < FILE_SIZE; ++i) {
+        data[i] = (unsigned char) (i % 251);
+    }
+    if (apr_file_write_full(file, data, FILE_SIZE, NULL) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    return file;
+}
+
+static size_t CALLBACK on_message(void *private, const WebSocketServer *server,
+                                  int type, unsigned char *buf, size_t bufsize)
+{
+    apr_file_t *file = private;
+
+    if ((type == MESSAGE_TYPE_TEXT) && (bufsize > 5) &&
+        !memcmp(buf, "file ", 5)) {
+        char *args = apr_pstrmemdup(server->message_pool(server),
+                                    (const char *) buf + 5, bufsize - 5);
+        char *end;
+        uint64_t offset = strtoull(args, &end, 10);
+        size_t length = strtoul(end, NULL, 10);
+
+        server->send_file(server, MESSAGE_TYPE_BINARY, file, offset, length);
+        return bufsize;
+    }
+
+    server->send(server, type, buf, bufsize);
+    return bufsize;
+}
@@ -0,0 +1,99 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "websocket_plugin.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The flow plugin echoes every message back, except for the text command
+ *
+ *     pause <ms>    replies "paused", then stops reading from the client for
+ *                   <ms> milliseconds
+ *
+ * which lets tests watch inbound flow control at work.
+ */
+
+EXPORT WebSocketPlugin *CALLBACK flow_init(void);
+
+static void *CALLBACK on_connect(const WebSocketServer *);
+static size_t CALLBACK on_message(void *, const WebSocketServer *, int,
+                                  unsigned char *, size_t);
+static void CALLBACK on_disconnect(void *, const WebSocketServer *);
+
+static WebSocketPlugin plugin = {
+    sizeof(WebSocketPlugin),
+    WEBSOCKET_PLUGIN_VERSION_0,
+    NULL, /* destroy */
+    on_connect,
+    on_message,
+    on_disconnect,
+};
+
+extern EXPORT WebSocketPlugin *CALLBACK flow_init(void) { return &plugin; }
+
+struct flow_data
+{
+    struct _WebSocketTimer *resume_timer; /* NULL unless paused */
+};
+
+static void *CALLBACK on_connect(const WebSocketServer *server)
+{
+    /* Refuse the connection if the server can't pause reading. */
+    if (server->version < WEBSOCKET_SERVER_VERSION_8) {
+        return NULL;
+    }
+
+    return calloc(1, sizeof(struct flow_data));
+}
+
+static void CALLBACK on_disconnect(void *private, const WebSocketServer *server)
+{
+    free(private);
+}
+
+static void CALLBACK resume(const WebSocketServer *server, void *private)
+{
+    struct flow_data *data = private;
+
+    server->timer_cancel(server, data->resume_timer);
+    data->resume_timer = NULL;
+
+    server->resume_read(server);
+}
+
+static size_t CALLBACK on_message(void *private, const WebSocketServer *server,
+                                  int type, unsigned char *buf, size_t bufsize)
+{
+    struct flow_data *data = private;
+
+    if ((type == MESSAGE_TYPE_TEXT) && (bufsize > 6) &&
+        !memcmp(buf, "pause ", 6) && (data->resume_timer == NULL)) {
+        char ms[16] = { 0 };
+
+        memcpy(ms, buf + 6, (bufsize - 6 < sizeof(ms)) ? (bufsize - 6)
+                                                        : (sizeof(ms) - 1));
+
+        server->send(server, MESSAGE_TYPE_TEXT,
+                     (const unsigned char *) "paused", 6);
+        server->pause_read(server);
+        data->resume_timer = server->timer_add(server, atoi(ms), resume, data);
+
+        return bufsize;
+    }
+
+    server->send(server, type, buf, bufsize);
+    return bufsize;
+}
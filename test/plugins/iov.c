@@ -0,0 +1,80 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "websocket_plugin.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "apr_strings.h"
+#include "httpd.h"
+
+/*
+ * The iov plugin takes messages in pieces with on_message_iov(), and has no
+ * on_message() at all. It echoes every message, put back together, and then
+ * replies "pieces <count>" to tell how many pieces the message came in.
+ */
+
+EXPORT WebSocketPlugin *CALLBACK iov_init(void);
+
+static void *CALLBACK on_connect(const WebSocketServer *);
+static size_t CALLBACK on_message_iov(void *, const WebSocketServer *, int,
+                                      WebSocketIovec *, size_t, size_t);
+
+static WebSocketPlugin plugin = {
+    sizeof(WebSocketPlugin),
+    WEBSOCKET_PLUGIN_VERSION_2,
+    NULL, /* destroy */
+    on_connect,
+    NULL, /* on_message */
+    NULL, /* on_disconnect */
+    NULL, /* on_writable */
+    on_message_iov,
+};
+
+extern EXPORT WebSocketPlugin *CALLBACK iov_init(void) { return &plugin; }
+
+static void *CALLBACK on_connect(const WebSocketServer *server)
+{
+    /* Refuse the connection if the server doesn't provide the pools. */
+    if (server->version < WEBSOCKET_SERVER_VERSION_9) {
+        return NULL;
+    }
+    return &plugin;
+}
+
+static size_t CALLBACK on_message_iov(void *private,
+                                      const WebSocketServer *server,
+                                      int type, WebSocketIovec *iov,
+                                      size_t iov_count, size_t message_size)
+{
+    unsigned char *message = apr_palloc(server->message_pool(server),
+                                        message_size + 1);
+    size_t offset = 0;
+    size_t i;
+    char reply[64];
+
+    for (i = 0; i < iov_count; ++i) {
+        memcpy(message + offset, iov[i].buffer, iov[i].buffer_size);
+        offset += iov[i].buffer_size;
+    }
+
+    server->send(server, type, message, offset);
+
+    snprintf(reply, sizeof(reply), "pieces %lu", (unsigned long) iov_count);
+    server->send(server, MESSAGE_TYPE_TEXT, (const unsigned char *) reply,
+                 strlen(reply));
+
+    return message_size;
+}
@@ -0,0 +1,97 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "websocket_plugin.h"
+
+#include "apr_strings.h"
+#include "httpd.h"
+
+/*
+ * The pools plugin echoes every message back, copying it into the message pool
+ * first, and keeps its own state in the connection pool. The text command
+ *
+ *     clears    replies "<messages> <clears>": how many messages were handled
+ *               before this one, and how many times the message pool was
+ *               cleared meanwhile
+ *
+ * lets tests check that the message pool is cleared after every message.
+ */
+
+EXPORT WebSocketPlugin *CALLBACK pools_init(void);
+
+static void *CALLBACK on_connect(const WebSocketServer *);
+static size_t CALLBACK on_message(void *, const WebSocketServer *, int,
+                                  unsigned char *, size_t);
+
+static WebSocketPlugin plugin = {
+    sizeof(WebSocketPlugin),
+    WEBSOCKET_PLUGIN_VERSION_0,
+    NULL, /* destroy */
+    on_connect,
+    on_message,
+    NULL, /* on_disconnect */
+};
+
+extern EXPORT WebSocketPlugin *CALLBACK pools_init(void) { return &plugin; }
+
+struct pools_data
+{
+    unsigned long messages; /* handled so far */
+    unsigned long clears;   /* of the message pool */
+};
+
+static void *CALLBACK on_connect(const WebSocketServer *server)
+{
+    /* Refuse the connection if the server doesn't provide the pools. */
+    if (server->version < WEBSOCKET_SERVER_VERSION_9) {
+        return NULL;
+    }
+
+    /* Nothing to free in on_disconnect(); the pool goes with the connection. */
+    return apr_pcalloc(server->connection_pool(server),
+                       sizeof(struct pools_data));
+}
+
+static apr_status_t count_clear(void *private)
+{
+    struct pools_data *data = private;
+
+    data->clears++;
+    return APR_SUCCESS;
+}
+
+static size_t CALLBACK on_message(void *private, const WebSocketServer *server,
+                                  int type, unsigned char *buf, size_t bufsize)
+{
+    struct pools_data *data = private;
+    apr_pool_t *pool = server->message_pool(server);
+
+    apr_pool_cleanup_register(pool, data, count_clear,
+                              apr_pool_cleanup_null);
+
+    if ((type == MESSAGE_TYPE_TEXT) && (bufsize == 6) &&
+        !memcmp(buf, "clears", 6)) {
+        const char *reply = apr_psprintf(pool, "%lu %lu", data->messages,
+                                         data->clears);
+
+        server->send(server, MESSAGE_TYPE_TEXT, (const unsigned char *) reply,
+                     strlen(reply));
+    }
+    else {
+        server->send(server, type, apr_pmemdup(pool, buf, bufsize), bufsize);
+    }
+
+    data->messages++;
+    return bufsize;
+}
@@ -0,0 +1,72 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "websocket_plugin.h"
+
+/*
+ * The prepared plugin echoes every message three times: first as a prepared
+ * message, then with a regular send, then as the same prepared message again.
+ * Interleaving the two kinds of sends checks that a connection's compression
+ * state stays in step with the client's.
+ */
+
+EXPORT WebSocketPlugin *CALLBACK prepared_init(void);
+
+static void *CALLBACK on_connect(const WebSocketServer *);
+static size_t CALLBACK on_message(void *, const WebSocketServer *, int,
+                                  unsigned char *, size_t);
+
+static WebSocketPlugin plugin = {
+    sizeof(WebSocketPlugin),
+    WEBSOCKET_PLUGIN_VERSION_0,
+    NULL, /* destroy */
+    on_connect,
+    on_message,
+    NULL, /* on_disconnect */
+};
+
+extern EXPORT WebSocketPlugin *CALLBACK prepared_init(void) { return &plugin; }
+
+static void *CALLBACK on_connect(const WebSocketServer *server)
+{
+    /* Refuse the connection if the server is too old for prepared messages. */
+    if (server->version < WEBSOCKET_SERVER_VERSION_3) {
+        return NULL;
+    }
+
+    return (void *) server;
+}
+
+static size_t CALLBACK on_message(void *private, const WebSocketServer *server,
+                                  int type, unsigned char *buf, size_t bufsize)
+{
+    struct _WebSocketPreparedMessage *msg;
+
+    if ((type != MESSAGE_TYPE_TEXT) && (type != MESSAGE_TYPE_BINARY)) {
+        return 0;
+    }
+
+    msg = server->prepare_message(server, type, buf, bufsize);
+    if (!msg) {
+        return 0;
+    }
+
+    server->send_prepared(server, msg);
+    server->send(server, type, buf, bufsize);
+    server->send_prepared(server, msg);
+
+    server->release_message(server, msg);
+
+    return bufsize;
+}
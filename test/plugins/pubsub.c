@@ -0,0 +1,238 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "websocket_plugin.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "apr_time.h"
+
+/*
+ * The pubsub plugin exposes the server's publish/subscribe hub through a few
+ * text commands:
+ *
+ *     subscribe <topic>          replies "subscribed"
+ *     unsubscribe <topic>        replies "unsubscribed"
+ *     publish <topic> <message>  replies "published <count>"
+ *     burst <topic> <key> <n>    publishes "0" to "<n-1>" under one conflation
+ *                                key, then replies "published"
+ *     conflate <key> <n>         sends "0" to "<n-1>" to this connection under
+ *                                one conflation key, then replies "sent"
+ *     flood <topic> <n> <size>   publishes <n> binary messages of <size> bytes,
+ *                                then replies "flooded <total count>"
+ *     expiring <topic> <ttl> <wait>
+ *                                publishes "expiring" with a TTL of <ttl> ms,
+ *                                and waits <wait> ms before replying
+ *                                "published <count>"
+ *     pending                    replies "pending <bytes>"
+ *
+ * Once a connection that backed up drains again, the plugin sends it
+ * "writable".
+ *
+ * Topic names and keys may not contain spaces. Since the bursts are queued
+ * from within on_message(), before the connection can write any of them,
+ * conflation leaves only the last message of each burst.
+ */
+
+EXPORT WebSocketPlugin *CALLBACK pubsub_init(void);
+
+static void *CALLBACK on_connect(const WebSocketServer *);
+static size_t CALLBACK on_message(void *, const WebSocketServer *, int,
+                                  unsigned char *, size_t);
+static void CALLBACK on_writable(void *, const WebSocketServer *);
+
+static WebSocketPlugin plugin = {
+    sizeof(WebSocketPlugin),
+    WEBSOCKET_PLUGIN_VERSION_1,
+    NULL, /* destroy */
+    on_connect,
+    on_message,
+    NULL, /* on_disconnect */
+    on_writable,
+};
+
+extern EXPORT WebSocketPlugin *CALLBACK pubsub_init(void) { return &plugin; }
+
+static void *CALLBACK on_connect(const WebSocketServer *server)
+{
+    /* Refuse the connection if the server is too old for the hub. */
+    if (server->version < WEBSOCKET_SERVER_VERSION_7) {
+        return NULL;
+    }
+
+    return (void *) server;
+}
+
+static void send_text(const WebSocketServer *server, const char *text)
+{
+    server->send(server, MESSAGE_TYPE_TEXT, (const unsigned char *) text,
+                 strlen(text));
+}
+
+static size_t CALLBACK on_message(void *private, const WebSocketServer *server,
+                                  int type, unsigned char *buf, size_t bufsize)
+{
+    char topic[256];
+    char rest[256];
+    const char *cmd = (const char *) buf;
+    const char *arg;
+    size_t len;
+
+    if (type != MESSAGE_TYPE_TEXT) {
+        return 0;
+    }
+
+    if ((bufsize == 7) && !memcmp(cmd, "pending", 7)) {
+        char reply[64];
+
+        snprintf(reply, sizeof(reply), "pending %lu",
+                 (unsigned long) server->pending_bytes(server));
+        send_text(server, reply);
+        return bufsize;
+    }
+
+    /* Split the command from its topic. */
+    arg = memchr(cmd, ' ', bufsize);
+    if (!arg) {
+        return 0;
+    }
+    arg++;
+
+    len = bufsize - (arg - cmd);
+    if (memchr(arg, ' ', len)) {
+        len = (const char *) memchr(arg, ' ', len) - arg;
+    }
+    if (len >= sizeof(topic)) {
+        return 0;
+    }
+    memcpy(topic, arg, len);
+    topic[len] = '\0';
+
+    /* Keep whatever follows the topic, for the commands with more arguments. */
+    rest[0] = '\0';
+    if (bufsize > (size_t) (arg - cmd) + len) {
+        size_t rest_len = bufsize - (arg - cmd) - len - 1;
+
+        if (rest_len < sizeof(rest)) {
+            memcpy(rest, arg + len + 1, rest_len);
+            rest[rest_len] = '\0';
+        }
+    }
+
+    if (!strncmp(cmd, "subscribe ", 10)) {
+        if (server->subscribe(server, topic)) {
+            send_text(server, "subscribed");
+        }
+    }
+    else if (!strncmp(cmd, "unsubscribe ", 12)) {
+        server->unsubscribe(server, topic);
+        send_text(server, "unsubscribed");
+    }
+    else if (!strncmp(cmd, "burst ", 6) || !strncmp(cmd, "conflate ", 9)) {
+        char key[64];
+        unsigned int count, i;
+        int burst = (cmd[0] == 'b');
+
+        /* For conflate, the "topic" is actually the key. */
+        if (burst ? (sscanf(rest, "%63s %u", key, &count) != 2)
+                  : (sscanf(rest, "%u", &count) != 1)) {
+            return 0;
+        }
+
+        for (i = 0; i < count; ++i) {
+            char value[16];
+            int value_len = snprintf(value, sizeof(value), "%u", i);
+
+            if (burst) {
+                server->publish_conflated(server, topic, key,
+                                          MESSAGE_TYPE_TEXT,
+                                          (const unsigned char *) value,
+                                          value_len);
+            }
+            else {
+                server->send_conflated(server, topic, MESSAGE_TYPE_TEXT,
+                                       (const unsigned char *) value,
+                                       value_len);
+            }
+        }
+
+        send_text(server, burst ? "published" : "sent");
+    }
+    else if (!strncmp(cmd, "flood ", 6)) {
+        static unsigned char payload[65536];
+        unsigned int count, size, i;
+        size_t published = 0;
+        char reply[64];
+
+        if ((sscanf(rest, "%u %u", &count, &size) != 2) ||
+            (size > sizeof(payload))) {
+            return 0;
+        }
+
+        memset(payload, 'x', size);
+        for (i = 0; i < count; ++i) {
+            published += server->publish(server, topic, MESSAGE_TYPE_BINARY,
+                                         payload, size);
+        }
+
+        snprintf(reply, sizeof(reply), "flooded %lu", (unsigned long) published);
+        send_text(server, reply);
+    }
+    else if (!strncmp(cmd, "expiring ", 9)) {
+        static const unsigned char payload[] = "expiring";
+        unsigned int ttl, wait;
+        size_t published;
+        char reply[64];
+
+        if (sscanf(rest, "%u %u", &ttl, &wait) != 2) {
+            return 0;
+        }
+
+        published = server->publish_expiring(server, topic, MESSAGE_TYPE_TEXT,
+                                             payload, sizeof(payload) - 1,
+                                             ttl);
+
+        /* Nothing is written while on_message() runs, so this ages it. */
+        apr_sleep(apr_time_from_msec(wait));
+
+        snprintf(reply, sizeof(reply), "published %lu",
+                 (unsigned long) published);
+        send_text(server, reply);
+    }
+    else if (!strncmp(cmd, "publish ", 8)) {
+        const unsigned char *msg = (const unsigned char *) arg + len;
+        size_t msg_len = bufsize - (arg + len - cmd);
+        char reply[64];
+
+        /* Skip the space after the topic. */
+        if (msg_len > 0) {
+            msg++;
+            msg_len--;
+        }
+
+        snprintf(reply, sizeof(reply), "published %lu",
+                 (unsigned long) server->publish(server, topic,
+                                                 MESSAGE_TYPE_TEXT, msg,
+                                                 msg_len));
+        send_text(server, reply);
+    }
+
+    return bufsize;
+}
+
+static void CALLBACK on_writable(void *private, const WebSocketServer *server)
+{
+    send_text(server, "writable");
+}
@@ -61,7 +61,7 @@ async def test_server_version_is_passed_to_plugin(uri):
     async with websockets.connect(uri) as conn:
         resp = await rpc(conn, "version")
 
-    assert resp == "1"
+    assert resp == "11"
 
 async def test_plugin_can_get_and_set_subprotocols(uri):
     subprotocols = [ "a", "b", "c" ]
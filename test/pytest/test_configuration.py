@@ -52,3 +52,16 @@ async def test_untrusted_Origins_are_not_allowed_with_OriginCheck_Trusted(root_u
             pass
 
     assert excinfo.value.status_code == 403
+
+async def test_messages_are_echoed_with_BusyPoll_enabled(root_uri):
+    uri = root_uri + "/echo-busy-poll"
+
+    async with websockets.connect(uri) as conn:
+        for i in range(10):
+            await conn.send(str(i))
+            resp = await asyncio.wait_for(conn.recv(), timeout=1.0)
+            assert resp == str(i)
+
+            # Let the server's spin window expire every other message.
+            if i % 2:
+                await asyncio.sleep(0.1)
@@ -0,0 +1,49 @@
+import asyncio
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+pytestmark = pytest.mark.asyncio
+
+#
+# Helpers
+#
+
+async def recv(conn):
+    return await asyncio.wait_for(conn.recv(), timeout=1.0)
+
+#
+# Tests
+#
+
+@pytest.mark.parametrize("compression", [None, "deflate"])
+async def test_detached_messages_outlive_the_next_message(root_uri,
+                                                          compression):
+    # The plugin sends each message back only once the next one has arrived,
+    # from the buffer it took over.
+    messages = ["hello", b"\x00\x01\x02" * 10000, "x" * 100000, "bye"]
+
+    async with websockets.connect(root_uri + '/detach',
+                                  compression=compression) as conn:
+        await conn.send(messages[0])
+        assert (await recv(conn)) == "none"
+
+        for previous, msg in zip(messages, messages[1:]):
+            await conn.send(msg)
+            assert (await recv(conn)) == previous
+
+async def test_fragmented_messages_can_be_detached(root_uri):
+    async with websockets.connect(root_uri + '/detach') as conn:
+        await conn.send([ b"\x01" * 1000, b"\x02" * 100000, b"\x03" ])
+        assert (await recv(conn)) == "none"
+
+        await conn.send("done")
+        assert (await recv(conn)) == b"\x01" * 1000 + b"\x02" * 100000 + b"\x03"
+
+async def test_empty_messages_cannot_be_detached(root_uri):
+    async with websockets.connect(root_uri + '/detach',
+                                  compression=None) as conn:
+        await conn.send("")
+        assert (await recv(conn)) == "null"
@@ -0,0 +1,42 @@
+import asyncio
+import time
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+pytestmark = pytest.mark.asyncio
+
+#
+# Fixtures
+#
+
+@pytest.fixture
+def uri(root_uri):
+    return root_uri + '/flow'
+
+#
+# Tests
+#
+
+async def test_paused_connections_read_nothing_until_resumed(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("pause 500")
+        await conn.send("hello")
+
+        start = time.monotonic()
+        assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == "paused"
+
+        # The echo can't come back before the plugin resumes reading.
+        assert (await asyncio.wait_for(conn.recv(), timeout=2.0)) == "hello"
+        assert time.monotonic() - start >= 0.4
+
+async def test_resumed_connections_keep_working(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("pause 50")
+        assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == "paused"
+
+        for i in range(10):
+            await conn.send(str(i))
+            assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == str(i)
@@ -0,0 +1,48 @@
+import asyncio
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+pytestmark = pytest.mark.asyncio
+
+#
+# Fixtures
+#
+
+@pytest.fixture
+async def conn(root_uri):
+    async with websockets.connect(root_uri + '/iov') as conn:
+        yield conn
+
+#
+# Helpers
+#
+
+async def recv(conn):
+    return await asyncio.wait_for(conn.recv(), timeout=1.0)
+
+#
+# Tests
+#
+
+async def test_unfragmented_messages_come_in_one_piece(conn):
+    for msg in ["hello", b"\x00\x01\x02" * 10000, ""]:
+        await conn.send(msg)
+        assert (await recv(conn)) == msg
+        assert (await recv(conn)) == "pieces 1"
+
+async def test_large_fragments_come_in_separate_pieces(conn):
+    fragments = [ b"a" * 10000, b"b" * 20000, b"c" * 30000 ]
+
+    await conn.send(fragments)
+    assert (await recv(conn)) == b"".join(fragments)
+    assert (await recv(conn)) == "pieces 3"
+
+async def test_small_fragments_are_gathered(conn):
+    fragments = [ "x" ] * 100 + [ "y" * 10000 ]
+
+    await conn.send(fragments)
+    assert (await recv(conn)) == "".join(fragments)
+    assert (await recv(conn)) == "pieces 1"
@@ -0,0 +1,68 @@
+import asyncio
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+CLOSE_CODE_GOING_AWAY = 1001
+
+pytestmark = pytest.mark.asyncio
+
+#
+# Helpers
+#
+
+class SilentProtocol(websockets.client.WebSocketClientProtocol):
+    """
+    A WebSocketClientProtocol that never answers pings, like a client that has
+    silently dropped off the network.
+
+    XXX This class overrides an internal API that isn't guaranteed to remain
+    stable.
+    """
+    async def pong(self, data=b''):
+        pass
+
+#
+# Tests
+#
+
+async def test_server_pings_quiet_clients_with_PingInterval(root_uri):
+    uri = root_uri + "/keepalive"
+
+    async with websockets.connect(uri) as conn:
+        # The client answers the server's pings automatically, so the
+        # connection must survive well past the 200ms interval.
+        await asyncio.sleep(1.0)
+
+        await conn.send("still here")
+        resp = await asyncio.wait_for(conn.recv(), timeout=1.0)
+        assert resp == "still here"
+
+async def test_unanswered_pings_close_the_connection_with_PingInterval(root_uri):
+    uri = root_uri + "/keepalive"
+
+    async with websockets.connect(uri, create_protocol=SilentProtocol) as conn:
+        await asyncio.wait_for(conn.wait_closed(), timeout=2.0)
+
+    assert conn.close_code == CLOSE_CODE_GOING_AWAY
+
+async def test_idle_connections_are_closed_with_IdleTimeout(root_uri):
+    uri = root_uri + "/idle-timeout"
+
+    async with websockets.connect(uri) as conn:
+        await asyncio.wait_for(conn.wait_closed(), timeout=2.0)
+
+    assert conn.close_code == CLOSE_CODE_GOING_AWAY
+
+async def test_messages_reset_the_IdleTimeout(root_uri):
+    uri = root_uri + "/idle-timeout"
+
+    async with websockets.connect(uri) as conn:
+        for _ in range(4):
+            await asyncio.sleep(0.3)
+            await conn.send("ping")
+            await asyncio.wait_for(conn.recv(), timeout=1.0)
+
+        assert conn.open
@@ -127,6 +127,23 @@ async def test_overflowing_fragmented_messages_are_rejected_when_using_MaxMessag
 
     assert conn.close_code == CLOSE_CODE_MESSAGE_TOO_BIG
 
+async def test_messages_over_MaxBufferedMemory_are_rejected(root_uri):
+    # /echo allows 32 MB messages, but the server only has 16 MB to buffer
+    # them in.
+    async with websockets.connect(root_uri + "/echo",
+                                  create_protocol=WebSocketDebugProtocol) as conn:
+        # As above, the server should reject the frame based on its header.
+        frame = b''.join([
+            b'\x82', # FIN bit set, no RSVx bits, opcode 2 (binary)
+            b'\xFF', # MASK bit set, length of "127" (the 8-byte flag value)
+            struct.pack("!Q", 20 * 1024 * 1024)
+        ])
+
+        conn.direct_write(frame)
+        await asyncio.wait_for(conn.wait_closed(), timeout=1.0)
+
+    assert conn.close_code == CLOSE_CODE_MESSAGE_TOO_BIG
+
 async def test_several_messages_under_the_MaxMessageSize_are_allowed(conn):
     await conn.send('1234')
     await conn.send('1234')
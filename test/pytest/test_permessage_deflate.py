@@ -0,0 +1,139 @@
+import asyncio
+import os
+
+import aiohttp
+import pytest
+import websockets
+from websockets.extensions.permessage_deflate import ClientPerMessageDeflateFactory
+
+from test_fixtures import root_uri, make_root
+from test_opening_handshake import websocket_headers
+
+pytestmark = pytest.mark.asyncio
+
+#
+# Helpers
+#
+
+def deflate_extensions(**kwargs):
+    return [ ClientPerMessageDeflateFactory(**kwargs) ]
+
+# Something that compresses well, like our JSON payloads do.
+COMPRESSIBLE = '{"symbol": "ABC", "bid": 101.25, "ask": 101.5}' * 1000
+
+#
+# Fixtures
+#
+
+@pytest.fixture
+async def http():
+    async with aiohttp.ClientSession() as client:
+        yield client
+
+#
+# Tests
+#
+
+@pytest.mark.parametrize("offer,accepted", [
+    ("permessage-deflate",
+     "permessage-deflate"),
+    ("permessage-deflate; server_no_context_takeover",
+     "permessage-deflate; server_no_context_takeover"),
+    ("permessage-deflate; client_no_context_takeover",
+     "permessage-deflate; client_no_context_takeover"),
+    ("permessage-deflate; server_max_window_bits=10",
+     "permessage-deflate; server_max_window_bits=10"),
+    ("permessage-deflate; server_max_window_bits=\"12\"",
+     "permessage-deflate; server_max_window_bits=12"),
+    ("permessage-deflate; client_max_window_bits",
+     "permessage-deflate"),
+    ("x-unknown-extension, permessage-deflate",
+     "permessage-deflate"),
+    ("permessage-deflate; server_max_window_bits=8, permessage-deflate",
+     "permessage-deflate"),
+])
+async def test_permessage_deflate_is_negotiated(http, offer, accepted):
+    headers = websocket_headers()
+    headers["Sec-WebSocket-Extensions"] = offer
+
+    async with http.get(make_root() + "/echo", headers=headers) as resp:
+        assert resp.status == 101
+        assert resp.headers.getall("Sec-WebSocket-Extensions") == [accepted]
+
+@pytest.mark.parametrize("offer", [
+    "x-unknown-extension",
+    "permessage-deflate; unknown_param",
+    "permessage-deflate; server_max_window_bits",
+    "permessage-deflate; server_max_window_bits=16",
+    "permessage-deflate; server_max_window_bits=09",
+    "permessage-deflate; server_no_context_takeover=1",
+    "permessage-deflate; client_no_context_takeover; client_no_context_takeover",
+    "permessage-deflate;;",
+])
+async def test_unacceptable_offers_are_declined(http, offer):
+    headers = websocket_headers()
+    headers["Sec-WebSocket-Extensions"] = offer
+
+    async with http.get(make_root() + "/echo", headers=headers) as resp:
+        assert resp.status == 101
+        assert "Sec-WebSocket-Extensions" not in resp.headers
+
+async def test_permessage_deflate_is_off_by_default(root_uri):
+    async with websockets.connect(root_uri + "/echo-allow-reserved") as conn:
+        assert conn.extensions == []
+
+        await conn.send(COMPRESSIBLE)
+        assert (await conn.recv()) == COMPRESSIBLE
+
+@pytest.mark.parametrize("params", [
+    {},
+    { "server_no_context_takeover": True, "client_no_context_takeover": True },
+    { "server_max_window_bits": 9, "client_max_window_bits": 9 },
+])
+async def test_compressed_messages_are_echoed(root_uri, params):
+    extensions = deflate_extensions(**params)
+
+    async with websockets.connect(root_uri + "/echo",
+                                  extensions=extensions) as conn:
+        assert len(conn.extensions) == 1
+
+        # Send a few messages, so that context takeover (or the lack of it) is
+        # exercised in both directions.
+        for i in range(3):
+            msg = COMPRESSIBLE + str(i)
+
+            await conn.send(msg)
+            assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == msg
+
+            await conn.send(msg.encode('utf-8'))
+            assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == msg.encode('utf-8')
+
+async def test_compressed_fragmented_messages_are_echoed(root_uri):
+    async def fragmented_message():
+        for _ in range(10):
+            yield COMPRESSIBLE
+
+    async with websockets.connect(root_uri + "/echo") as conn:
+        await conn.send(fragmented_message())
+        resp = await asyncio.wait_for(conn.recv(), timeout=1.0)
+
+        assert resp == COMPRESSIBLE * 10
+
+async def test_uncompressed_and_pooled_messages_are_echoed(root_uri):
+    # Short and incompressible messages are sent uncompressed, and connections
+    # without context takeover share compression state; none of that should
+    # be visible to the client.
+    messages = [ "short", os.urandom(4096), COMPRESSIBLE, b"", os.urandom(100),
+                 COMPRESSIBLE ]
+
+    async def echo_all():
+        extensions = deflate_extensions(server_no_context_takeover=True,
+                                        client_no_context_takeover=True)
+
+        async with websockets.connect(root_uri + "/echo",
+                                      extensions=extensions) as conn:
+            for msg in messages:
+                await conn.send(msg)
+                assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == msg
+
+    await asyncio.gather(*[ echo_all() for _ in range(5) ])
@@ -0,0 +1,67 @@
+import asyncio
+import struct
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+OPCODE_PING = 0x9
+OPCODE_PONG = 0xA
+
+pytestmark = pytest.mark.asyncio
+
+#
+# Helpers
+#
+
+class PongCountingProtocol(websockets.client.WebSocketClientProtocol):
+    """
+    A WebSocketClientProtocol that records the payload of every pong it
+    receives, and additionally allows arbitrary data to be written to the
+    transport.
+
+    XXX This class uses internal APIs that aren't guaranteed to remain stable.
+    """
+    def __init__(self, *args, **kwargs):
+        super().__init__(*args, **kwargs)
+        self.pongs = []
+
+    async def read_frame(self, max_size):
+        frame = await super().read_frame(max_size)
+        if frame.opcode == OPCODE_PONG:
+            self.pongs.append(frame.data)
+        return frame
+
+    def direct_write(self, data: bytes):
+        self.transport.write(data)
+
+def ping_frame(payload: bytes):
+    """Returns a masked ping frame. The all-zero mask leaves payload as-is."""
+    return struct.pack("!BB", 0x80 | OPCODE_PING, 0x80 | len(payload)) + \
+           b"\x00\x00\x00\x00" + payload
+
+#
+# Tests
+#
+
+async def test_pings_are_answered_with_their_payload(root_uri):
+    async with websockets.connect(root_uri + "/echo",
+                                  create_protocol=PongCountingProtocol) as conn:
+        await asyncio.wait_for(await conn.ping("1234"), timeout=1.0)
+
+        assert conn.pongs == [b"1234"]
+
+async def test_only_the_latest_of_several_pings_is_answered(root_uri):
+    async with websockets.connect(root_uri + "/echo",
+                                  create_protocol=PongCountingProtocol) as conn:
+        # Send the pings in a single write, so that the server reads them in a
+        # single batch.
+        conn.direct_write(b"".join(ping_frame(str(i).encode())
+                                   for i in range(10)))
+
+        # The echo comes after the pong, if any.
+        await conn.send("done")
+        assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == "done"
+
+        assert conn.pongs == [b"9"]
@@ -0,0 +1,34 @@
+import asyncio
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+pytestmark = pytest.mark.asyncio
+
+#
+# Fixtures
+#
+
+@pytest.fixture
+async def conn(root_uri):
+    async with websockets.connect(root_uri + '/pools') as conn:
+        yield conn
+
+#
+# Tests
+#
+
+async def test_messages_copied_into_the_message_pool_are_sent_intact(conn):
+    for msg in ["hello", b"\x00\x01\x02", ""]:
+        await conn.send(msg)
+        assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == msg
+
+async def test_message_pool_is_cleared_after_every_message(conn):
+    for i in range(100):
+        await conn.send(str(i))
+        assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == str(i)
+
+    await conn.send("clears")
+    assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == "100 100"
@@ -0,0 +1,43 @@
+import asyncio
+import os
+
+import pytest
+import websockets
+from websockets.extensions.permessage_deflate import ClientPerMessageDeflateFactory
+
+from test_fixtures import root_uri
+
+#
+# Fixtures
+#
+
+@pytest.fixture
+def uri(root_uri):
+    return root_uri + '/prepared'
+
+#
+# Tests
+#
+
+pytestmark = pytest.mark.asyncio
+
+COMPRESSIBLE = '{"symbol": "ABC", "bid": 101.25, "ask": 101.5}' * 100
+
+@pytest.mark.parametrize("extensions", [
+    [],
+    [ ClientPerMessageDeflateFactory() ],
+    [ ClientPerMessageDeflateFactory(server_no_context_takeover=True) ],
+    [ ClientPerMessageDeflateFactory(server_max_window_bits=10) ],
+], ids=["uncompressed", "context-takeover", "no-context-takeover",
+        "small-window"])
+async def test_prepared_messages_are_sent(uri, extensions):
+    # The plugin echoes each message three times, alternating between a
+    # prepared message and a regular send.
+    messages = [ COMPRESSIBLE, "short", os.urandom(1000), b"", COMPRESSIBLE ]
+
+    async with websockets.connect(uri, extensions=extensions) as conn:
+        for msg in messages:
+            await conn.send(msg)
+
+            for _ in range(3):
+                assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == msg
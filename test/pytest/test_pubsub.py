@@ -0,0 +1,174 @@
+import asyncio
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+#
+# Helpers
+#
+
+async def recv_all(conn, count):
+    """Receives the given number of messages, waiting one second for each."""
+    return [ await asyncio.wait_for(conn.recv(), timeout=1.0)
+             for _ in range(count) ]
+
+#
+# Fixtures
+#
+
+@pytest.fixture
+def uri(root_uri):
+    return root_uri + '/pubsub'
+
+#
+# Tests
+#
+
+pytestmark = pytest.mark.asyncio
+
+# The hub is per child process, and depending on the MPM, separate connections
+# may be served by separate children. So these tests publish to topics that the
+# publishing connection is itself subscribed to.
+
+async def test_publish_without_subscribers_reaches_nobody(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("publish nobody-here hello")
+        assert (await recv_all(conn, 1)) == ["published 0"]
+
+async def test_published_messages_reach_subscribers(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("subscribe news")
+        assert (await recv_all(conn, 1)) == ["subscribed"]
+
+        # The published message and the reply to the publish command are sent
+        # separately, so they may arrive in either order.
+        await conn.send("publish news hello there")
+        assert sorted(await recv_all(conn, 2)) == ["hello there", "published 1"]
+
+        await conn.send("unsubscribe news")
+        assert (await recv_all(conn, 1)) == ["unsubscribed"]
+
+        await conn.send("publish news again")
+        assert (await recv_all(conn, 1)) == ["published 0"]
+
+async def test_subscribing_twice_delivers_once(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("subscribe twice")
+        await conn.send("subscribe twice")
+        assert (await recv_all(conn, 2)) == ["subscribed", "subscribed"]
+
+        await conn.send("publish twice once")
+        assert sorted(await recv_all(conn, 2)) == ["once", "published 1"]
+
+async def test_published_messages_keep_their_order(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("subscribe ordered")
+        await recv_all(conn, 1)
+
+        for i in range(100):
+            await conn.send("publish ordered {}".format(i))
+
+        messages = await recv_all(conn, 200)
+        published = [ m for m in messages if not m.startswith("published") ]
+
+        assert published == [ str(i) for i in range(100) ]
+
+# The conflating commands queue their whole burst from within the plugin's
+# on_message() callback, before the connection gets a chance to write any of
+# it, so only the last message of the burst should be sent.
+
+async def test_conflated_sends_keep_only_the_latest(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("conflate price 100")
+        assert sorted(await recv_all(conn, 2)) == ["99", "sent"]
+
+        with pytest.raises(asyncio.TimeoutError):
+            await recv_all(conn, 1)
+
+async def test_conflated_publishes_keep_only_the_latest(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("subscribe quotes")
+        assert (await recv_all(conn, 1)) == ["subscribed"]
+
+        await conn.send("burst quotes price 50")
+        assert sorted(await recv_all(conn, 2)) == ["49", "published"]
+
+        # A burst under a different key is not folded into the first.
+        await conn.send("burst quotes volume 10")
+        assert sorted(await recv_all(conn, 2)) == ["9", "published"]
+
+async def test_expiring_messages_are_sent_in_time(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("subscribe fresh")
+        assert (await recv_all(conn, 1)) == ["subscribed"]
+
+        await conn.send("expiring fresh 5000 0")
+        assert sorted(await recv_all(conn, 2)) == ["expiring", "published 1"]
+
+async def test_expired_messages_are_dropped(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("subscribe stale")
+        assert (await recv_all(conn, 1)) == ["subscribed"]
+
+        # The plugin holds up the connection past the message's deadline.
+        await conn.send("expiring stale 20 200")
+        assert (await recv_all(conn, 1)) == ["published 1"]
+
+        with pytest.raises(asyncio.TimeoutError):
+            await recv_all(conn, 1)
+
+async def test_backed_up_connections_are_told_when_writable(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("subscribe backlog")
+        assert (await recv_all(conn, 1)) == ["subscribed"]
+
+        # 100 KiB is queued before the connection can write any of it, which is
+        # past the default WebSocketLowWatermark of 64 KiB.
+        await conn.send("flood backlog 100 1024")
+
+        messages = await recv_all(conn, 102)
+        assert "flooded 100" in messages
+        assert messages[-1] == "writable"
+
+        await conn.send("pending")
+        assert (await recv_all(conn, 1)) == ["pending 0"]
+
+async def test_published_messages_reach_every_process(uri):
+    # With several children (or a multi-process MPM), these connections are
+    # likely to be spread across processes; the broadcast bus should reach
+    # them all.
+    subscribers = [ await websockets.connect(uri) for _ in range(8) ]
+
+    try:
+        for conn in subscribers:
+            await conn.send("subscribe everywhere")
+            assert (await recv_all(conn, 1)) == ["subscribed"]
+
+        async with websockets.connect(uri) as publisher:
+            await publisher.send("publish everywhere hello")
+            await recv_all(publisher, 1)
+
+        for conn in subscribers:
+            assert (await recv_all(conn, 1)) == ["hello"]
+
+    finally:
+        for conn in subscribers:
+            await conn.close()
+
+async def test_zero_copy_sends_arrive_intact(root_uri):
+    # Over loopback, the kernel ends up copying the data anyway and the server
+    # stops using zero-copy sends partway; both kinds of send must be intact.
+    async with websockets.connect(root_uri + '/pubsub-zerocopy') as conn:
+        await conn.send("subscribe zerocopy")
+        assert (await recv_all(conn, 1)) == ["subscribed"]
+
+        for _ in range(2):
+            await conn.send("flood zerocopy 32 65536")
+
+            messages = await recv_all(conn, 33)
+            assert "flooded 32" in messages
+
+            messages.remove("flooded 32")
+            assert messages == [ b"x" * 65536 ] * 32
@@ -0,0 +1,67 @@
+import asyncio
+import time
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+CLOSE_CODE_POLICY_VIOLATION = 1008
+
+pytestmark = pytest.mark.asyncio
+
+# Both locations allow 20 messages and 10 control frames per second, with a
+# burst of one second's worth.
+
+async def test_clients_within_the_limits_are_unaffected(root_uri):
+    async with websockets.connect(root_uri + "/rate-limit-close") as conn:
+        for i in range(10):
+            await conn.send(str(i))
+            assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == str(i)
+
+        await asyncio.wait_for(await conn.ping(), timeout=1.0)
+        assert conn.open
+
+async def test_clients_over_the_message_limit_are_slowed_down(root_uri):
+    async with websockets.connect(root_uri + "/rate-limit-delay") as conn:
+        start = time.monotonic()
+
+        for i in range(40):
+            await conn.send(str(i))
+
+        # The second 20 can only be read at 20 per second.
+        for i in range(40):
+            assert (await asyncio.wait_for(conn.recv(), timeout=2.0)) == str(i)
+
+        assert time.monotonic() - start >= 0.8
+        assert conn.open
+
+async def test_clients_over_the_message_limit_are_closed(root_uri):
+    async with websockets.connect(root_uri + "/rate-limit-close") as conn:
+        for i in range(40):
+            await conn.send(str(i))
+
+        with pytest.raises(websockets.exceptions.ConnectionClosed):
+            while True:
+                await asyncio.wait_for(conn.recv(), timeout=1.0)
+
+    assert conn.close_code == CLOSE_CODE_POLICY_VIOLATION
+
+async def test_ping_floods_are_closed(root_uri):
+    async with websockets.connect(root_uri + "/rate-limit-close") as conn:
+        for i in range(40):
+            await conn.ping(str(i))
+
+        await asyncio.wait_for(conn.wait_closed(), timeout=2.0)
+
+    assert conn.close_code == CLOSE_CODE_POLICY_VIOLATION
+
+async def test_pings_over_the_limit_are_still_answered(root_uri):
+    async with websockets.connect(root_uri + "/rate-limit-delay") as conn:
+        for i in range(29):
+            await conn.ping(str(i))
+
+        # The last ping is read late, but its pong (which also acknowledges
+        # every earlier ping) must still arrive.
+        await asyncio.wait_for(await conn.ping("29"), timeout=3.0)
+        assert conn.open
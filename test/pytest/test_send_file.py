@@ -0,0 +1,53 @@
+import asyncio
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+FILE_SIZE = 1024 * 1024
+
+pytestmark = pytest.mark.asyncio
+
+#
+# Helpers
+#
+
+def file_contents(offset, length):
+    """Returns the given part of the files plugin's file."""
+    return bytes((i % 251) for i in range(offset, offset + length))
+
+#
+# Fixtures
+#
+
+@pytest.fixture(params=['/files', '/files-deflate'])
+async def conn(root_uri, request):
+    async with websockets.connect(root_uri + request.param,
+                                  max_size=None) as conn:
+        yield conn
+
+#
+# Tests
+#
+
+@pytest.mark.parametrize("offset, length", [
+    (0, FILE_SIZE),
+    (12345, 1000),
+    (FILE_SIZE - 1, 1),
+    (0, 0),
+])
+async def test_send_file_sends_the_given_part_of_the_file(conn, offset, length):
+    await conn.send("file {} {}".format(offset, length))
+
+    msg = await asyncio.wait_for(conn.recv(), timeout=5.0)
+    assert msg == file_contents(offset, length)
+
+async def test_send_file_keeps_messages_in_order(conn):
+    await conn.send("before")
+    await conn.send("file 100 100")
+    await conn.send("after")
+
+    assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == "before"
+    assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == file_contents(100, 100)
+    assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == "after"
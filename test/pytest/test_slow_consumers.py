@@ -0,0 +1,54 @@
+import asyncio
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+CLOSE_CODE_POLICY_VIOLATION = 1008
+
+pytestmark = pytest.mark.asyncio
+
+#
+# Fixtures
+#
+
+@pytest.fixture
+def uri(root_uri):
+    return root_uri + '/pubsub-limited'
+
+#
+# Tests
+#
+
+# The pubsub plugin's flood command publishes its whole flood from within
+# on_message(), before the connection can write any of it, so everything it
+# publishes to itself counts against WebSocketMaxPendingBytes (64 KiB here).
+
+async def test_connections_within_MaxPendingBytes_are_kept(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("subscribe within-limit")
+        assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == "subscribed"
+
+        await conn.send("flood within-limit 10 1024")
+
+        messages = [ await asyncio.wait_for(conn.recv(), timeout=1.0)
+                     for _ in range(11) ]
+        assert "flooded 10" in messages
+        assert messages.count(b"x" * 1024) == 10
+
+        assert conn.open
+
+async def test_connections_over_MaxPendingBytes_are_closed(uri):
+    async with websockets.connect(uri) as conn:
+        await conn.send("subscribe over-limit")
+        assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == "subscribed"
+
+        await conn.send("flood over-limit 200 1024")
+
+        # Whatever was queued before the limit was hit may still arrive.
+        with pytest.raises(websockets.exceptions.ConnectionClosed):
+            while True:
+                await asyncio.wait_for(conn.recv(), timeout=1.0)
+
+    assert conn.close_code == CLOSE_CODE_POLICY_VIOLATION
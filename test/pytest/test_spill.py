@@ -0,0 +1,54 @@
+import asyncio
+import os
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+pytestmark = pytest.mark.asyncio
+
+#
+# Fixtures
+#
+
+@pytest.fixture
+async def conn(root_uri):
+    """
+    A fixture that returns a connection to an echo endpoint with a
+    SpillThreshold of 64 KiB.
+    """
+    async with websockets.connect(root_uri + "/echo-spill",
+                                  max_size=None) as conn:
+        yield conn
+
+#
+# Tests
+#
+
+async def test_messages_under_the_SpillThreshold_are_echoed(conn):
+    msg = os.urandom(1024)
+
+    await conn.send(msg)
+    assert (await asyncio.wait_for(conn.recv(), timeout=1.0)) == msg
+
+async def test_messages_over_the_SpillThreshold_are_echoed(conn):
+    msg = os.urandom(1024 * 1024 + 1)
+
+    await conn.send(msg)
+    assert (await asyncio.wait_for(conn.recv(), timeout=5.0)) == msg
+
+async def test_fragmented_text_over_the_SpillThreshold_is_echoed(conn):
+    # The threshold is crossed partway through, with some of the message
+    # already in memory.
+    fragments = [ "é" * 20000 for _ in range(10) ]
+
+    await conn.send(fragments)
+    assert (await asyncio.wait_for(conn.recv(), timeout=5.0)) == "".join(fragments)
+
+async def test_spilled_messages_do_not_count_against_MaxBufferedMemory(conn):
+    # The server only has 16 MB to buffer messages in memory.
+    msg = os.urandom(20 * 1024 * 1024)
+
+    await conn.send(msg)
+    assert (await asyncio.wait_for(conn.recv(), timeout=10.0)) == msg
@@ -0,0 +1,45 @@
+import asyncio
+
+import pytest
+import websockets
+
+from test_fixtures import root_uri
+
+#
+# Fixtures
+#
+
+@pytest.fixture
+def uri(root_uri):
+    return root_uri + '/dumb-increment'
+
+#
+# Tests
+#
+
+pytestmark = pytest.mark.asyncio
+
+async def test_timer_callbacks_send_periodic_messages(uri):
+    # The dumb-increment plugin sends an incrementing counter every 50ms from a
+    # timer running on the connection's framing loop.
+    async with websockets.connect(uri, subprotocols=["dumb-increment-protocol"]) as conn:
+        for expected in range(5):
+            msg = await asyncio.wait_for(conn.recv(), timeout=1.0)
+            assert msg == str(expected)
+
+async def test_timer_callbacks_interleave_with_incoming_messages(uri):
+    async with websockets.connect(uri, subprotocols=["dumb-increment-protocol"]) as conn:
+        await asyncio.wait_for(conn.recv(), timeout=1.0)
+        await conn.send("reset\n")
+
+        # Messages already in flight may still arrive, but the counter must
+        # restart from zero shortly after the reset.
+        for _ in range(5):
+            msg = await asyncio.wait_for(conn.recv(), timeout=1.0)
+            if msg == "0":
+                break
+        else:
+            pytest.fail("counter was not reset")
+
+        msg = await asyncio.wait_for(conn.recv(), timeout=1.0)
+        assert msg == "1"
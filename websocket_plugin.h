@@ -17,6 +17,7 @@
 #if !defined(_MOD_WEBSOCKET_H_)
 #define _MOD_WEBSOCKET_H_
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #if defined(__cplusplus)
@@ -73,7 +74,122 @@ extern "C"
     typedef void (CALLBACK * WS_Close)
                  (const struct _WebSocketServer *server);
 
+    struct _WebSocketTimer;
+
+    typedef void (CALLBACK * WS_TimerCallback)
+                 (const struct _WebSocketServer *server,
+                  void *data);
+
+    typedef struct _WebSocketTimer *(CALLBACK * WS_Timer_Add)
+                                    (const struct _WebSocketServer *server,
+                                     const unsigned int interval_ms,
+                                     WS_TimerCallback callback,
+                                     void *data);
+
+    typedef void (CALLBACK * WS_Timer_Cancel)
+                 (const struct _WebSocketServer *server,
+                  struct _WebSocketTimer *timer);
+
+    struct _WebSocketPreparedMessage;
+
+    typedef struct _WebSocketPreparedMessage *(CALLBACK * WS_Message_Prepare)
+                                              (const struct _WebSocketServer *server,
+                                               const int type,
+                                               const unsigned char *buffer,
+                                               const size_t buffer_size);
+
+    typedef size_t (CALLBACK * WS_Send_Prepared)
+                   (const struct _WebSocketServer *server,
+                    struct _WebSocketPreparedMessage *message);
+
+    typedef void (CALLBACK * WS_Message_Release)
+                 (const struct _WebSocketServer *server,
+                  struct _WebSocketPreparedMessage *message);
+
+    typedef int (CALLBACK * WS_Subscribe)
+                (const struct _WebSocketServer *server,
+                 const char *topic);
+
+    typedef void (CALLBACK * WS_Unsubscribe)
+                 (const struct _WebSocketServer *server,
+                  const char *topic);
+
+    typedef size_t (CALLBACK * WS_Publish)
+                   (const struct _WebSocketServer *server,
+                    const char *topic,
+                    const int type,
+                    const unsigned char *buffer,
+                    const size_t buffer_size);
+
+    typedef size_t (CALLBACK * WS_Send_Conflated)
+                   (const struct _WebSocketServer *server,
+                    const char *key,
+                    const int type,
+                    const unsigned char *buffer,
+                    const size_t buffer_size);
+
+    typedef size_t (CALLBACK * WS_Publish_Conflated)
+                   (const struct _WebSocketServer *server,
+                    const char *topic,
+                    const char *key,
+                    const int type,
+                    const unsigned char *buffer,
+                    const size_t buffer_size);
+
+    typedef size_t (CALLBACK * WS_Send_Expiring)
+                   (const struct _WebSocketServer *server,
+                    const int type,
+                    const unsigned char *buffer,
+                    const size_t buffer_size,
+                    const unsigned int ttl_ms);
+
+    typedef size_t (CALLBACK * WS_Publish_Expiring)
+                   (const struct _WebSocketServer *server,
+                    const char *topic,
+                    const int type,
+                    const unsigned char *buffer,
+                    const size_t buffer_size,
+                    const unsigned int ttl_ms);
+
+    typedef size_t (CALLBACK * WS_Pending_Bytes)
+                   (const struct _WebSocketServer *server);
+
+    typedef void (CALLBACK * WS_Read_Pause)
+                 (const struct _WebSocketServer *server);
+
+    typedef void (CALLBACK * WS_Read_Resume)
+                 (const struct _WebSocketServer *server);
+
+    struct apr_pool_t;
+    struct apr_file_t;
+
+    typedef struct apr_pool_t *(CALLBACK * WS_Pool)
+                               (const struct _WebSocketServer *server);
+
+    typedef size_t (CALLBACK * WS_Send_File)
+                   (const struct _WebSocketServer *server,
+                    const int type,
+                    struct apr_file_t *file,
+                    const uint64_t offset,
+                    const size_t length);
+
+    typedef unsigned char *(CALLBACK * WS_Message_Detach)
+                           (const struct _WebSocketServer *server);
+
+    typedef void (CALLBACK * WS_Message_Free)
+                 (unsigned char *buffer);
+
 #define WEBSOCKET_SERVER_VERSION_1 1
+#define WEBSOCKET_SERVER_VERSION_2 2
+#define WEBSOCKET_SERVER_VERSION_3 3
+#define WEBSOCKET_SERVER_VERSION_4 4
+#define WEBSOCKET_SERVER_VERSION_5 5
+#define WEBSOCKET_SERVER_VERSION_6 6
+#define WEBSOCKET_SERVER_VERSION_7 7
+#define WEBSOCKET_SERVER_VERSION_8 8
+#define WEBSOCKET_SERVER_VERSION_9 9
+#define WEBSOCKET_SERVER_VERSION_10 10
+#define WEBSOCKET_SERVER_VERSION_11 11
 
     typedef struct _WebSocketServer
     {
@@ -88,6 +204,46 @@ extern "C"
         WS_Protocol_Set protocol_set;
         WS_Send send;
         WS_Close close;
+
+        /* WEBSOCKET_SERVER_VERSION_2 */
+        WS_Timer_Add timer_add;
+        WS_Timer_Cancel timer_cancel;
+
+        /* WEBSOCKET_SERVER_VERSION_3 */
+        WS_Message_Prepare prepare_message;
+        WS_Send_Prepared send_prepared;
+        WS_Message_Release release_message;
+
+        /* WEBSOCKET_SERVER_VERSION_4 */
+        WS_Subscribe subscribe;
+        WS_Unsubscribe unsubscribe;
+        WS_Publish publish;
+
+        /* WEBSOCKET_SERVER_VERSION_5 */
+        WS_Send_Conflated send_conflated;
+        WS_Publish_Conflated publish_conflated;
+
+        /* WEBSOCKET_SERVER_VERSION_6 */
+        WS_Send_Expiring send_expiring;
+        WS_Publish_Expiring publish_expiring;
+
+        /* WEBSOCKET_SERVER_VERSION_7 */
+        WS_Pending_Bytes pending_bytes;
+
+        /* WEBSOCKET_SERVER_VERSION_8 */
+        WS_Read_Pause pause_read;
+        WS_Read_Resume resume_read;
+
+        /* WEBSOCKET_SERVER_VERSION_9 */
+        WS_Pool message_pool;
+        WS_Pool connection_pool;
+
+        /* WEBSOCKET_SERVER_VERSION_10 */
+        WS_Send_File send_file;
+
+        /* WEBSOCKET_SERVER_VERSION_11 */
+        WS_Message_Detach detach_message;
+        WS_Message_Free free_message;
     } WebSocketServer;
 
     struct _WebSocketPlugin;
@@ -112,7 +268,28 @@ extern "C"
                  (void *plugin_private,
                   const WebSocketServer *server);
 
+    typedef void (CALLBACK * WS_OnWritable)
+                 (void *plugin_private,
+                  const WebSocketServer *server);
+
+    /* One piece of a message passed to on_message_iov. */
+    typedef struct _WebSocketIovec
+    {
+        unsigned char *buffer;
+        size_t buffer_size;
+    } WebSocketIovec;
+
+    typedef size_t (CALLBACK * WS_OnMessageIov)
+                   (void *plugin_private,
+                    const WebSocketServer *server,
+                    const int type,
+                    WebSocketIovec *iov,
+                    const size_t iov_count,
+                    const size_t message_size);
+
 #define WEBSOCKET_PLUGIN_VERSION_0 0
+#define WEBSOCKET_PLUGIN_VERSION_1 1
+#define WEBSOCKET_PLUGIN_VERSION_2 2
 
   typedef struct _WebSocketPlugin
   {
@@ -122,6 +299,12 @@ extern "C"
       WS_OnConnect on_connect;
       WS_OnMessage on_message;
       WS_OnDisconnect on_disconnect;
+
+      /* WEBSOCKET_PLUGIN_VERSION_1 */
+      WS_OnWritable on_writable;
+
+      /* WEBSOCKET_PLUGIN_VERSION_2 */
+      WS_OnMessageIov on_message_iov;
   } WebSocketPlugin;
 
 #if defined(__cplusplus)